@@ -0,0 +1,819 @@
+/*
+ * Load generator for the chat server, speaks the wire format of protocol.h.
+ *
+ * Opens many sessions, logs them all in, then lets some of them send CLIENT_2_SERVER messages
+ * at a fixed total rate. Every message carries its send time, so each SERVER_2_CLIENT copy a
+ * session receives gives one send-to-deliver sample. Results are printed as one JSON object on
+ * stdout, progress goes to stderr. --protocol-version 1 speaks the compact encoding of compact.h,
+ * 2 accepts the deflated frames of compress.h on top. --unix PATH connects to the server's AF_UNIX
+ * socket instead of TCP, --seqpacket to its SOCK_SEQPACKET one, which sends one frame per packet.
+ *
+ * Build: gcc -O2 -std=gnu11 -pthread -I../src chatbench.c ../src/util.c -lz -o chatbench
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <zlib.h>
+#include "protocol.h"
+#include "compress.h"
+#include "util.h"
+
+#define BENCH_MAX_EVENTS 256
+// sessions a worker connects per loop iteration, so logins overlap with reading the announcements
+#define BENCH_CONNECT_BATCH 16
+#define BENCH_RECEIVE_BUFFER 8192
+// a version 1 header is at most four bytes
+#define COMPACT_FRAME_MAX (4 + TEXT_MAX)
+
+// log-linear histogram: 2^HISTOGRAM_SUB_BITS buckets per power of two, about 1.5% resolution
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB)
+
+#define PHASE_LOGIN 0
+#define PHASE_RUN 1
+#define PHASE_DRAIN 2
+#define PHASE_STOP 3
+
+typedef struct Histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct Options {
+    const char *host;
+    int port;
+    long sessions;
+    long senders;
+    double rate;
+    double duration;
+    double drain;
+    long threads;
+    long size;
+    const char *prefix;
+    int version;
+    const char *unixPath;
+    int seqpacket;
+} Options;
+
+typedef struct Session {
+    // user name suffix
+    size_t index;
+    int fd;
+    int loggedIn;
+    int sender;
+    uint64_t connectStart;
+    uint64_t nextSend;
+    size_t start;
+    size_t end;
+    unsigned char buffer[BENCH_RECEIVE_BUFFER];
+} Session;
+
+typedef struct Worker {
+    pthread_t thread;
+    int epollFileDescriptor;
+    Session *sessions;
+    size_t count;
+    size_t connected;
+    uint64_t sent;
+    uint64_t sendBlocked;
+    uint64_t delivered;
+    uint64_t bytesReceived;
+    // after every session logged in, without the user list traffic
+    uint64_t runBytesReceived;
+    uint64_t framesByType[USER_REMOVED + 1];
+    uint64_t loginFailed;
+    uint64_t disconnects;
+    Histogram latency;
+    Histogram login;
+    // raw inflate for version 2, reset per frame
+    z_stream inflater;
+} Worker;
+
+static Options options = {
+        .host = "127.0.0.1",
+        .port = 8111,
+        .sessions = 1000,
+        .senders = 10,
+        .rate = 100.0,
+        .duration = 10.0,
+        .drain = 2.0,
+        .threads = 0,
+        .size = 0,
+        .prefix = "b",
+        .version = VERSION,
+        .unixPath = NULL,
+        .seqpacket = 0
+};
+static struct sockaddr_storage serverAddress;
+static socklen_t serverAddressLength;
+static atomic_int phase = PHASE_LOGIN;
+static atomic_long loggedIn = 0;
+static uint64_t runStart;
+// time between two messages of one sender
+static uint64_t sendInterval;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int histogramBucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB) {
+        return (int) value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB + (int) ((value >> shift) - HISTOGRAM_SUB);
+}
+
+// lowest value that falls into the bucket
+static uint64_t histogramValue(int bucket) {
+    if (bucket < HISTOGRAM_SUB) {
+        return (uint64_t) bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB - 1;
+    return (uint64_t) (bucket % HISTOGRAM_SUB + HISTOGRAM_SUB) << shift;
+}
+
+static void histogramRecord(Histogram *histogram, uint64_t value) {
+    histogram->buckets[histogramBucket(value)]++;
+    histogram->count++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+static void histogramMerge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static double histogramPercentile(const Histogram *histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0.0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) histogram->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            return (double) histogramValue(i) / 1000.0;
+        }
+    }
+    return (double) histogram->max / 1000.0;
+}
+
+static void printHistogram(const char *name, const Histogram *histogram) {
+    printf("\"%s\":{\"count\":%" PRIu64 ",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+           name, histogram->count, histogramPercentile(histogram, 50.0), histogramPercentile(histogram, 99.0),
+           histogramPercentile(histogram, 99.9), (double) histogram->max / 1000.0);
+}
+
+static int sendAll(int fd, const void *data, size_t length) {
+    const unsigned char *next = data;
+    while (length > 0) {
+        ssize_t sent = send(fd, next, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        next += sent;
+        length -= (size_t) sent;
+    }
+    return 0;
+}
+
+static int sessionConnect(Worker *worker, Session *session) {
+    message request;
+    struct epoll_event event;
+    int one = 1;
+
+    session->connectStart = now();
+    if ((session->fd = socket(serverAddress.ss_family, options.seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0)) < 0) {
+        errnoPrint("socket()");
+        return -1;
+    }
+    if (serverAddress.ss_family == AF_INET) {
+        setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (connect(session->fd, (struct sockaddr *) &serverAddress, serverAddressLength) < 0) {
+        errnoPrint("connect()");
+        close(session->fd);
+        session->fd = -1;
+        return -1;
+    }
+    memset(&request, 0, sizeof(request));
+    request.messageBody.loginRequest.magic = htonl(MAGIC_LOGIN_REQUEST);
+    request.messageBody.loginRequest.version = (uint8_t) options.version;
+    int nameLength = snprintf(request.messageBody.loginRequest.name, sizeof(request.messageBody.loginRequest.name),
+                              "%s%zu", options.prefix, session->index);
+    request.messageHeader.type = LOGIN_REQUEST;
+    request.messageHeader.length = htons((uint16_t) (sizeof(request.messageBody.loginRequest.magic) +
+                                                     sizeof(request.messageBody.loginRequest.version) +
+                                                     nameLength));
+    if (sendAll(session->fd, &request, sizeof(messageHeader) + ntohs(request.messageHeader.length)) == -1) {
+        errnoPrint("sending login request");
+        close(session->fd);
+        session->fd = -1;
+        return -1;
+    }
+    fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if (epoll_ctl(worker->epollFileDescriptor, EPOLL_CTL_ADD, session->fd, &event) == -1) {
+        errnoPrint("epoll_ctl()");
+        close(session->fd);
+        session->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void sessionClose(Worker *worker, Session *session) {
+    epoll_ctl(worker->epollFileDescriptor, EPOLL_CTL_DEL, session->fd, NULL);
+    close(session->fd);
+    session->fd = -1;
+    if (!session->loggedIn) {
+        // counts as done for the login barrier, it will never log in
+        worker->loginFailed++;
+        atomic_fetch_add(&loggedIn, 1);
+    } else {
+        worker->disconnects++;
+    }
+}
+
+static size_t putVarint(unsigned char *out, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char) value;
+    return length;
+}
+
+// returns the bytes used, 0 if incomplete or longer than max
+static size_t getVarint(const unsigned char *in, size_t available, size_t max, uint64_t *value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < available && i < max; ++i) {
+        result |= (uint64_t) (in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// offset of the text in a SERVER_2_CLIENT body, 0 for server notices or a malformed body
+static size_t textOffset(const unsigned char *frame, uint16_t length) {
+    uint64_t value;
+    size_t offset;
+    size_t used;
+
+    if (options.version == VERSION) {
+        offset = sizeof(uint64_t) + sizeof(((server2Client *) 0)->originalSender);
+        return length > offset && frame[sizeof(uint64_t)] != '\0' ? offset : 0;
+    }
+    // time, then the sender id with the name bit
+    if ((offset = getVarint(frame, length, 10, &value)) == 0 ||
+        (used = getVarint(frame + offset, length - offset, 10, &value)) == 0 || value == 0) {
+        return 0;
+    }
+    offset += used;
+    if (value & 1) {
+        offset += offset < length ? 1 + (size_t) frame[offset] : length;
+    }
+    return offset < length ? offset : 0;
+}
+
+static void handleFrame(Worker *worker, Session *session, const unsigned char *frame, uint16_t length,
+                        uint8_t type, uint64_t receivedAt) {
+    if (type <= USER_REMOVED) {
+        worker->framesByType[type]++;
+    }
+    switch (type) {
+        case LOGIN_RESPONSE:
+            if (length >= 5 && frame[4] == LOGIN_RESPONSE_STATUS_SUCCESS) {
+                session->loggedIn = 1;
+                histogramRecord(&worker->login, receivedAt - session->connectStart);
+                atomic_fetch_add(&loggedIn, 1);
+            } else {
+                errorPrint("login refused with code %d", length >= 5 ? frame[4] : -1);
+            }
+            break;
+        case SERVER_2_CLIENT: {
+            const size_t text = textOffset(frame, length);
+            uint64_t sentAt = 0;
+            size_t i;
+            // server notices have no sender and carry no timestamp
+            if (text == 0) {
+                break;
+            }
+            for (i = text; i < length && frame[i] >= '0' && frame[i] <= '9'; ++i) {
+                sentAt = sentAt * 10 + (uint64_t) (frame[i] - '0');
+            }
+            if (i > text && sentAt >= runStart && sentAt <= receivedAt) {
+                worker->delivered++;
+                histogramRecord(&worker->latency, receivedAt - sentAt);
+            }
+            break;
+        }
+        case HEARTBEAT: {
+            // an idle receiver would be removed by the server otherwise
+            const unsigned char answer[] = {HEARTBEAT, 0};
+            sendAll(session->fd, answer, sizeof(answer));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void sessionReceive(Worker *worker, Session *session) {
+    for (;;) {
+        if (session->start > 0) {
+            memmove(session->buffer, session->buffer + session->start, session->end - session->start);
+            session->end -= session->start;
+            session->start = 0;
+        }
+        ssize_t bytesRead = recv(session->fd, session->buffer + session->end,
+                                 sizeof(session->buffer) - session->end, 0);
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            sessionClose(worker, session);
+            return;
+        }
+        uint64_t receivedAt = now();
+        worker->bytesReceived += (uint64_t) bytesRead;
+        if (atomic_load(&phase) != PHASE_LOGIN) {
+            worker->runBytesReceived += (uint64_t) bytesRead;
+        }
+        session->end += (size_t) bytesRead;
+        while (session->end - session->start >= 2) {
+            const unsigned char *header = session->buffer + session->start;
+            size_t available = session->end - session->start;
+            size_t headerLength = sizeof(messageHeader);
+            uint64_t length;
+            // the login response keeps the version 0 header in every version
+            if (options.version == VERSION || header[0] == LOGIN_RESPONSE) {
+                if (available < sizeof(messageHeader)) {
+                    break;
+                }
+                length = (uint64_t) (header[1] << 8 | header[2]);
+            } else if ((headerLength = getVarint(header + 1, available - 1, 3, &length)) == 0) {
+                break;
+            } else {
+                headerLength++;
+            }
+            if (length > sizeof(messageBody)) {
+                errorPrint("invalid frame length %" PRIu64, length);
+                sessionClose(worker, session);
+                return;
+            }
+            if (available < headerLength + length) {
+                break;
+            }
+            if (header[0] & COMPRESS_TYPE_FLAG) {
+                unsigned char body[sizeof(messageBody) + 32];
+                inflateReset(&worker->inflater);
+                worker->inflater.next_in = (unsigned char *) header + headerLength;
+                worker->inflater.avail_in = (uInt) length;
+                worker->inflater.next_out = body;
+                worker->inflater.avail_out = sizeof(body);
+                if (inflate(&worker->inflater, Z_FINISH) != Z_STREAM_END) {
+                    errorPrint("invalid compressed frame");
+                    sessionClose(worker, session);
+                    return;
+                }
+                handleFrame(worker, session, body, (uint16_t) worker->inflater.total_out,
+                            (uint8_t) (header[0] & ~COMPRESS_TYPE_FLAG), receivedAt);
+            } else {
+                handleFrame(worker, session, header + headerLength, (uint16_t) length, header[0], receivedAt);
+            }
+            session->start += headerLength + length;
+        }
+    }
+}
+
+static void sessionSend(Worker *worker, Session *session, uint64_t sendAt) {
+    message buffer;
+    int textLength = snprintf(buffer.messageBody.client2Server.text, sizeof(buffer.messageBody.client2Server.text),
+                              "%" PRIu64 " ", sendAt);
+    if (textLength < options.size) {
+        memset(buffer.messageBody.client2Server.text + textLength, 'x', (size_t) (options.size - textLength));
+        textLength = (int) options.size;
+    }
+    unsigned char frame[COMPACT_FRAME_MAX];
+    size_t frameLength;
+    frame[0] = CLIENT_2_SERVER;
+    if (options.version == VERSION) {
+        frame[1] = (unsigned char) (textLength >> 8);
+        frame[2] = (unsigned char) textLength;
+        frameLength = sizeof(messageHeader);
+    } else {
+        frameLength = 1 + putVarint(frame + 1, (uint64_t) textLength);
+    }
+    memcpy(frame + frameLength, buffer.messageBody.client2Server.text, (size_t) textLength);
+    frameLength += (size_t) textLength;
+    ssize_t sent = send(session->fd, frame, frameLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent == (ssize_t) frameLength) {
+        worker->sent++;
+    } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // the server does not keep up reading, skip this message instead of queueing it here
+        worker->sendBlocked++;
+    } else if (sent >= 0) {
+        // the rest of a torn frame has to follow, the stream would be corrupted otherwise
+        fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) & ~O_NONBLOCK);
+        sendAll(session->fd, frame + sent, frameLength - (size_t) sent);
+        fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+        worker->sent++;
+    }
+}
+
+// sends every message that is due and returns the epoll timeout until the next one
+static int sendDue(Worker *worker) {
+    uint64_t current = now();
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; i < worker->count; ++i) {
+        Session *session = &worker->sessions[i];
+        if (!session->sender || session->fd == -1) {
+            continue;
+        }
+        while (session->nextSend <= current) {
+            sessionSend(worker, session, current);
+            session->nextSend += sendInterval;
+        }
+        if (session->nextSend < next) {
+            next = session->nextSend;
+        }
+    }
+    if (next == UINT64_MAX) {
+        return 100;
+    }
+    return (int) ((next - current + 999999) / 1000000);
+}
+
+static void *workerThread(void *arg) {
+    Worker *worker = (Worker *) arg;
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    int scheduled = 0;
+    int timeout;
+
+    for (;;) {
+        int currentPhase = atomic_load(&phase);
+        if (currentPhase == PHASE_STOP) {
+            break;
+        }
+        timeout = 100;
+        if (worker->connected < worker->count) {
+            for (int i = 0; i < BENCH_CONNECT_BATCH && worker->connected < worker->count; ++i) {
+                Session *session = &worker->sessions[worker->connected++];
+                if (sessionConnect(worker, session) == -1) {
+                    worker->loginFailed++;
+                    atomic_fetch_add(&loggedIn, 1);
+                }
+            }
+            timeout = 0;
+        } else if (currentPhase == PHASE_RUN) {
+            if (!scheduled) {
+                // send times are offsets until runStart is known
+                for (size_t i = 0; i < worker->count; ++i) {
+                    worker->sessions[i].nextSend += runStart;
+                }
+                scheduled = 1;
+            }
+            timeout = sendDue(worker);
+        }
+        int count = epoll_wait(worker->epollFileDescriptor, events, BENCH_MAX_EVENTS, timeout);
+        if (count == -1 && errno != EINTR) {
+            errnoPrint("epoll_wait()");
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            Session *session = (Session *) events[i].data.ptr;
+            if (session->fd != -1) {
+                sessionReceive(worker, session);
+            }
+        }
+    }
+    for (size_t i = 0; i < worker->connected; ++i) {
+        if (worker->sessions[i].fd != -1) {
+            close(worker->sessions[i].fd);
+        }
+    }
+    return NULL;
+}
+
+static void printUsage(void) {
+    infoPrint("Usage : ./chatbench [--host ADDR] [--port N] [--sessions N] [--senders N] [--rate MSGS]");
+    infoPrint("                   [--duration S] [--drain S] [--threads N] [--size BYTES] [--prefix NAME]");
+    infoPrint("                   [--protocol-version N] [--unix PATH] [--seqpacket]");
+    infoPrint("  --sessions N  concurrent logged in sessions (default %ld)", options.sessions);
+    infoPrint("  --senders N  sessions that send, the others only receive (default %ld)", options.senders);
+    infoPrint("  --rate MSGS  messages per second over all senders (default %.0f)", options.rate);
+    infoPrint("  --duration S  seconds of sending after every session is logged in (default %.0f)",
+              options.duration);
+    infoPrint("  --drain S  seconds to keep receiving after the last send (default %.0f)", options.drain);
+    infoPrint("  --threads N  client event loops, 0 for one per core (default)");
+    infoPrint("  --size BYTES  pad message text to this length (default: just the timestamp)");
+    infoPrint("  --prefix NAME  user names are NAME0, NAME1, ... (default %s)", options.prefix);
+    infoPrint("  --protocol-version N  %d, %d for the compact encoding, %d to accept compressed frames (default %d)",
+              VERSION, VERSION_COMPACT, VERSION_COMPRESSED, VERSION);
+    infoPrint("  --unix PATH  connect to the server's AF_UNIX socket at PATH instead of host and port");
+    infoPrint("  --seqpacket  the socket at PATH is a SOCK_SEQPACKET one");
+}
+
+static int parseOptions(int argc, char **argv) {
+    int option;
+    char *endptr = NULL;
+    static const struct option longOptions[] = {
+            {"host",     required_argument, NULL, 'H'},
+            {"port",     required_argument, NULL, 'p'},
+            {"sessions", required_argument, NULL, 'n'},
+            {"senders",  required_argument, NULL, 's'},
+            {"rate",     required_argument, NULL, 'r'},
+            {"duration", required_argument, NULL, 'd'},
+            {"drain",    required_argument, NULL, 'D'},
+            {"threads",  required_argument, NULL, 't'},
+            {"size",     required_argument, NULL, 'b'},
+            {"prefix",   required_argument, NULL, 'x'},
+            {"protocol-version", required_argument, NULL, 'v'},
+            {"unix",     required_argument, NULL, 'u'},
+            {"seqpacket", no_argument,      NULL, 'q'},
+            {"help",     no_argument,       NULL, 'h'},
+            {NULL, 0,                       NULL, 0}
+    };
+
+    while ((option = getopt_long(argc, argv, "H:p:n:s:r:d:D:t:b:x:v:u:qh", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'H':
+                options.host = optarg;
+                break;
+            case 'p':
+                options.port = (int) strtol(optarg, &endptr, 10);
+                if (*endptr || options.port < 1 || options.port > 65535) {
+                    errorPrint("invalid port");
+                    return -1;
+                }
+                break;
+            case 'n':
+                options.sessions = strtol(optarg, &endptr, 10);
+                if (*endptr || options.sessions < 1) {
+                    errorPrint("invalid session count");
+                    return -1;
+                }
+                break;
+            case 's':
+                options.senders = strtol(optarg, &endptr, 10);
+                if (*endptr || options.senders < 0) {
+                    errorPrint("invalid sender count");
+                    return -1;
+                }
+                break;
+            case 'r':
+                options.rate = strtod(optarg, &endptr);
+                if (*endptr || options.rate <= 0.0) {
+                    errorPrint("invalid rate");
+                    return -1;
+                }
+                break;
+            case 'd':
+                options.duration = strtod(optarg, &endptr);
+                if (*endptr || options.duration <= 0.0) {
+                    errorPrint("invalid duration");
+                    return -1;
+                }
+                break;
+            case 'D':
+                options.drain = strtod(optarg, &endptr);
+                if (*endptr || options.drain < 0.0) {
+                    errorPrint("invalid drain time");
+                    return -1;
+                }
+                break;
+            case 't':
+                options.threads = strtol(optarg, &endptr, 10);
+                if (*endptr || options.threads < 0) {
+                    errorPrint("invalid thread count");
+                    return -1;
+                }
+                break;
+            case 'b':
+                options.size = strtol(optarg, &endptr, 10);
+                if (*endptr || options.size < 0 || options.size > TEXT_MAX) {
+                    errorPrint("invalid message size");
+                    return -1;
+                }
+                break;
+            case 'x':
+                options.prefix = optarg;
+                if (strlen(options.prefix) > USERNAME_MAX - 10) {
+                    errorPrint("prefix too long");
+                    return -1;
+                }
+                break;
+            case 'v':
+                options.version = (int) strtol(optarg, &endptr, 10);
+                if (*endptr || options.version < VERSION || options.version > VERSION_MAX) {
+                    errorPrint("invalid protocol version");
+                    return -1;
+                }
+                break;
+            case 'u':
+                options.unixPath = optarg;
+                if (strlen(options.unixPath) >= sizeof(((struct sockaddr_un *) NULL)->sun_path)) {
+                    errorPrint("socket path too long");
+                    return -1;
+                }
+                break;
+            case 'q':
+                options.seqpacket = 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    if (options.seqpacket && options.unixPath == NULL) {
+        errorPrint("--seqpacket needs --unix");
+        return -1;
+    }
+    if (options.senders > options.sessions) {
+        options.senders = options.sessions;
+    }
+    if (options.threads == 0) {
+        options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (options.threads > options.sessions) {
+        options.threads = options.sessions;
+    }
+    return 0;
+}
+
+static void sleepSeconds(double seconds) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (long) ((seconds - (double) ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+int main(int argc, char **argv) {
+    struct rlimit limit;
+    Worker total;
+
+    setProgName(argv[0]);
+    if (parseOptions(argc, argv) == -1) {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    if (options.unixPath != NULL) {
+        struct sockaddr_un *address = (struct sockaddr_un *) &serverAddress;
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, options.unixPath);
+        serverAddressLength = sizeof(struct sockaddr_un);
+    } else {
+        struct sockaddr_in *address = (struct sockaddr_in *) &serverAddress;
+        address->sin_family = AF_INET;
+        address->sin_port = htons((uint16_t) options.port);
+        if (inet_pton(AF_INET, options.host, &address->sin_addr) != 1) {
+            errorPrint("invalid host address %s", options.host);
+            return EXIT_FAILURE;
+        }
+        serverAddressLength = sizeof(struct sockaddr_in);
+    }
+    // one descriptor per session
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) options.sessions + 64) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Worker *workers = calloc((size_t) options.threads, sizeof(Worker));
+    if (workers == NULL) {
+        errorPrint("out of memory");
+        return EXIT_FAILURE;
+    }
+    for (long i = 0; i < options.threads; ++i) {
+        Worker *worker = &workers[i];
+        worker->count = (size_t) (options.sessions / options.threads + (i < options.sessions % options.threads));
+        worker->sessions = calloc(worker->count, sizeof(Session));
+        if (worker->sessions == NULL || (worker->epollFileDescriptor = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            inflateInit2(&worker->inflater, -15) != Z_OK) {
+            errnoPrint("worker setup");
+            return EXIT_FAILURE;
+        }
+    }
+    // sessions are dealt round robin so every worker gets its share of the senders, sender k of S
+    // starts k / rate seconds into the run, so the total rate is even from the start
+    sendInterval = (uint64_t) ((double) options.senders * 1e9 / options.rate);
+    for (long i = 0; i < options.sessions; ++i) {
+        Session *session = &workers[i % options.threads].sessions[i / options.threads];
+        session->index = (size_t) i;
+        session->fd = -1;
+        if (i < options.senders) {
+            session->sender = 1;
+            session->nextSend = (uint64_t) ((double) i * 1e9 / options.rate);
+        }
+    }
+
+    uint64_t loginStart = now();
+    for (long i = 0; i < options.threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, workerThread, &workers[i]) != 0) {
+            errnoPrint("pthread_create()");
+            return EXIT_FAILURE;
+        }
+    }
+    while (atomic_load(&loggedIn) < options.sessions) {
+        sleepSeconds(0.05);
+    }
+    uint64_t loginEnd = now();
+    infoPrint("%ld sessions logged in after %.2f s", options.sessions, (double) (loginEnd - loginStart) / 1e9);
+
+    runStart = now();
+    atomic_store(&phase, PHASE_RUN);
+    sleepSeconds(options.duration);
+    atomic_store(&phase, PHASE_DRAIN);
+    uint64_t runEnd = now();
+    sleepSeconds(options.drain);
+    atomic_store(&phase, PHASE_STOP);
+    for (long i = 0; i < options.threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (long i = 0; i < options.threads; ++i) {
+        Worker *worker = &workers[i];
+        total.sent += worker->sent;
+        total.sendBlocked += worker->sendBlocked;
+        total.delivered += worker->delivered;
+        total.bytesReceived += worker->bytesReceived;
+        total.runBytesReceived += worker->runBytesReceived;
+        total.loginFailed += worker->loginFailed;
+        total.disconnects += worker->disconnects;
+        for (int type = 0; type <= USER_REMOVED; ++type) {
+            total.framesByType[type] += worker->framesByType[type];
+        }
+        histogramMerge(&total.latency, &worker->latency);
+        histogramMerge(&total.login, &worker->login);
+    }
+    double runSeconds = (double) (runEnd - runStart) / 1e9;
+    uint64_t expected = total.sent * (uint64_t) (options.sessions - (long) total.loginFailed);
+
+    printf("{\"transport\":\"%s\",\"sessions\":%ld,\"senders\":%ld,\"threads\":%ld,\"rate\":%.1f,"
+           "\"duration_s\":%.3f,\"login_s\":%.3f,\"login_failed\":%" PRIu64 ",",
+           options.unixPath == NULL ? "tcp" : options.seqpacket ? "seqpacket" : "unix", options.sessions,
+           options.senders, options.threads, options.rate, runSeconds, (double) (loginEnd - loginStart) / 1e9,
+           total.loginFailed);
+    printHistogram("login", &total.login);
+    printf(",\"sent\":%" PRIu64 ",\"send_blocked\":%" PRIu64 ",\"delivered\":%" PRIu64 ",\"expected\":%" PRIu64
+           ",\"sent_per_s\":%.1f,\"delivered_per_s\":%.1f,\"bytes_received\":%" PRIu64
+           ",\"run_bytes_received\":%" PRIu64 ",\"disconnects\":%" PRIu64
+           ",\"user_added\":%" PRIu64 ",\"user_removed\":%" PRIu64 ",", total.sent, total.sendBlocked,
+           total.delivered, expected, (double) total.sent / runSeconds, (double) total.delivered / runSeconds,
+           total.bytesReceived, total.runBytesReceived, total.disconnects, total.framesByType[USER_ADDED],
+           total.framesByType[USER_REMOVED]);
+    printHistogram("latency", &total.latency);
+    printf("}\n");
+
+    for (long i = 0; i < options.threads; ++i) {
+        close(workers[i].epollFileDescriptor);
+        free(workers[i].sessions);
+    }
+    free(workers);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# Compares --fanout-threads settings: starts the server (reactor mode) once per user count and
+# thread count, runs chatbench against it and prints one line per run with the send-to-deliver
+# latency over every copy, which is dominated by the copy that is sent last.
+#
+# Helpers can only help when they get cores of their own. Run this where the server has more cores
+# than broadcast workers and chatbench runs elsewhere or on separate cores; on a single core the
+# helpers merely take turns with the worker and the results say nothing about parallel fan-out.
+#
+# Usage: ./fanoutbench.sh [SERVER [CHATBENCH]]
+#   USERS="1000 10000" THREADS="0 1 2 3" RATE=50 DURATION=5 PORT=8111 override the defaults,
+#   RATE is the number of messages per second at 1000 users and is scaled down for more.
+#
+# Build the server from ../src and chatbench as described in chatbench.c first.
+
+server=${1:-../src/server}
+chatbench=${2:-./chatbench}
+users=${USERS:-"1000 10000"}
+threads=${THREADS:-"0 1 2 3"}
+rate=${RATE:-50}
+duration=${DURATION:-5}
+port=${PORT:-8111}
+
+ulimit -n $((${users##* } * 2 + 1024)) 2>/dev/null
+
+printf "%8s %8s %10s %10s %10s %10s %10s\n" users threads delivered expected p50_us p99_us max_us
+for n in $users; do
+    for t in $threads; do
+        "$server" --reactor --fanout-threads "$t" --log-level error "$port" 2>/dev/null &
+        pid=$!
+        sleep 0.5
+        "$chatbench" --port "$port" --sessions "$n" --senders 10 --rate "$(awk "BEGIN { print $rate * 1000 / $n }")" \
+            --duration "$duration" --drain 2 2>/dev/null |
+            python3 -c 'import json, sys
+d = json.load(sys.stdin)
+l = d["latency"]
+print("%8s %8s %10d %10d %10.0f %10.0f %10.0f" % (sys.argv[1], sys.argv[2], d["delivered"], d["expected"],
+      l["p50_us"], l["p99_us"], l["max_us"]))' "$n" "$t"
+        kill "$pid"
+        wait "$pid" 2>/dev/null
+    done
+done
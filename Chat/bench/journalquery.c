@@ -0,0 +1,114 @@
+/*
+ * Reads a time range out of the server's journal (--journal DIR) and reports how long it took.
+ *
+ * Prints one line per record (time, room, type, sender and text of chat lines), or with --count
+ * only one JSON line with the number of records, their bytes and the query time. Times are
+ * nanoseconds since the epoch, --since takes seconds back from now instead.
+ *
+ * Build:
+ *   gcc -O2 -std=gnu11 -pthread -I../src journalquery.c ../src/journal.c ../src/util.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "protocol.h"
+#include "journal.h"
+#include "util.h"
+
+typedef struct Totals {
+    int quiet;
+    size_t records;
+    size_t bytes;
+} Totals;
+
+static uint64_t now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int printRecord(uint64_t timestamp, const char *room, const unsigned char *frame, size_t length, void *arg) {
+    Totals *totals = arg;
+    message buffer;
+    char when[32];
+
+    totals->records++;
+    totals->bytes += length;
+    if (totals->quiet) {
+        return 0;
+    }
+    memset(&buffer, 0, sizeof(buffer));
+    memcpy(&buffer, frame, length < sizeof(buffer) ? length : sizeof(buffer));
+    time_t seconds = (time_t) (timestamp / 1000000000u);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    printf("%s.%09llu %-10s ", when, (unsigned long long) (timestamp % 1000000000u), room != NULL ? room : "*");
+    switch (buffer.messageHeader.type) {
+        case SERVER_2_CLIENT:
+            printf("%s: %s\n", buffer.messageBody.server2Client.originalSender[0] != '\0'
+                               ? buffer.messageBody.server2Client.originalSender : "[server]",
+                   buffer.messageBody.server2Client.text);
+            break;
+        case USER_ADDED:
+            printf("+ %s\n", buffer.messageBody.userAdded.name);
+            break;
+        case USER_REMOVED:
+            printf("- %s (%u)\n", buffer.messageBody.userRemoved.name, buffer.messageBody.userRemoved.code);
+            break;
+        default:
+            printf("type %u, %zu bytes\n", buffer.messageHeader.type, length);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    Totals totals = {0};
+    int option;
+    static const struct option longOptions[] = {
+            {"from",  required_argument, NULL, 'f'},
+            {"to",    required_argument, NULL, 't'},
+            {"since", required_argument, NULL, 's'},
+            {"count", no_argument,       NULL, 'c'},
+            {NULL, 0,                    NULL, 0}
+    };
+
+    setProgName(argv[0]);
+    while ((option = getopt_long(argc, argv, "f:t:s:c", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'f':
+                from = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                to = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                from = now(CLOCK_REALTIME) - strtoull(optarg, NULL, 10) * 1000000000u;
+                break;
+            case 'c':
+                totals.quiet = 1;
+                break;
+            default:
+                optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1) {
+        errorPrint("Usage: ./journalquery [--from NS] [--to NS] [--since SECONDS] [--count] DIR");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = now(CLOCK_MONOTONIC);
+    ssize_t visited = journalQuery(argv[optind], from, to, printRecord, &totals);
+    uint64_t elapsed = now(CLOCK_MONOTONIC) - start;
+    if (visited == -1) {
+        errnoPrint("could not read journal %s", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (totals.quiet) {
+        printf("{\"records\":%zu,\"bytes\":%zu,\"query_us\":%.1f}\n", totals.records, totals.bytes,
+               (double) elapsed / 1000.0);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/*
+ * Cost of the logging done for every chat message, per log configuration.
+ *
+ * Replays the log calls of one CLIENT_2_SERVER round trip (header and body hexdumps, the
+ * redirect and broadcast debug lines, the outgoing SERVER_2_CLIENT hexdump) and prints one JSON
+ * line with the nanoseconds per message. Run with stderr sent to /dev/null or a file.
+ *
+ * Build one binary per compile-time level:
+ *   gcc -O2 -std=gnu11 -pthread -I../src -DLOG_LEVEL_MIN=LOG_LEVEL_DEBUG logbench.c ../src/util.c
+ *   gcc -O2 -std=gnu11 -pthread -I../src -DLOG_LEVEL_MIN=LOG_LEVEL_INFO logbench.c ../src/util.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+#include "util.h"
+
+static long messages = 200000;
+static long threads = 1;
+static message frame;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void *replay(void *arg) {
+    (void) arg;
+    for (long i = 0; i < messages; ++i) {
+        debugHexdump(&frame.messageHeader, sizeof(frame.messageHeader), "messageHeader");
+        debugHexdump(&frame.messageBody, ntohs(frame.messageHeader.length), "client message");
+        debugPrint("REDIRECTING MESSAGE TO %d", (int) i);
+        debugPrint("sending %zu bytes to all users", strlen(frame.messageBody.client2Server.text));
+        debugHexdump(&frame, sizeof(frame.messageHeader) + ntohs(frame.messageHeader.length), "server 2 client");
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *level = "info";
+    int async = 0;
+    int option;
+    static const struct option longOptions[] = {
+            {"level",    required_argument, NULL, 'L'},
+            {"async",    no_argument,       NULL, 'a'},
+            {"messages", required_argument, NULL, 'n'},
+            {"threads",  required_argument, NULL, 't'},
+            {NULL, 0,                       NULL, 0}
+    };
+
+    setProgName(argv[0]);
+    while ((option = getopt_long(argc, argv, "L:an:t:", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'L':
+                level = optarg;
+                break;
+            case 'a':
+                async = 1;
+                break;
+            case 'n':
+                messages = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            default:
+                errorPrint("Usage: ./logbench [--level debug|info|error] [--async] [--messages N] [--threads N]");
+                return EXIT_FAILURE;
+        }
+    }
+    if (logLevelFromName(level) == -1 || messages < 1 || threads < 1 || threads > 256) {
+        errorPrint("invalid arguments");
+        return EXIT_FAILURE;
+    }
+    logLevelSet(logLevelFromName(level));
+    if (async && logAsyncStart() == -1) {
+        errnoPrint("logAsyncStart()");
+        return EXIT_FAILURE;
+    }
+
+    const char *text = "hello from a benchmark client, this is a chat message of typical length";
+    frame.messageHeader.type = CLIENT_2_SERVER;
+    frame.messageHeader.length = htons((uint16_t) strlen(text));
+    strcpy(frame.messageBody.client2Server.text, text);
+
+    pthread_t workers[256];
+    uint64_t start = now();
+    for (long i = 0; i < threads; ++i) {
+        pthread_create(&workers[i], NULL, replay, NULL);
+    }
+    for (long i = 0; i < threads; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    uint64_t elapsed = now() - start;
+    logFlush();
+    uint64_t flushed = now() - start;
+
+    printf("{\"compile_level\":%d,\"runtime_level\":\"%s\",\"async\":%d,\"threads\":%ld,\"messages\":%ld,"
+           "\"ns_per_message\":%.1f,\"ns_per_message_flushed\":%.1f,\"dropped\":%zu}\n", LOG_LEVEL_MIN, level,
+           async, threads, messages * threads, (double) elapsed / (double) (messages * threads),
+           (double) flushed / (double) (messages * threads), logDroppedRecords());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+/*
+ * Cost of the idle timer wheel at many connections.
+ *
+ * Schedules one timer per simulated connection, spread over one heartbeat interval the way logins
+ * spread them, then advances the wheel tick by tick for a number of intervals and re-arms every
+ * timer that fires one interval later, as the idle thread does for a connection that stays quiet.
+ * Prints one JSON line with the nanoseconds per add, per fired timer and of the slowest tick.
+ *
+ * Build: gcc -O2 -std=gnu11 -I../src timerbench.c ../src/timerwheel.c -o timerbench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include "timerwheel.h"
+
+static long timers = 500000;
+// ticks of 100 ms, as in idle.h: a 300 s timeout checks every 100 s
+static long interval = 1000;
+static long rounds = 3;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int option;
+    static const struct option longOptions[] = {
+            {"timers",   required_argument, NULL, 'n'},
+            {"interval", required_argument, NULL, 'i'},
+            {"rounds",   required_argument, NULL, 'r'},
+            {NULL, 0,                       NULL, 0}
+    };
+
+    while ((option = getopt_long(argc, argv, "n:i:r:", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'n':
+                timers = strtol(optarg, NULL, 10);
+                break;
+            case 'i':
+                interval = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--timers N] [--interval TICKS] [--rounds N]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (timers <= 0 || interval <= 0 || rounds <= 0) {
+        fprintf(stderr, "all values must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    Timer *timer = calloc((size_t) timers, sizeof(Timer));
+    TimerWheel *wheel = malloc(sizeof(TimerWheel));
+    if (timer == NULL || wheel == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    timerWheelInit(wheel, 0);
+    srand(1);
+
+    uint64_t start = now();
+    for (long i = 0; i < timers; ++i) {
+        timerWheelAdd(wheel, &timer[i], 1 + (uint64_t) (rand() % interval));
+    }
+    uint64_t addTime = now() - start;
+
+    uint64_t fired = 0;
+    uint64_t slowestTick = 0;
+    start = now();
+    for (uint64_t tick = 1; tick <= (uint64_t) (interval * rounds); ++tick) {
+        uint64_t tickStart = now();
+        Timer *expired = timerWheelAdvance(wheel, tick);
+        while (expired != NULL) {
+            Timer *next = expired->next;
+            timerWheelAdd(wheel, expired, tick + (uint64_t) interval);
+            fired++;
+            expired = next;
+        }
+        uint64_t tickTime = now() - tickStart;
+        slowestTick = tickTime > slowestTick ? tickTime : slowestTick;
+    }
+    uint64_t runTime = now() - start;
+
+    printf("{\"timers\":%ld,\"interval_ticks\":%ld,\"rounds\":%ld,\"add_ns\":%.1f,\"fired\":%" PRIu64
+           ",\"ns_per_fired\":%.1f,\"slowest_tick_us\":%.1f,\"scheduled\":%zu}\n", timers, interval, rounds,
+           (double) addTime / (double) timers, fired, fired > 0 ? (double) runTime / (double) fired : 0.0,
+           (double) slowestTick / 1000.0, wheel->count);
+    free(wheel);
+    free(timer);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,330 @@
+/*
+ * Throughput of one connection over TCP loopback or the server's AF_UNIX socket (--unix-socket).
+ *
+ * Every connection logs in, joins a room of its own and keeps --window messages in flight: each
+ * copy of its own message the server sends back lets it send the next one. So the numbers are what
+ * a single busy bot gets through the server, not how many messages a crowd of clients can queue.
+ * Prints one JSON line with the messages and text bytes per second of an average connection and
+ * the mean round trip of a message.
+ *
+ * Build: gcc -O2 -std=gnu11 -I../src transportbench.c ../src/util.c -o transportbench
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "util.h"
+
+#define BENCH_MAX_EVENTS 64
+#define BENCH_RECEIVE_BUFFER 65536
+
+typedef struct Connection {
+    int fd;
+    char name[USERNAME_MAX + 1];
+    int loggedIn;
+    long inFlight;
+    uint64_t delivered;
+    size_t start;
+    size_t end;
+    unsigned char buffer[BENCH_RECEIVE_BUFFER];
+} Connection;
+
+static const char *host = "127.0.0.1";
+static int port = 8111;
+static const char *unixPath = NULL;
+static int seqpacket = 0;
+static long connections = 1;
+static long window = 16;
+static long size = 64;
+static double duration = 5.0;
+static int running = 0;
+static unsigned char frame[sizeof(messageHeader) + TEXT_MAX];
+static size_t frameLength;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int sendAll(int fd, const void *data, size_t length) {
+    const unsigned char *next = data;
+    while (length > 0) {
+        ssize_t sent = send(fd, next, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        next += sent;
+        length -= (size_t) sent;
+    }
+    return 0;
+}
+
+static int sendText(Connection *connection, const char *text, size_t length) {
+    unsigned char buffer[sizeof(messageHeader) + TEXT_MAX];
+
+    buffer[0] = CLIENT_2_SERVER;
+    buffer[1] = (unsigned char) (length >> 8);
+    buffer[2] = (unsigned char) length;
+    memcpy(buffer + sizeof(messageHeader), text, length);
+    return sendAll(connection->fd, buffer, sizeof(messageHeader) + length);
+}
+
+static int connectTo(Connection *connection, long index) {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    unsigned char request[sizeof(messageHeader) + sizeof(loginRequest)];
+    int one = 1;
+
+    memset(&address, 0, sizeof(address));
+    if (unixPath != NULL) {
+        struct sockaddr_un *local = (struct sockaddr_un *) &address;
+        local->sun_family = AF_UNIX;
+        strcpy(local->sun_path, unixPath);
+        addressLength = sizeof(struct sockaddr_un);
+    } else {
+        struct sockaddr_in *remote = (struct sockaddr_in *) &address;
+        remote->sin_family = AF_INET;
+        remote->sin_port = htons((uint16_t) port);
+        if (inet_pton(AF_INET, host, &remote->sin_addr) != 1) {
+            errorPrint("invalid host address %s", host);
+            return -1;
+        }
+        addressLength = sizeof(struct sockaddr_in);
+    }
+    if ((connection->fd = socket(address.ss_family, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0)) < 0 ||
+        connect(connection->fd, (struct sockaddr *) &address, addressLength) < 0) {
+        errnoPrint("connect()");
+        return -1;
+    }
+    if (address.ss_family == AF_INET) {
+        setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    int nameLength = snprintf(connection->name, sizeof(connection->name), "tb%ld_%ld", (long) getpid() % 10000,
+                              index);
+    uint32_t magic = htonl(MAGIC_LOGIN_REQUEST);
+    uint16_t length = (uint16_t) (sizeof(magic) + 1 + (size_t) nameLength);
+    request[0] = LOGIN_REQUEST;
+    request[1] = (unsigned char) (length >> 8);
+    request[2] = (unsigned char) length;
+    memcpy(request + sizeof(messageHeader), &magic, sizeof(magic));
+    request[sizeof(messageHeader) + sizeof(magic)] = VERSION;
+    memcpy(request + sizeof(messageHeader) + sizeof(magic) + 1, connection->name, (size_t) nameLength);
+    return sendAll(connection->fd, request, sizeof(messageHeader) + length);
+}
+
+static void handleFrame(Connection *connection, const unsigned char *body, uint8_t type, uint16_t length) {
+    const size_t text = sizeof(uint64_t) + sizeof(((server2Client *) NULL)->originalSender);
+
+    if (type == LOGIN_RESPONSE) {
+        if (length < 5 || body[4] != LOGIN_RESPONSE_STATUS_SUCCESS) {
+            errorPrint("login of %s refused", connection->name);
+            exit(EXIT_FAILURE);
+        }
+        connection->loggedIn = 1;
+        return;
+    }
+    // only the copies of its own messages count, the room has nobody else in it
+    if (type != SERVER_2_CLIENT || length <= text ||
+        strncmp((const char *) body + sizeof(uint64_t), connection->name, sizeof(connection->name)) != 0) {
+        return;
+    }
+    connection->inFlight--;
+    if (running) {
+        connection->delivered++;
+        if (sendAll(connection->fd, frame, frameLength) == 0) {
+            connection->inFlight++;
+        }
+    }
+}
+
+static int receive(Connection *connection) {
+    if (connection->start > 0) {
+        memmove(connection->buffer, connection->buffer + connection->start, connection->end - connection->start);
+        connection->end -= connection->start;
+        connection->start = 0;
+    }
+    ssize_t bytesRead = recv(connection->fd, connection->buffer + connection->end,
+                             sizeof(connection->buffer) - connection->end, MSG_DONTWAIT);
+    if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (bytesRead <= 0) {
+        errorPrint("server closed the connection of %s", connection->name);
+        return -1;
+    }
+    connection->end += (size_t) bytesRead;
+    while (connection->end - connection->start >= sizeof(messageHeader)) {
+        const unsigned char *header = connection->buffer + connection->start;
+        uint16_t length = (uint16_t) (header[1] << 8 | header[2]);
+        if (connection->end - connection->start < sizeof(messageHeader) + length) {
+            break;
+        }
+        connection->start += sizeof(messageHeader) + length;
+        handleFrame(connection, header + sizeof(messageHeader), header[0], length);
+    }
+    return 0;
+}
+
+// handles events for at most timeout ms, -1 if a connection broke
+static int pump(int epollFileDescriptor, int timeout) {
+    struct epoll_event events[BENCH_MAX_EVENTS];
+
+    int count = epoll_wait(epollFileDescriptor, events, BENCH_MAX_EVENTS, timeout);
+    for (int i = 0; i < count; ++i) {
+        if (receive((Connection *) events[i].data.ptr) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int option;
+    static const struct option longOptions[] = {
+            {"host",        required_argument, NULL, 'H'},
+            {"port",        required_argument, NULL, 'p'},
+            {"unix",        required_argument, NULL, 'u'},
+            {"seqpacket",   no_argument,       NULL, 'q'},
+            {"connections", required_argument, NULL, 'n'},
+            {"window",      required_argument, NULL, 'w'},
+            {"size",        required_argument, NULL, 'b'},
+            {"duration",    required_argument, NULL, 'd'},
+            {NULL, 0,                          NULL, 0}
+    };
+
+    setProgName(argv[0]);
+    while ((option = getopt_long(argc, argv, "H:p:u:qn:w:b:d:", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                port = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                unixPath = optarg;
+                break;
+            case 'q':
+                seqpacket = 1;
+                break;
+            case 'n':
+                connections = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                window = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                size = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration = strtod(optarg, NULL);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--host ADDR] [--port N] [--unix PATH [--seqpacket]] [--connections N]"
+                                "\n       [--window N] [--size BYTES] [--duration S]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (connections <= 0 || window <= 0 || size <= 0 || size > TEXT_MAX || duration <= 0.0 ||
+        port < 1 || port > 65535 || (seqpacket && unixPath == NULL) ||
+        (unixPath != NULL && strlen(unixPath) >= sizeof(((struct sockaddr_un *) NULL)->sun_path))) {
+        fprintf(stderr, "invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Connection *connection = calloc((size_t) connections, sizeof(Connection));
+    int epollFileDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (connection == NULL || epollFileDescriptor == -1) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (long i = 0; i < connections; ++i) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &connection[i]};
+        if (connectTo(&connection[i], i) == -1 ||
+            epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, connection[i].fd, &event) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (long loggedIn = 0; loggedIn < connections;) {
+        if (pump(epollFileDescriptor, 100) == -1) {
+            return EXIT_FAILURE;
+        }
+        loggedIn = 0;
+        for (long i = 0; i < connections; ++i) {
+            loggedIn += connection[i].loggedIn;
+        }
+    }
+    for (long i = 0; i < connections; ++i) {
+        char join[sizeof(connection[i].name) + 8];
+        int length = snprintf(join, sizeof(join), "/join %s", connection[i].name);
+        if (sendText(&connection[i], join, (size_t) length) == -1) {
+            errnoPrint("joining a room");
+            return EXIT_FAILURE;
+        }
+    }
+    // user lists and join notices of the other connections
+    for (uint64_t until = now() + 300000000u; now() < until;) {
+        if (pump(epollFileDescriptor, 50) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    frame[0] = CLIENT_2_SERVER;
+    frame[1] = (unsigned char) (size >> 8);
+    frame[2] = (unsigned char) size;
+    memset(frame + sizeof(messageHeader), 'x', (size_t) size);
+    frameLength = sizeof(messageHeader) + (size_t) size;
+    running = 1;
+    uint64_t start = now();
+    for (long i = 0; i < connections; ++i) {
+        for (long j = 0; j < window; ++j) {
+            if (sendAll(connection[i].fd, frame, frameLength) == -1) {
+                errnoPrint("sending");
+                return EXIT_FAILURE;
+            }
+            connection[i].inFlight++;
+        }
+    }
+    uint64_t end = start + (uint64_t) (duration * 1e9);
+    while (now() < end) {
+        if (pump(epollFileDescriptor, 10) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+    uint64_t elapsed = now() - start;
+    running = 0;
+
+    uint64_t delivered = 0;
+    for (long i = 0; i < connections; ++i) {
+        delivered += connection[i].delivered;
+        close(connection[i].fd);
+    }
+    double seconds = (double) elapsed / 1e9;
+    double perConnection = (double) delivered / seconds / (double) connections;
+    printf("{\"transport\":\"%s\",\"connections\":%ld,\"window\":%ld,\"size\":%ld,\"duration_s\":%.3f,"
+           "\"delivered\":%" PRIu64 ",\"msgs_per_s_per_connection\":%.1f,\"mb_per_s_per_connection\":%.2f,"
+           "\"mean_round_trip_us\":%.1f}\n", unixPath == NULL ? "tcp" : seqpacket ? "seqpacket" : "unix",
+           connections, window, size, seconds, delivered, perConnection, perConnection * (double) size / 1e6,
+           perConnection > 0.0 ? (double) window / perConnection * 1e6 : 0.0);
+    free(connection);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,231 @@
+#include "admin.h"
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include "user.h"
+#include "util.h"
+#include "epoch.h"
+#include "pool.h"
+#include "credit.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "broadcastagent.h"
+#include "fanout.h"
+#include "compact.h"
+#include "compress.h"
+#include "idle.h"
+#include "directmessage.h"
+#include "cluster.h"
+#include "journal.h"
+
+typedef struct AdminCommand {
+    struct AdminCommand *next;
+    int type;
+    // the admin may log out and somebody else log in as Admin before the command has run
+    uint32_t adminId;
+    char argument[USERNAME_MAX + 1];
+    uint64_t submitted;
+} AdminCommand;
+
+static Pool commandPool = POOL_INITIALIZER("AdminCommand", sizeof(AdminCommand));
+
+static pthread_t adminThread;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueChanged = PTHREAD_COND_INITIALIZER;
+static AdminCommand *head = NULL;
+static AdminCommand *tail = NULL;
+static size_t queued = 0;
+// held by the thread while it runs a command, adminSuspend() keeps it
+static pthread_mutex_t commandLock = PTHREAD_MUTEX_INITIALIZER;
+// only touched by the executor
+static bool paused = false;
+
+static Histogram latency;
+static atomic_size_t kicks = 0;
+static atomic_size_t rejected = 0;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// the admin's memory and socket stay valid until epochExit(), even if it logs out meanwhile
+static void reply(AdminCommand *command, message *buffer, int code, char *argument) {
+    epochEnter();
+    User *admin = findUserByName(ADMIN_NAME);
+    if (admin != NULL && admin->id == command->adminId && !atomic_load(&admin->kicked)) {
+        memset(buffer, 0, sizeof(message));
+        sendServerMessage(buffer, admin->socketFileDescriptor, "", code, argument);
+    }
+    epochExit();
+}
+
+// the victim's own thread or reactor sees the shutdown and removes it, nobody waits for that
+static void kickUser(AdminCommand *command, message *buffer) {
+    epochEnter();
+    User *user = findUserByName(command->argument);
+    if (user != NULL && strcmp(user->name, ADMIN_NAME) == 0) {
+        epochExit();
+        reply(command, buffer, SERVER_CODE_DO_NOT_KICK_YOURSELF, "");
+        return;
+    }
+    // claimed first, so neither the user's own thread nor an eviction announces the close again
+    if (user == NULL || atomic_exchange(&user->kicked, 1) != 0) {
+        epochExit();
+        debugPrint("couldnt find username %s", command->argument);
+        reply(command, buffer, SERVER_CODE_USER_UNKNOWN, "");
+        return;
+    }
+    if (notifyUserRemoved(user, USER_REMOVED_STATUS_KICKED_FROM_SERVER) == -1) {
+        errnoPrint("error sending notifyUserRemoved");
+    }
+    shutdown(user->socketFileDescriptor, SHUT_RDWR);
+    // a throttled reader would not look at its socket before the paused agent returns a credit
+    creditInterrupt(user->credit);
+    epochExit();
+    atomic_fetch_add_explicit(&kicks, 1, memory_order_relaxed);
+    infoPrint("User %s kicked", command->argument);
+    reply(command, buffer, SERVER_CODE_USER_KICKED, command->argument);
+}
+
+static void pauseChat(AdminCommand *command, message *buffer) {
+    if (paused) {
+        reply(command, buffer, SERVER_CODE_ALREADY_PAUSED, "");
+        return;
+    }
+    debugPrint("sending SERVER_CODE_PAUSED");
+    paused = true;
+    prepareServerMessage(buffer, "", SERVER_CODE_PAUSED, "");
+    sendMessageToAllUsers(buffer, SERVER_CODE_PAUSED);
+    pauseServer();
+}
+
+static void resumeChat(AdminCommand *command, message *buffer) {
+    if (!paused) {
+        reply(command, buffer, SERVER_CODE_CANNOT_RESUME, "");
+        return;
+    }
+    debugPrint("sending SERVER_CODE_RESUMED");
+    prepareServerMessage(buffer, "", SERVER_CODE_RESUMED, "");
+    sendMessageToAllUsers(buffer, SERVER_CODE_RESUMED);
+    resumeServer();
+    paused = false;
+}
+
+// goes to the server log, the protocol has no reply type for it
+static void printStats(void) {
+    printUserStats();
+    poolPrintStats();
+    infoPrint("STATS log: %zu records dropped", logDroppedRecords());
+    infoPrint("STATS broadcast: %zu messages waited for a full queue", broadcastAgentPutWaits());
+    fanoutPrintStats();
+    size_t compactFrames, originalBytes, compactBytes;
+    compactStats(&compactFrames, &originalBytes, &compactBytes);
+    infoPrint("STATS compact protocol: %zu frames encoded, %zu bytes instead of %zu", compactFrames,
+              compactBytes, originalBytes);
+    compressPrintStats();
+    idlePrintStats();
+    directMessagePrintStats();
+    clusterPrintStats();
+    adminPrintStats();
+    size_t records, commits, stalls;
+    journalStats(&records, &commits, &stalls);
+    infoPrint("STATS journal: %zu records in %zu commits, %zu appends waited for the disk", records,
+              commits, stalls);
+}
+
+static void *adminLoop(void *arg) {
+    (void) arg;
+    message *buffer = allocMessage();
+
+    if (buffer == NULL) {
+        errnoPrint("could not allocate the admin's message buffer");
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&queueLock);
+        while (head == NULL) {
+            pthread_cond_wait(&queueChanged, &queueLock);
+        }
+        AdminCommand *command = head;
+        if ((head = command->next) == NULL) {
+            tail = NULL;
+        }
+        queued--;
+        pthread_mutex_unlock(&queueLock);
+
+        pthread_mutex_lock(&commandLock);
+        memset(buffer, 0, sizeof(message));
+        switch (command->type) {
+            case ADMIN_COMMAND_KICK:
+                kickUser(command, buffer);
+                break;
+            case ADMIN_COMMAND_PAUSE:
+                pauseChat(command, buffer);
+                break;
+            case ADMIN_COMMAND_RESUME:
+                resumeChat(command, buffer);
+                break;
+            case ADMIN_COMMAND_STATS:
+                printStats();
+                break;
+            default:
+                break;
+        }
+        pthread_mutex_unlock(&commandLock);
+        histogramRecord(&latency, now() - command->submitted);
+        poolFree(&commandPool, command);
+    }
+}
+
+int adminStart(void) {
+    if (pthread_create(&adminThread, NULL, adminLoop, NULL) != 0) {
+        errnoPrint("error creating admin thread");
+        return -1;
+    }
+    return 1;
+}
+
+int adminSubmit(int type, uint32_t adminId, const char *argument) {
+    AdminCommand *command;
+
+    pthread_mutex_lock(&queueLock);
+    if (queued >= ADMIN_QUEUE_MAX || (command = poolAlloc(&commandPool)) == NULL) {
+        pthread_mutex_unlock(&queueLock);
+        atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+        return -1;
+    }
+    memset(command, 0, sizeof(AdminCommand));
+    command->type = type;
+    command->adminId = adminId;
+    if (argument != NULL) {
+        strncpy(command->argument, argument, sizeof(command->argument) - 1);
+    }
+    command->submitted = now();
+    if (tail != NULL) {
+        tail->next = command;
+    } else {
+        head = command;
+    }
+    tail = command;
+    queued++;
+    pthread_cond_signal(&queueChanged);
+    pthread_mutex_unlock(&queueLock);
+    return 1;
+}
+
+void adminSuspend(void) {
+    pthread_mutex_lock(&commandLock);
+}
+
+void adminPrintStats(void) {
+    infoPrint("STATS admin: %zu commands run, %zu kicks, %zu rejected for a full queue, "
+              "latency p50 %.1f us, p99 %.1f us, max %.1f us",
+              histogramCount(&latency), atomic_load(&kicks), atomic_load(&rejected),
+              (double) histogramPercentile(&latency, 0.5) / 1000.0,
+              (double) histogramPercentile(&latency, 0.99) / 1000.0, (double) histogramMax(&latency) / 1000.0);
+}
@@ -0,0 +1,29 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdint.h>
+
+#define ADMIN_NAME "Admin"
+// commands waiting for the executor, the admin is told about the general problem beyond that
+#define ADMIN_QUEUE_MAX 64
+
+#define ADMIN_COMMAND_KICK 0
+#define ADMIN_COMMAND_PAUSE 1
+#define ADMIN_COMMAND_RESUME 2
+#define ADMIN_COMMAND_STATS 3
+
+// starts the thread that runs the admin's commands one after another, the admin's own thread or
+// reactor only queues them and keeps serving its socket
+int adminStart(void);
+
+// queues a command of the admin with the given user id, argument is the user to kick; returns -1
+// if the queue is full
+int adminSubmit(int type, uint32_t adminId, const char *argument);
+
+// waits for the command being run and keeps the executor from starting another one, no user is
+// kicked afterwards; used before the users are handed over to the next process
+void adminSuspend(void);
+
+void adminPrintStats(void);
+
+#endif
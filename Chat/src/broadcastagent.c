@@ -3,82 +3,293 @@
 #include "protocol.h"
 #include "broadcastagent.h"
 #include <stdlib.h>
-#include <semaphore.h>
 #include <errno.h>
 #include "user.h"
 #include "util.h"
+#include "mpscring.h"
+#include "frame.h"
+#include "room.h"
+#include "history.h"
+#include "journal.h"
+#include "credit.h"
+#include "cluster.h"
+#include <time.h>
+#include <stdatomic.h>
+#include <stdio.h>
 
-static mqd_t messageQueue;
-static pthread_t threadId;
-static sem_t queueLock;
+// each worker has its own queue, a room always goes to the same worker
+typedef struct BroadcastWorker {
+    pthread_t thread;
+    int index;
+    MpscRing ring;
+    mqd_t queue;
+} BroadcastWorker;
 
-static int full;
+static int queueBackend = BROADCAST_QUEUE_RING;
+static BroadcastWorker *workers = NULL;
+static int workerCount = 1;
+static pthread_mutex_t pauseLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pauseChanged = PTHREAD_COND_INITIALIZER;
+static int paused = 0;
+
+// puts that found their worker's queue full and had to wait
+static atomic_size_t putWaits = 0;
+// reactors holding back messages for a full queue, any worker that makes room resumes them all
+static pthread_mutex_t waitLock = PTHREAD_MUTEX_INITIALIZER;
+static BroadcastWaiter *waiters = NULL;
+static atomic_int waiting = 0;
+// messages accepted by broadcastAgentPut() and messages a worker is done with
+static atomic_size_t queued = 0;
+static atomic_size_t delivered = 0;
 
 void *pauseServer(void) {
-    sem_wait(&queueLock);
+    pthread_mutex_lock(&pauseLock);
+    paused = 1;
+    pthread_mutex_unlock(&pauseLock);
     return NULL;
 }
 
 void *resumeServer(void) {
-    sem_post(&queueLock);
+    pthread_mutex_lock(&pauseLock);
+    paused = 0;
+    pthread_cond_broadcast(&pauseChanged);
+    pthread_mutex_unlock(&pauseLock);
     return NULL;
 }
 
+static void waitWhilePaused(void) {
+    pthread_mutex_lock(&pauseLock);
+    while (paused) {
+        pthread_cond_wait(&pauseChanged, &pauseLock);
+    }
+    pthread_mutex_unlock(&pauseLock);
+}
+
+static void resumeWaiters(void) {
+    pthread_mutex_lock(&waitLock);
+    BroadcastWaiter *waiter = waiters;
+    waiters = NULL;
+    atomic_store(&waiting, 0);
+    while (waiter != NULL) {
+        BroadcastWaiter *next = waiter->next;
+        waiter->queued = 0;
+        waiter->resume(waiter->arg);
+        waiter = next;
+    }
+    pthread_mutex_unlock(&waitLock);
+}
+
 static void *broadcastAgent(void *arg) {
-    sem_init(&queueLock, 0, 1);
-    mqMessage *tmpMessage = malloc(sizeof(mqMessage));
+    BroadcastWorker *worker = (BroadcastWorker *) arg;
+    mqMessage *tmpMessage = allocMqMessage();
 
 
     while (1) {
-        if (mq_receive(messageQueue, (char *) tmpMessage, sizeof(mqMessage), 0) == -1) {
+        if (queueBackend == BROADCAST_QUEUE_RING) {
+            if (mpscRingPop(&worker->ring, tmpMessage) == -1) {
+                errnoPrint("error receiving message from message ring");
+                break;
+            }
+        } else if (mq_receive(worker->queue, (char *) tmpMessage, sizeof(mqMessage), 0) == -1) {
             errnoPrint("error receiving message from message queue");
             break;
         }
-        sem_wait(&queueLock);
-        sendSthTo(tmpMessage);
-        sem_post(&queueLock);
+        // pairs with the fence in broadcastAgentOffer(), one of the two sees the other
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&waiting, memory_order_relaxed)) {
+            resumeWaiters();
+        }
+        waitWhilePaused();
+        if (tmpMessage->room != NULL) {
+            sendSthToUsers(tmpMessage, historyRecord(tmpMessage));
+            roomMembersRelease();
+        } else {
+            sendSthTo(tmpMessage);
+        }
+        // once per peer link, the other nodes deliver it to their own users
+        if (!tmpMessage->fromPeer && tmpMessage->frame != NULL) {
+            clusterForward(tmpMessage->frame, tmpMessage->room != NULL ? tmpMessage->room->name : NULL);
+        }
+        // only copied into the current group, the journal thread does the disk work
+        if (tmpMessage->frame != NULL &&
+            journalAppend(tmpMessage->frame, tmpMessage->room != NULL ? tmpMessage->room->name : NULL) == -1) {
+            errnoPrint("could not journal message");
+        }
+        // queues that could not send right away hold their own reference
+        frameRelease(tmpMessage->frame);
+        tmpMessage->frame = NULL;
+        roomRelease(tmpMessage->room);
+        tmpMessage->room = NULL;
+        // lets the sender's reader go on if it ran out of credits
+        creditReturn(tmpMessage->credit);
+        tmpMessage->credit = NULL;
+        atomic_fetch_add(&delivered, 1);
     }
-    debugPrint("exciting bcastagent");
-    free(tmpMessage);
-    return arg;
+    debugPrint("exciting bcastagent %d", worker->index);
+    freeMqMessage(tmpMessage);
+    return NULL;
 }
 
-int broadcastAgentStart(void) {
+static int openMessageQueue(BroadcastWorker *worker, size_t capacity) {
     struct mq_attr mq_attr;
+    char name[64];
 
-    mq_attr.mq_maxmsg = 10;
+    mq_attr.mq_maxmsg = (long) capacity;
     mq_attr.mq_msgsize = sizeof(mqMessage);
     mq_attr.mq_flags = 0;
 
-    if ((messageQueue = mq_open(QUEUE_NAME, O_RDWR | O_CREAT, 0660, &mq_attr)) == -1) {
-        errnoPrint("error creating message queue");
+    snprintf(name, sizeof(name), "%s_%d", QUEUE_NAME, worker->index);
+    if ((worker->queue = mq_open(name, O_RDWR | O_CREAT, 0660, &mq_attr)) == -1) {
+        errnoPrint("error creating message queue (mq_maxmsg %zu, see /proc/sys/fs/mqueue/msg_max)", capacity);
         return -1;
     }
-    if (mq_unlink(QUEUE_NAME) == -1) {
+    if (mq_unlink(name) == -1) {
         errnoPrint("error unlinking message queue");
         return -1;
     }
-    if (pthread_create(&threadId, NULL, broadcastAgent, NULL) != 0) {
-        errnoPrint("error creating broadcast agent's thread");
+    return 1;
+}
+
+int broadcastAgentStart(int backend, size_t capacity, int count) {
+    queueBackend = backend;
+    if ((workers = calloc((size_t) count, sizeof(BroadcastWorker))) == NULL) {
+        errnoPrint("error allocating broadcast workers");
         return -1;
     }
+    workerCount = count;
+    for (int i = 0; i < count; ++i) {
+        BroadcastWorker *worker = &workers[i];
+        worker->index = i;
+        if (backend == BROADCAST_QUEUE_RING) {
+            if (mpscRingInit(&worker->ring, capacity, sizeof(mqMessage)) == -1) {
+                errnoPrint("error creating message ring");
+                return -1;
+            }
+        } else if (openMessageQueue(worker, capacity) == -1) {
+            return -1;
+        }
+        if (pthread_create(&worker->thread, NULL, broadcastAgent, worker) != 0) {
+            errnoPrint("error creating broadcast agent's thread");
+            return -1;
+        }
+    }
+    debugPrint("%d broadcast workers, %s queues with %zu slots", count,
+               backend == BROADCAST_QUEUE_RING ? "ring" : "mq", capacity);
     return 1;
 }
 
+int broadcastAgentWorkers(void) {
+    return workerCount;
+}
+
+// the ring has no blocking push, a full one is polled until the deadline
+static int pushRing(BroadcastWorker *worker, mqMessage *msg, const struct timespec *deadline) {
+    static const struct timespec retry = {.tv_sec = 0, .tv_nsec = BROADCAST_PUT_RETRY_US * 1000};
+    struct timespec now;
+
+    while (mpscRingPush(&worker->ring, msg) == -1) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        nanosleep(&retry, NULL);
+    }
+    return 1;
+}
 
 int broadcastAgentPut(mqMessage *msg) {
-    struct timespec *abs_timeout = malloc(sizeof(struct timespec));
-    abs_timeout->tv_nsec = 25;
-    abs_timeout->tv_sec = 0;
-    if (mq_timedsend(messageQueue, (char *) msg, sizeof(mqMessage), 0, abs_timeout) == -1) {
-        full = 1;
-    } else {
-        full = 0;
+    BroadcastWorker *worker = &workers[msg->room != NULL ? msg->room->worker : 0];
+    struct timespec deadline;
+
+    // counted up front, a drain that sees the put may only end once the worker is done with it
+    atomic_fetch_add(&queued, 1);
+    if (queueBackend == BROADCAST_QUEUE_RING && mpscRingPush(&worker->ring, msg) == 1) {
+        return 1;
+    }
+    // senders are limited by their credits, so this only happens when many of them are busy at once
+    atomic_fetch_add(&putWaits, 1);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += BROADCAST_PUT_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (BROADCAST_PUT_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    if (queueBackend == BROADCAST_QUEUE_RING) {
+        if (pushRing(worker, msg, &deadline) == -1) {
+            atomic_fetch_sub(&queued, 1);
+            return -1;
+        }
+        return 1;
+    }
+    while (mq_timedsend(worker->queue, (char *) msg, sizeof(mqMessage), 0, &deadline) == -1) {
+        if (errno != EINTR) {
+            atomic_fetch_sub(&queued, 1);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// one attempt without waiting, the caller counted the message as queued already
+static int pushNow(mqMessage *msg) {
+    static const struct timespec now = {.tv_sec = 0, .tv_nsec = 0};
+    BroadcastWorker *worker = &workers[msg->room != NULL ? msg->room->worker : 0];
+
+    if (queueBackend == BROADCAST_QUEUE_RING) {
+        return mpscRingPush(&worker->ring, msg) == 1;
+    }
+    // a deadline in the past only fails if the queue is full
+    while (mq_timedsend(worker->queue, (char *) msg, sizeof(mqMessage), 0, &now) == -1) {
+        if (errno != EINTR) {
+            return 0;
+        }
     }
     return 1;
 }
 
-int isMqFull(void) {
-    debugPrint("returning full with %d", full);
-    return full;
+int broadcastAgentTryPut(mqMessage *msg) {
+    atomic_fetch_add(&queued, 1);
+    if (pushNow(msg)) {
+        return 1;
+    }
+    atomic_fetch_sub(&queued, 1);
+    atomic_fetch_add(&putWaits, 1);
+    return 0;
+}
+
+int broadcastAgentOffer(mqMessage *msg, BroadcastWaiter *waiter) {
+    atomic_fetch_add(&queued, 1);
+    if (pushNow(msg)) {
+        return 1;
+    }
+    pthread_mutex_lock(&waitLock);
+    if (!waiter->queued) {
+        waiter->queued = 1;
+        waiter->next = waiters;
+        waiters = waiter;
+    }
+    atomic_store(&waiting, 1);
+    pthread_mutex_unlock(&waitLock);
+    // a worker that made room before the waiter was queued did not resume it, so try once more
+    atomic_thread_fence(memory_order_seq_cst);
+    if (pushNow(msg)) {
+        return 1;
+    }
+    atomic_fetch_sub(&queued, 1);
+    return 0;
+}
+
+void broadcastAgentDrain(void) {
+    static const struct timespec interval = {.tv_sec = 0, .tv_nsec = 1000000};
+
+    resumeServer();
+    while (atomic_load(&delivered) < atomic_load(&queued)) {
+        nanosleep(&interval, NULL);
+    }
+}
+
+size_t broadcastAgentPutWaits(void) {
+    return atomic_load(&putWaits);
 }
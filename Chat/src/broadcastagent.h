@@ -2,20 +2,55 @@
 #define BROADCASTAGENT_H
 #define QUEUE_NAME "/message_queue"
 
+#define BROADCAST_QUEUE_RING 0
+#define BROADCAST_QUEUE_MQ 1
+#define BROADCAST_QUEUE_DEFAULT_CAPACITY 1024
+#define BROADCAST_QUEUE_MQ_DEFAULT_CAPACITY 10
+#define BROADCAST_WORKERS_MAX 64
+// how long a put waits for room in a full queue before the message is refused
+#define BROADCAST_PUT_TIMEOUT_MS 1000
+#define BROADCAST_PUT_RETRY_US 50
+
 
 #include "user.h"
 #include "protocol.h"
 
 struct User;
 
-int broadcastAgentStart(void);
+// backend is BROADCAST_QUEUE_RING or BROADCAST_QUEUE_MQ, capacity is the number of queued messages
+// per worker, every worker has its own queue and thread
+int broadcastAgentStart(int backend, size_t capacity, int workers);
+
+int broadcastAgentWorkers(void);
 
+// hands msg (and its references to msg->frame, msg->room and msg->credit) to the worker of
+// msg->room, waits while that worker's queue is full, returns -1 if it stays full too long
 int broadcastAgentPut(mqMessage *msg);
 
+// a reactor holding back a message until there is room again, reused for every wait
+typedef struct BroadcastWaiter {
+    struct BroadcastWaiter *next;
+    int queued;
+    void (*resume)(void *arg);
+    void *arg;
+} BroadcastWaiter;
+
+// like broadcastAgentPut() but never waits: returns 0 if the worker's queue is full, msg keeps its
+// references then
+int broadcastAgentTryPut(mqMessage *msg);
+
+// tries msg once more, if the queue is still full returns 0 and calls waiter->resume(waiter->arg)
+// once a worker took a message off its queue; the waiter offers its messages again then
+int broadcastAgentOffer(mqMessage *msg, BroadcastWaiter *waiter);
+
+size_t broadcastAgentPutWaits(void);
+
+// resumes a paused server and returns once every message put so far has been delivered, the
+// callers must have stopped putting new ones
+void broadcastAgentDrain(void);
+
 void *pauseServer(void);
 
 void *resumeServer(void);
 
-int isMqFull(void);
-
 #endif
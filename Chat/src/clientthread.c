@@ -6,102 +6,199 @@
 #include <errno.h>
 #include "protocol.h"
 #include "broadcastagent.h"
+#include "sendqueue.h"
+#include "frame.h"
+#include "receivebuffer.h"
+#include "room.h"
+#include "history.h"
+#include "credit.h"
+#include "idle.h"
+#include "upgrade.h"
+#include "connectionhandler.h"
 
 
-void *clientthread(void *arg) {
-    char userName[31];
-    char msg[512];
-    int code;
-    int checkStatus = 1;
-
+static int loginFailed(int code) {
+    return code == -1 || code == LOGIN_RESPONSE_STATUS_NAME_TAKEN || code == LOGIN_RESPONSE_STATUS_NAME_INVALID ||
+           code == LOGIN_RESPONSE_STATUS_PROTOCOL_VERSION_MISMATCH ||
+           code == LOGIN_RESPONSE_STATUS_OTHER_SERVER_ERROR;
+}
 
-    debugPrint("Client thread[%zi] started.", (ssize_t) pthread_self());
+int clientLogin(User **user, message *buffer) {
+    User *thisUser = *user;
+    User *preLoginUser = thisUser;
+    uint8_t version = VERSION;
+    int code;
 
-    User *thisUser = (User *) arg;
-    mqMessage *testMessage = malloc(sizeof(mqMessage));
-    message *newMessage = malloc(sizeof(message));
+    code = receiveLoginRequest(buffer, thisUser->socketFileDescriptor);
+    // a version we do not speak is answered in version 0
+    if (code != -1 && buffer->messageBody.loginRequest.version <= VERSION_MAX) {
+        version = buffer->messageBody.loginRequest.version;
+    }
+    if (!loginFailed(code)) {
+        debugPrint("name = %s", buffer->messageBody.loginRequest.name);
+        memset(thisUser->name, 0, sizeof(thisUser->name));
+        strncpy(thisUser->name, buffer->messageBody.loginRequest.name, sizeof(thisUser->name) - 1);
+        thisUser = addNewUser(thisUser->thread, thisUser->socketFileDescriptor, thisUser->name, version);
+        if (thisUser == NULL) {
+            releaseUserName(preLoginUser->name);
+            return -1;
+        }
+        // the list holds its own copy, the placeholder from accept() is not needed anymore
+        freeUser(preLoginUser);
+        *user = thisUser;
+    }
+    if (sendLoginResponse(buffer, thisUser->socketFileDescriptor, (uint8_t) code, version) == -1 || loginFailed(code)) {
+        return -1;
+    }
+    debugPrint("sent login response to %s", thisUser->name);
+    // replays the recent messages of the room right after the login response
+    if (historyJoin(thisUser) == -1) {
+        errnoPrint("could not put %s into room %s", thisUser->name, ROOM_DEFAULT_NAME);
+        return -1;
+    }
+    if (notifyUserAdded(thisUser) == -1) {
+        return -1;
+    }
+    if (idleTrack(thisUser) == -1) {
+        errnoPrint("could not watch %s for idleness", thisUser->name);
+        return -1;
+    }
+    return 1;
+}
 
-    if (newMessage == NULL) {
-        errno = ENOMEM;
-        return NULL;
+int clientClosed(User *thisUser) {
+    // a kicked or evicted user has already been announced as removed
+    if (atomic_exchange(&thisUser->kicked, 1) == 0 &&
+        notifyUserRemoved(thisUser, sendQueueOverflowed(thisUser->socketFileDescriptor)
+                                    ? USER_REMOVED_STATUS_KICKED_FROM_SERVER
+                                    : USER_REMOVED_STATUS_CONN_CLOSED_BY_CLIENT) == -1) {
+        errnoPrint("failed to notifyUserRemoved");
+        return -1;
     }
-    memset(newMessage, 0, sizeof(message));
+    return 0;
+}
 
-    receiveHeader(&newMessage->messageHeader, thisUser->socketFileDescriptor);
-    if (newMessage->messageHeader.type == LOGIN_REQUEST) {
-        if ((code = receiveLoginRequest(newMessage,
-                                        thisUser->socketFileDescriptor)) == -1 ||
-            code == LOGIN_RESPONSE_STATUS_NAME_TAKEN || code == LOGIN_RESPONSE_STATUS_NAME_INVALID ||
-            code == LOGIN_RESPONSE_STATUS_PROTOCOL_VERSION_MISMATCH ||
-            code == LOGIN_RESPONSE_STATUS_OTHER_SERVER_ERROR) {
-        } else {
-            debugPrint("name = %s", newMessage->messageBody.loginRequest.name);
-            memset(userName, 0, sizeof(userName));
-            memset(thisUser->name,0,sizeof(thisUser->name));
-            strncpy(userName, newMessage->messageBody.loginRequest.name,
-                    strlen(newMessage->messageBody.loginRequest.name));
-            strncpy(thisUser->name, userName, strlen(userName));
-            testMessage->user = thisUser;
-            thisUser = addNewUser(thisUser->thread, thisUser->socketFileDescriptor, thisUser->name);
-        }
-        if (sendLoginResponse(newMessage, thisUser->socketFileDescriptor, (uint8_t) code) == -1 ||
-            code == LOGIN_RESPONSE_STATUS_NAME_TAKEN || code == LOGIN_RESPONSE_STATUS_NAME_INVALID ||
-            code == LOGIN_RESPONSE_STATUS_PROTOCOL_VERSION_MISMATCH ||
-            code == LOGIN_RESPONSE_STATUS_OTHER_SERVER_ERROR) {
-        } else {
-            debugPrint("sent login response to %s", thisUser->name);
-            if (notifyUserAdded(thisUser) == -1) {
-                checkStatus = -1;
-            }
-            unlockMutex();
-            while (checkStatus == 1) {
-                memset(testMessage->message.messageBody.server2Client.text, 0,
-                       sizeof(testMessage->message.messageBody.server2Client.text));
-                if (receiveHeader(&newMessage->messageHeader, thisUser->socketFileDescriptor) == 0) {
-                    debugPrint("header = 0, closing..");
-                    if (notifyUserRemoved(thisUser, USER_REMOVED_STATUS_CONN_CLOSED_BY_CLIENT) == -1) {
-                        errnoPrint("failed to notifyUserRemoved");
-                        return NULL;
-                    }
+int clientReceive(User *thisUser, message *buffer, mqMessage *mqBuffer) {
+    char msg[512];
+
+    idleTouch(thisUser);
+    memset(mqBuffer->message.messageBody.server2Client.text, 0,
+           sizeof(mqBuffer->message.messageBody.server2Client.text));
+    // switch just in case there are more cases to be handled
+    switch (buffer->messageHeader.type) {
+        case CLIENT_2_SERVER:
+            if (receiveClientMessage(buffer, thisUser->socketFileDescriptor) != 1) {
+                // command or malformed text, the frame is consumed either way
+            } else {
+                debugPrint("REDIRECTING MESSAGE TO %d", thisUser->socketFileDescriptor);
+                memset(msg, 0, sizeof(msg));
+                strncpy(msg, buffer->messageBody.client2Server.text,
+                        strlen(buffer->messageBody.client2Server.text));
+                mqBuffer->user = thisUser;
+                if (prepareServerMessage(&mqBuffer->message, thisUser->name,
+                                         SERVER_CODE_CLIENT_MESSAGE,
+                                         msg) == NULL) {
+                    errnoPrint("error preparing server message");
                     break;
                 }
-                // switch just in case there are more cases to be handled
-                switch (newMessage->messageHeader.type) {
-                    case CLIENT_2_SERVER:
-                        if (receiveClientMessage(newMessage,
-                                                 thisUser->socketFileDescriptor) == 0) {
-
-                        } else {
-                            debugPrint("REDIRECTING MESSAGE TO %d", thisUser->socketFileDescriptor);
-                            memset(msg, 0, sizeof(msg));
-                            strncpy(msg, newMessage->messageBody.client2Server.text,
-                                    strlen(newMessage->messageBody.client2Server.text));
-                            if (isMqFull() == 1) {
-                                if (sendServerMessage(newMessage, thisUser->socketFileDescriptor, "",
-                                                      SERVER_CODE_GENERAL_PROBLEMS, "") == -1) {
-                                    errnoPrint("error sending server message");
-                                }
-                            } else {
-                                if (prepareServerMessage(&testMessage->message, thisUser->name,
-                                                         SERVER_CODE_CLIENT_MESSAGE,
-                                                         msg) == NULL) {
-                                    errnoPrint("error preparing server message");
-                                    break;
-                                }
-                                broadcastAgentPut(testMessage);
-                            }
-                        }
-                        break;
-                    default:
-                        break;
+                // encoded once here, the agent and every send queue share this frame
+                if ((mqBuffer->frame = frameFromMessage(&mqBuffer->message)) == NULL) {
+                    errnoPrint("error encoding server message");
+                    break;
                 }
-
+                mqBuffer->frame->sender = thisUser->id;
+                // only the members of the sender's room get it
+                mqBuffer->room = roomRetain(thisUser->room);
+                // the reader checks for a credit before it reads the next frame
+                mqBuffer->credit = creditTake(thisUser->credit);
+                if (connectionHandlerMode() == CONNECTION_MODE_REACTOR) {
+                    if (broadcastAgentTryPut(mqBuffer) == 0) {
+                        return CLIENT_RECEIVE_QUEUE_FULL;
+                    }
+                } else if (broadcastAgentPut(mqBuffer) == -1) {
+                    errnoPrint("broadcast queue stayed full, dropping message of %s", thisUser->name);
+                    frameRelease(mqBuffer->frame);
+                    roomRelease(mqBuffer->room);
+                    creditReturn(mqBuffer->credit);
+                    if (sendServerMessage(buffer, thisUser->socketFileDescriptor, "",
+                                          SERVER_CODE_GENERAL_PROBLEMS, "") == -1) {
+                        errnoPrint("error sending server message");
+                    }
+                }
+                mqBuffer->frame = NULL;
+                mqBuffer->room = NULL;
+                mqBuffer->credit = NULL;
             }
+            break;
+        default:
+            break;
+    }
+    return 1;
+}
+
+// reads the frames of a logged in user until the connection ends, or parks it for a handover
+static void serve(User *thisUser, ReceiveBuffer *receiveBuffer, message *newMessage, mqMessage *testMessage) {
+    int result;
+
+    while ((result = receiveFrame(receiveBuffer, newMessage, thisUser->socketFileDescriptor)) > 0 &&
+           clientReceive(thisUser, newMessage, testMessage) == 1) {
+        // the socket is not read while the broadcast agent holds all of this user's credits
+        creditWait(thisUser->credit);
+    }
+    if (upgradeRequested()) {
+        upgradePark(thisUser, receiveBuffer);
+        upgradeWait();
+    }
+    if (result <= 0) {
+        debugPrint("receive = %d, closing..", result);
+        clientClosed(thisUser);
+    }
+}
+
+static void *clientStart(User *thisUser, size_t resumed) {
+    mqMessage *testMessage = allocMqMessage();
+    message *newMessage = allocMessage();
+    ReceiveBuffer *receiveBuffer = receiveBufferCreate();
+
+    if (newMessage == NULL || testMessage == NULL || receiveBuffer == NULL) {
+        freeMessage(newMessage);
+        freeMqMessage(testMessage);
+        if (receiveBuffer != NULL) {
+            receiveBufferDestroy(receiveBuffer);
         }
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (thisUser == NULL) {
+        // taken over from the previous process, logged in long ago
+        thisUser = upgradeResume(resumed, receiveBuffer);
+        serve(thisUser, receiveBuffer, newMessage, testMessage);
+    } else if (receiveFrame(receiveBuffer, newMessage, thisUser->socketFileDescriptor) > 0 &&
+               newMessage->messageHeader.type == LOGIN_REQUEST &&
+               clientLogin(&thisUser, newMessage) == 1) {
+        receiveBuffer->version = thisUser->version;
+        serve(thisUser, receiveBuffer, newMessage, testMessage);
     }
     debugPrint("Client thread[%zi] stopping.", (ssize_t) pthread_self());
     infoPrint("User %s disconnected!", thisUser->name);
+    upgradeForgetReader(thisUser);
     removeUser(thisUser);
-    free(newMessage);
+    receiveBufferDestroy(receiveBuffer);
+    freeMessage(newMessage);
+    freeMqMessage(testMessage);
     return NULL;
 }
+
+// nobody joins a reader, it ends once its connection does
+void *clientthread(void *arg) {
+    pthread_detach(pthread_self());
+    debugPrint("Client thread[%zi] started.", (ssize_t) pthread_self());
+    return clientStart((User *) arg, 0);
+}
+
+void *clientResume(void *arg) {
+    pthread_detach(pthread_self());
+    debugPrint("Client thread[%zi] resumed.", (ssize_t) pthread_self());
+    return clientStart(NULL, (size_t) arg);
+}
@@ -1,6 +1,24 @@
 #ifndef CLIENTTHREAD_H
 #define CLIENTTHREAD_H
 
+#include "user.h"
+
 void *clientthread(void *arg);
 
+// serves a user taken over from the previous process, arg is the index of its upgrade session
+void *clientResume(void *arg);
+
+// login handshake for a connection whose LOGIN_REQUEST frame is already in buffer,
+// on success *user is replaced by the registered user
+int clientLogin(User **user, message *buffer);
+
+// the message is still in mqBuffer with its references: a reactor does not wait for a full broadcast queue
+#define CLIENT_RECEIVE_QUEUE_FULL 2
+
+// handles one complete frame of a logged in user, returns 1 to keep the connection
+int clientReceive(User *thisUser, message *buffer, mqMessage *mqBuffer);
+
+// announces the end of a logged in user's stream to the others
+int clientClosed(User *thisUser);
+
 #endif
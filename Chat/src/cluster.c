@@ -0,0 +1,989 @@
+#define _GNU_SOURCE
+
+#include "cluster.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include "util.h"
+#include "user.h"
+#include "room.h"
+#include "frame.h"
+#include "epoch.h"
+#include "registry.h"
+#include "broadcastagent.h"
+#include "credit.h"
+
+#define HEADER_SIZE 5
+// a version 0 message to clients: header, timestamp and sender name before the text
+#define CHAT_FRAME_MIN (sizeof(messageHeader) + SERVER_2_CLIENT_MIN_LENGTH)
+
+// a message waiting for the link's writer: header and small parts, then a chat frame shared with the clients
+typedef struct Outbound {
+    struct Outbound *next;
+    Frame *frame;
+    size_t length;
+    unsigned char bytes[];
+} Outbound;
+
+typedef struct Peer {
+    int fd;
+    uint64_t nodeId;
+    char address[64];
+    // guards the outbound queue; senders only queue, the link's writer thread does the blocking writes
+    pthread_mutex_t writeLock;
+    pthread_cond_t queued;
+    Outbound *head;
+    Outbound *tail;
+    size_t queuedBytes;
+    // a failed write or a full queue marks the link broken and shuts it down
+    int broken;
+    int closing;
+    pthread_t writer;
+    // only touched by the link's reader
+    unsigned char *buffer;
+    size_t start;
+    size_t end;
+} Peer;
+
+// a logged in user of this node (nodeId 0) or of a peer, with the id local clients know it by
+typedef struct ClusterName {
+    struct ClusterName *next;
+    char name[USERNAME_MAX + 1];
+    uint32_t id;
+    uint64_t nodeId;
+} ClusterName;
+
+// a login waiting for the peers to agree on its name
+typedef struct Claim {
+    struct Claim *next;
+    uint32_t sequence;
+    const char *name;
+    uint64_t asked[CLUSTER_PEERS_MAX];
+    size_t waiting;
+    int refused;
+} Claim;
+
+static int enabled = 0;
+static uint64_t nodeId = 0;
+
+// guards names and claims; presence is queued under it, so every link sees one order of events
+static pthread_mutex_t clusterLock = PTHREAD_MUTEX_INITIALIZER;
+// taken before clusterLock is let go: local users are told about remote users in the same order,
+// without holding up claims and chat frames meanwhile
+static pthread_mutex_t presenceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t claimAnswered = PTHREAD_COND_INITIALIZER;
+static ClusterName *names[CLUSTER_NAME_BUCKETS];
+static Claim *claims = NULL;
+static uint32_t claimSequence = 0;
+
+// guards the peer list, senders hold it shared while they queue
+static pthread_rwlock_t peersLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static Peer *peers[CLUSTER_PEERS_MAX];
+static int peerCount = 0;
+
+static atomic_size_t forwarded = 0;
+static atomic_size_t received = 0;
+static atomic_size_t dropped = 0;
+static atomic_size_t claimsAsked = 0;
+static atomic_size_t claimsRefused = 0;
+static atomic_size_t conflicts = 0;
+
+static void putUint32(unsigned char *bytes, uint32_t value) {
+    value = htonl(value);
+    memcpy(bytes, &value, sizeof(value));
+}
+
+static uint32_t getUint32(const unsigned char *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return ntohl(value);
+}
+
+static ClusterName **findName(const char *name, uint64_t node) {
+    ClusterName **link = &names[registryHashName(name) % CLUSTER_NAME_BUCKETS];
+    while (*link != NULL && (strncmp((*link)->name, name, USERNAME_MAX + 1) != 0 || (*link)->nodeId != node)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// caller holds clusterLock
+static int nameKnown(const char *name) {
+    for (ClusterName *entry = names[registryHashName(name) % CLUSTER_NAME_BUCKETS]; entry != NULL;
+         entry = entry->next) {
+        if (strncmp(entry->name, name, USERNAME_MAX + 1) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static ClusterName *addName(const char *name, uint32_t id, uint64_t node) {
+    ClusterName *entry = calloc(1, sizeof(ClusterName));
+    if (entry == NULL) {
+        return NULL;
+    }
+    strncpy(entry->name, name, USERNAME_MAX);
+    entry->id = id;
+    entry->nodeId = node;
+    ClusterName **bucket = &names[registryHashName(name) % CLUSTER_NAME_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+// caller holds the peer's writeLock, the link's reader sees the shutdown and removes the peer
+static void dropPeer(Peer *peer) {
+    peer->broken = 1;
+    shutdown(peer->fd, SHUT_RDWR);
+    pthread_cond_signal(&peer->queued);
+}
+
+// queues a message of the given parts, followed by frame unless it is NULL; never blocks, a peer that
+// falls CLUSTER_QUEUE_MAX bytes behind is dropped
+static int peerSend(Peer *peer, uint8_t type, const struct iovec *parts, int count, Frame *frame) {
+    size_t length = 0;
+
+    for (int i = 0; i < count; ++i) {
+        length += parts[i].iov_len;
+    }
+    Outbound *outbound = malloc(sizeof(Outbound) + HEADER_SIZE + length);
+    pthread_mutex_lock(&peer->writeLock);
+    if (outbound == NULL || peer->broken ||
+        peer->queuedBytes + HEADER_SIZE + length + (frame != NULL ? frame->length : 0) > CLUSTER_QUEUE_MAX) {
+        if (!peer->broken) {
+            errorPrint("%s, dropping peer %s", outbound == NULL ? "out of memory" : "peer falls behind",
+                       peer->address);
+            dropPeer(peer);
+        }
+        pthread_mutex_unlock(&peer->writeLock);
+        free(outbound);
+        return -1;
+    }
+    outbound->next = NULL;
+    outbound->frame = frame != NULL ? frameRetain(frame) : NULL;
+    outbound->length = HEADER_SIZE;
+    outbound->bytes[0] = type;
+    putUint32(outbound->bytes + 1, (uint32_t) (length + (frame != NULL ? frame->length : 0)));
+    for (int i = 0; i < count; ++i) {
+        memcpy(outbound->bytes + outbound->length, parts[i].iov_base, parts[i].iov_len);
+        outbound->length += parts[i].iov_len;
+    }
+    if (peer->tail != NULL) {
+        peer->tail->next = outbound;
+    } else {
+        peer->head = outbound;
+    }
+    peer->tail = outbound;
+    peer->queuedBytes += outbound->length + (frame != NULL ? frame->length : 0);
+    pthread_cond_signal(&peer->queued);
+    pthread_mutex_unlock(&peer->writeLock);
+    return 1;
+}
+
+static size_t outboundFree(Outbound *outbound) {
+    size_t length = outbound->length;
+    if (outbound->frame != NULL) {
+        length += outbound->frame->length;
+        frameRelease(outbound->frame);
+    }
+    free(outbound);
+    return length;
+}
+
+// blocks for at most CLUSTER_SEND_TIMEOUT_MS while the peer takes nothing
+static int writeOutbound(Peer *peer, const Outbound *outbound) {
+    struct iovec iov[2] = {{.iov_base = (void *) outbound->bytes, .iov_len = outbound->length},
+                           {.iov_base = outbound->frame != NULL ? outbound->frame->data : NULL,
+                            .iov_len = outbound->frame != NULL ? outbound->frame->length : 0}};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = outbound->frame != NULL ? 2 : 1;
+    while (message.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(peer->fd, &message, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (message.msg_iovlen > 0 && (size_t) sent >= message.msg_iov->iov_len) {
+            sent -= (ssize_t) message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (char *) message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= (size_t) sent;
+        }
+    }
+    return 1;
+}
+
+// takes everything queued at once and writes it without the lock, until the link breaks or closes
+static void *peerWriter(void *arg) {
+    Peer *peer = (Peer *) arg;
+
+    pthread_mutex_lock(&peer->writeLock);
+    for (;;) {
+        while (peer->head == NULL && !peer->broken && !peer->closing) {
+            pthread_cond_wait(&peer->queued, &peer->writeLock);
+        }
+        if (peer->broken || peer->closing) {
+            break;
+        }
+        Outbound *batch = peer->head;
+        peer->head = peer->tail = NULL;
+        pthread_mutex_unlock(&peer->writeLock);
+        size_t written = 0;
+        int error = 0;
+        while (batch != NULL) {
+            Outbound *next = batch->next;
+            if (error == 0 && writeOutbound(peer, batch) == -1) {
+                error = errno;
+            }
+            written += outboundFree(batch);
+            batch = next;
+        }
+        pthread_mutex_lock(&peer->writeLock);
+        peer->queuedBytes -= written;
+        if (error != 0 && !peer->broken) {
+            errno = error;
+            errnoPrint("peer %s does not take messages, dropping it", peer->address);
+            dropPeer(peer);
+        }
+    }
+    pthread_mutex_unlock(&peer->writeLock);
+    return NULL;
+}
+
+// the next message of the link, *payload points into the peer's buffer until the next call
+static int peerReceive(Peer *peer, uint8_t *type, unsigned char **payload, uint32_t *length) {
+    for (;;) {
+        size_t available = peer->end - peer->start;
+        if (available >= HEADER_SIZE) {
+            *length = getUint32(peer->buffer + peer->start + 1);
+            if (*length > CLUSTER_PAYLOAD_MAX) {
+                errorPrint("peer %s sent a message of %u bytes", peer->address, *length);
+                return -1;
+            }
+            if (available >= HEADER_SIZE + *length) {
+                *type = peer->buffer[peer->start];
+                *payload = peer->buffer + peer->start + HEADER_SIZE;
+                peer->start += HEADER_SIZE + *length;
+                return 1;
+            }
+        }
+        if (peer->start > 0) {
+            memmove(peer->buffer, peer->buffer + peer->start, available);
+            peer->start = 0;
+            peer->end = available;
+        }
+        ssize_t bytesRead = recv(peer->fd, peer->buffer + peer->end, HEADER_SIZE + CLUSTER_PAYLOAD_MAX - peer->end, 0);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return (int) bytesRead;
+        }
+        peer->end += (size_t) bytesRead;
+    }
+}
+
+// caller holds clusterLock, presence is queued to every peer in the order the lock is taken
+static void sendPresence(uint8_t type, const char *name, const uint8_t *code) {
+    struct iovec parts[2];
+    int count = 0;
+
+    if (code != NULL) {
+        parts[count].iov_base = (void *) code;
+        parts[count++].iov_len = 1;
+    }
+    parts[count].iov_base = (void *) name;
+    parts[count++].iov_len = strnlen(name, USERNAME_MAX);
+    pthread_rwlock_rdlock(&peersLock);
+    for (int i = 0; i < peerCount; ++i) {
+        peerSend(peers[i], type, parts, count, NULL);
+    }
+    pthread_rwlock_unlock(&peersLock);
+}
+
+int clusterEnabled(void) {
+    return enabled;
+}
+
+int clusterClaimName(const char *name) {
+    Claim claim;
+    struct timespec deadline;
+    uint8_t sequence[sizeof(uint32_t)];
+
+    if (!enabled) {
+        return 1;
+    }
+    memset(&claim, 0, sizeof(claim));
+    claim.name = name;
+    pthread_mutex_lock(&clusterLock);
+    if (nameKnown(name)) {
+        pthread_mutex_unlock(&clusterLock);
+        return -1;
+    }
+    claim.sequence = ++claimSequence;
+    pthread_rwlock_rdlock(&peersLock);
+    for (int i = 0; i < peerCount; ++i) {
+        claim.asked[claim.waiting++] = peers[i]->nodeId;
+    }
+    pthread_rwlock_unlock(&peersLock);
+    if (claim.waiting == 0) {
+        pthread_mutex_unlock(&clusterLock);
+        return 1;
+    }
+    claim.next = claims;
+    claims = &claim;
+    pthread_mutex_unlock(&clusterLock);
+
+    // a peer that is dropped meanwhile is taken off the claim by its reader
+    putUint32(sequence, claim.sequence);
+    struct iovec parts[2] = {{.iov_base = sequence, .iov_len = sizeof(sequence)},
+                             {.iov_base = (void *) name, .iov_len = strnlen(name, USERNAME_MAX)}};
+    pthread_rwlock_rdlock(&peersLock);
+    for (int i = 0; i < peerCount; ++i) {
+        peerSend(peers[i], CLUSTER_CLAIM, parts, 2, NULL);
+    }
+    pthread_rwlock_unlock(&peersLock);
+    atomic_fetch_add(&claimsAsked, 1);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += CLUSTER_CLAIM_TIMEOUT_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_mutex_lock(&clusterLock);
+    while (claim.waiting > 0 && !claim.refused) {
+        if (pthread_cond_timedwait(&claimAnswered, &clusterLock, &deadline) == ETIMEDOUT) {
+            errorPrint("peers did not answer the claim of %s in time", name);
+            claim.refused = 1;
+        }
+    }
+    Claim **link = &claims;
+    while (*link != &claim) {
+        link = &(*link)->next;
+    }
+    *link = claim.next;
+    pthread_mutex_unlock(&clusterLock);
+    if (claim.refused) {
+        atomic_fetch_add(&claimsRefused, 1);
+        return -1;
+    }
+    return 1;
+}
+
+// caller holds clusterLock
+static void answered(Claim *claim, uint64_t node, int granted) {
+    for (size_t i = 0; i < claim->waiting; ++i) {
+        if (claim->asked[i] == node) {
+            claim->asked[i] = claim->asked[--claim->waiting];
+            claim->refused |= !granted;
+            pthread_cond_broadcast(&claimAnswered);
+            return;
+        }
+    }
+}
+
+static void handleClaim(Peer *peer, const unsigned char *payload, uint32_t length) {
+    char name[USERNAME_MAX + 1];
+    unsigned char answer[sizeof(uint32_t) + 1];
+    int granted;
+
+    if (length < sizeof(uint32_t) || length - sizeof(uint32_t) > USERNAME_MAX) {
+        return;
+    }
+    memset(name, 0, sizeof(name));
+    memcpy(name, payload + sizeof(uint32_t), length - sizeof(uint32_t));
+    pthread_mutex_lock(&clusterLock);
+    granted = !nameKnown(name);
+    Claim *own = claims;
+    while (own != NULL && strncmp(own->name, name, USERNAME_MAX + 1) != 0) {
+        own = own->next;
+    }
+    if (granted && own != NULL) {
+        // both nodes claim it at once: the lower node id wins, the other one is refused there
+        granted = peer->nodeId < nodeId;
+    } else if (granted && testUserName(name) == -1) {
+        granted = 0;
+    }
+    pthread_mutex_unlock(&clusterLock);
+    memcpy(answer, payload, sizeof(uint32_t));
+    answer[sizeof(uint32_t)] = (unsigned char) granted;
+    struct iovec part = {.iov_base = answer, .iov_len = sizeof(answer)};
+    peerSend(peer, CLUSTER_CLAIM_RESULT, &part, 1, NULL);
+}
+
+static void handleClaimResult(Peer *peer, const unsigned char *payload, uint32_t length) {
+    if (length != sizeof(uint32_t) + 1) {
+        return;
+    }
+    uint32_t sequence = getUint32(payload);
+    pthread_mutex_lock(&clusterLock);
+    for (Claim *claim = claims; claim != NULL; claim = claim->next) {
+        if (claim->sequence == sequence) {
+            answered(claim, peer->nodeId, payload[sizeof(uint32_t)]);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clusterLock);
+}
+
+// a name two nodes gave out while they were not linked: the user on the higher node id goes
+static void evictLocal(const char *name) {
+    epochEnter();
+    User *user = findUserByName(name);
+    if (user != NULL && atomic_exchange(&user->kicked, 1) == 0) {
+        infoPrint("User %s also logged in on another node, removing", name);
+        if (notifyUserRemoved(user, USER_REMOVED_STATUS_KICKED_FROM_SERVER) == -1) {
+            errnoPrint("error sending notifyUserRemoved");
+        }
+        // the thread or reactor reading the socket sees the shutdown and removes the user
+        shutdown(user->socketFileDescriptor, SHUT_RDWR);
+        creditInterrupt(user->credit);
+        atomic_fetch_add(&conflicts, 1);
+    }
+    epochExit();
+}
+
+static void handleUserAdded(Peer *peer, const unsigned char *payload, uint32_t length) {
+    char name[USERNAME_MAX + 1];
+    int conflict;
+
+    if (length == 0 || length > USERNAME_MAX) {
+        return;
+    }
+    memset(name, 0, sizeof(name));
+    memcpy(name, payload, length);
+    pthread_mutex_lock(&clusterLock);
+    if (*findName(name, peer->nodeId) != NULL) {
+        pthread_mutex_unlock(&clusterLock);
+        return;
+    }
+    conflict = *findName(name, 0) != NULL && peer->nodeId < nodeId;
+    pthread_mutex_unlock(&clusterLock);
+    if (conflict) {
+        evictLocal(name);
+    }
+    pthread_mutex_lock(&clusterLock);
+    ClusterName *entry = addName(name, userIdIssue(), peer->nodeId);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&clusterLock);
+        errorPrint("out of memory, %s of peer %s is not shown", name, peer->address);
+        return;
+    }
+    uint32_t id = entry->id;
+    pthread_mutex_lock(&presenceLock);
+    pthread_mutex_unlock(&clusterLock);
+    notifyPeerUserAdded(name, id, NULL);
+    pthread_mutex_unlock(&presenceLock);
+}
+
+static void handleUserRemoved(Peer *peer, const unsigned char *payload, uint32_t length) {
+    char name[USERNAME_MAX + 1];
+
+    if (length < 2 || length - 1 > USERNAME_MAX) {
+        return;
+    }
+    memset(name, 0, sizeof(name));
+    memcpy(name, payload + 1, length - 1);
+    pthread_mutex_lock(&clusterLock);
+    ClusterName **link = findName(name, peer->nodeId);
+    ClusterName *entry = *link;
+    if (entry == NULL) {
+        pthread_mutex_unlock(&clusterLock);
+        return;
+    }
+    *link = entry->next;
+    pthread_mutex_lock(&presenceLock);
+    pthread_mutex_unlock(&clusterLock);
+    notifyPeerUserRemoved(entry->name, entry->id, payload[0]);
+    pthread_mutex_unlock(&presenceLock);
+    free(entry);
+}
+
+static void handleChat(Peer *peer, const unsigned char *payload, uint32_t length) {
+    char roomName[ROOM_NAME_MAX + 1];
+    mqMessage message;
+
+    if (length < 1 || length < 1 + (size_t) payload[0] + CHAT_FRAME_MIN || payload[0] > ROOM_NAME_MAX) {
+        return;
+    }
+    size_t roomLength = payload[0];
+    const unsigned char *data = payload + 1 + roomLength;
+    size_t frameLength = length - 1 - roomLength;
+    // relayed as it is, so it has to be a well formed message to clients
+    if (data[0] != SERVER_2_CLIENT || ((size_t) data[1] << 8 | data[2]) != frameLength - sizeof(messageHeader)) {
+        errorPrint("peer %s sent a malformed chat frame", peer->address);
+        return;
+    }
+    memset(&message, 0, sizeof(message));
+    message.fromPeer = 1;
+    if (roomLength > 0) {
+        memcpy(roomName, payload + 1, roomLength);
+        roomName[roomLength] = '\0';
+        // nobody here is in the room
+        if ((message.room = roomFind(roomName)) == NULL) {
+            return;
+        }
+    }
+    if ((message.frame = frameCreate(data, frameLength)) == NULL) {
+        roomRelease(message.room);
+        return;
+    }
+    char sender[sizeof(((server2Client *) NULL)->originalSender) + 1];
+    memset(sender, 0, sizeof(sender));
+    memcpy(sender, data + sizeof(messageHeader) + sizeof(uint64_t), sizeof(sender) - 1);
+    pthread_mutex_lock(&clusterLock);
+    ClusterName *entry = *findName(sender, peer->nodeId);
+    // version 1 clients know the sender by the id this node gave it
+    message.frame->sender = entry != NULL ? entry->id : 0;
+    pthread_mutex_unlock(&clusterLock);
+    atomic_fetch_add(&received, 1);
+    if (broadcastAgentPut(&message) == -1) {
+        errnoPrint("broadcast queue stayed full, dropping message from peer %s", peer->address);
+        frameRelease(message.frame);
+        roomRelease(message.room);
+        atomic_fetch_add(&dropped, 1);
+    }
+}
+
+void clusterUserAdded(User *user) {
+    ClusterName *remote = NULL;
+    size_t count = 0;
+
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&clusterLock);
+    if (addName(user->name, user->id, 0) == NULL) {
+        errorPrint("out of memory, %s is not shown on other nodes", user->name);
+        pthread_mutex_unlock(&clusterLock);
+        return;
+    }
+    sendPresence(CLUSTER_USER_ADDED, user->name, NULL);
+    // the remote users are listed to the new one after the lock is let go
+    for (size_t i = 0; i < CLUSTER_NAME_BUCKETS; ++i) {
+        for (ClusterName *entry = names[i]; entry != NULL; entry = entry->next) {
+            count += entry->nodeId != 0;
+        }
+    }
+    if (count > 0 && (remote = malloc(count * sizeof(ClusterName))) == NULL) {
+        errorPrint("out of memory, the users of other nodes are not listed to %s", user->name);
+    }
+    count = 0;
+    for (size_t i = 0; remote != NULL && i < CLUSTER_NAME_BUCKETS; ++i) {
+        for (ClusterName *entry = names[i]; entry != NULL; entry = entry->next) {
+            if (entry->nodeId != 0) {
+                remote[count++] = *entry;
+            }
+        }
+    }
+    pthread_mutex_lock(&presenceLock);
+    pthread_mutex_unlock(&clusterLock);
+    for (size_t i = 0; i < count; ++i) {
+        notifyPeerUserAdded(remote[i].name, remote[i].id, user);
+    }
+    pthread_mutex_unlock(&presenceLock);
+    free(remote);
+}
+
+void clusterUserRemoved(User *user, uint8_t code) {
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&clusterLock);
+    ClusterName **link = findName(user->name, 0);
+    ClusterName *entry = *link;
+    // only users the peers were told about are taken back
+    if (entry != NULL && entry->id == user->id) {
+        *link = entry->next;
+        sendPresence(CLUSTER_USER_REMOVED, user->name, &code);
+    } else {
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&clusterLock);
+    free(entry);
+}
+
+void clusterForward(Frame *frame, const char *room) {
+    uint8_t roomLength = (uint8_t) (room != NULL ? strnlen(room, ROOM_NAME_MAX) : 0);
+
+    if (!enabled) {
+        return;
+    }
+    struct iovec parts[2] = {{.iov_base = &roomLength, .iov_len = 1},
+                             {.iov_base = (void *) room, .iov_len = roomLength}};
+    // the frame is queued by reference, the peers' writers send it
+    pthread_rwlock_rdlock(&peersLock);
+    for (int i = 0; i < peerCount; ++i) {
+        if (peerSend(peers[i], CLUSTER_CHAT, parts, 2, frame) == 1) {
+            atomic_fetch_add(&forwarded, 1);
+        }
+    }
+    pthread_rwlock_unlock(&peersLock);
+}
+
+// adds the peer and tells it every local user, -1 if the node is linked already
+static int registerPeer(Peer *peer) {
+    pthread_mutex_lock(&clusterLock);
+    pthread_rwlock_wrlock(&peersLock);
+    for (int i = 0; i < peerCount; ++i) {
+        // both nodes may have connected to each other, the link registered first stays
+        if (peers[i]->nodeId == peer->nodeId) {
+            pthread_rwlock_unlock(&peersLock);
+            pthread_mutex_unlock(&clusterLock);
+            debugPrint("already linked to the node at %s", peer->address);
+            return -1;
+        }
+    }
+    if (peerCount == CLUSTER_PEERS_MAX) {
+        pthread_rwlock_unlock(&peersLock);
+        pthread_mutex_unlock(&clusterLock);
+        errorPrint("more than %d peers, refusing %s", CLUSTER_PEERS_MAX, peer->address);
+        return -1;
+    }
+    peers[peerCount++] = peer;
+    pthread_rwlock_unlock(&peersLock);
+    for (size_t i = 0; i < CLUSTER_NAME_BUCKETS; ++i) {
+        for (ClusterName *entry = names[i]; entry != NULL; entry = entry->next) {
+            if (entry->nodeId == 0) {
+                struct iovec part = {.iov_base = entry->name, .iov_len = strnlen(entry->name, USERNAME_MAX)};
+                peerSend(peer, CLUSTER_USER_ADDED, &part, 1, NULL);
+            }
+        }
+    }
+    pthread_mutex_unlock(&clusterLock);
+    infoPrint("Linked to cluster node %s", peer->address);
+    return 1;
+}
+
+// the peer's users leave, claims stop waiting for it
+static void unregisterPeer(Peer *peer) {
+    ClusterName *gone = NULL;
+
+    pthread_mutex_lock(&clusterLock);
+    pthread_rwlock_wrlock(&peersLock);
+    for (int i = 0; i < peerCount; ++i) {
+        if (peers[i] == peer) {
+            peers[i] = peers[--peerCount];
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&peersLock);
+    for (Claim *claim = claims; claim != NULL; claim = claim->next) {
+        answered(claim, peer->nodeId, 1);
+    }
+    for (size_t i = 0; i < CLUSTER_NAME_BUCKETS; ++i) {
+        ClusterName **link = &names[i];
+        while (*link != NULL) {
+            ClusterName *entry = *link;
+            if (entry->nodeId != peer->nodeId) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            entry->next = gone;
+            gone = entry;
+        }
+    }
+    pthread_mutex_lock(&presenceLock);
+    pthread_mutex_unlock(&clusterLock);
+    while (gone != NULL) {
+        ClusterName *entry = gone;
+        gone = entry->next;
+        notifyPeerUserRemoved(entry->name, entry->id, USER_REMOVED_STATUS_CONN_CLOSED_BY_CLIENT);
+        free(entry);
+    }
+    pthread_mutex_unlock(&presenceLock);
+    infoPrint("Link to cluster node %s closed", peer->address);
+}
+
+static int exchangeHello(Peer *peer) {
+    unsigned char hello[sizeof(uint32_t) + sizeof(uint64_t)];
+    unsigned char *payload;
+    uint32_t length;
+    uint8_t type;
+    uint64_t id = hton64u(nodeId);
+
+    putUint32(hello, CLUSTER_MAGIC);
+    memcpy(hello + sizeof(uint32_t), &id, sizeof(id));
+    struct iovec part = {.iov_base = hello, .iov_len = sizeof(hello)};
+    if (peerSend(peer, CLUSTER_HELLO, &part, 1, NULL) == -1 || peerReceive(peer, &type, &payload, &length) != 1 ||
+        type != CLUSTER_HELLO || length != sizeof(hello) || getUint32(payload) != CLUSTER_MAGIC) {
+        errorPrint("no cluster node at %s", peer->address);
+        return -1;
+    }
+    memcpy(&id, payload + sizeof(uint32_t), sizeof(id));
+    peer->nodeId = ntoh64u(id);
+    if (peer->nodeId == nodeId) {
+        errorPrint("%s is this node itself", peer->address);
+        return -1;
+    }
+    return 1;
+}
+
+// serves one link until it breaks
+static void runLink(int fd, const char *address) {
+    struct timeval timeout = {.tv_sec = CLUSTER_SEND_TIMEOUT_MS / 1000,
+                              .tv_usec = (CLUSTER_SEND_TIMEOUT_MS % 1000) * 1000};
+    Peer *peer = calloc(1, sizeof(Peer));
+    unsigned char *payload;
+    uint32_t length;
+    uint8_t type;
+    int result;
+
+    if (peer == NULL || (peer->buffer = malloc(HEADER_SIZE + CLUSTER_PAYLOAD_MAX)) == NULL) {
+        free(peer);
+        close(fd);
+        return;
+    }
+    peer->fd = fd;
+    strncpy(peer->address, address, sizeof(peer->address) - 1);
+    pthread_mutex_init(&peer->writeLock, NULL);
+    pthread_cond_init(&peer->queued, NULL);
+    // claims wait for a round trip, a chat frame should not wait for the next one
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (pthread_create(&peer->writer, NULL, peerWriter, peer) != 0) {
+        errnoPrint("error creating writer thread for peer %s", peer->address);
+        pthread_cond_destroy(&peer->queued);
+        pthread_mutex_destroy(&peer->writeLock);
+        free(peer->buffer);
+        free(peer);
+        close(fd);
+        return;
+    }
+
+    if (exchangeHello(peer) == 1 && registerPeer(peer) == 1) {
+        while ((result = peerReceive(peer, &type, &payload, &length)) == 1) {
+            switch (type) {
+                case CLUSTER_CLAIM:
+                    handleClaim(peer, payload, length);
+                    break;
+                case CLUSTER_CLAIM_RESULT:
+                    handleClaimResult(peer, payload, length);
+                    break;
+                case CLUSTER_USER_ADDED:
+                    handleUserAdded(peer, payload, length);
+                    break;
+                case CLUSTER_USER_REMOVED:
+                    handleUserRemoved(peer, payload, length);
+                    break;
+                case CLUSTER_CHAT:
+                    handleChat(peer, payload, length);
+                    break;
+                default:
+                    debugPrint("unknown message %u from peer %s", type, peer->address);
+                    break;
+            }
+        }
+        unregisterPeer(peer);
+    }
+    // nobody queues anymore but the reader itself; what is left is not sent
+    pthread_mutex_lock(&peer->writeLock);
+    peer->closing = 1;
+    shutdown(fd, SHUT_RDWR);
+    pthread_cond_signal(&peer->queued);
+    pthread_mutex_unlock(&peer->writeLock);
+    pthread_join(peer->writer, NULL);
+    while (peer->head != NULL) {
+        Outbound *next = peer->head->next;
+        outboundFree(peer->head);
+        peer->head = next;
+    }
+    close(fd);
+    pthread_cond_destroy(&peer->queued);
+    pthread_mutex_destroy(&peer->writeLock);
+    free(peer->buffer);
+    free(peer);
+}
+
+typedef struct Link {
+    int fd;
+    char address[64];
+} Link;
+
+static void *acceptedLink(void *arg) {
+    Link *link = (Link *) arg;
+
+    runLink(link->fd, link->address);
+    free(link);
+    return NULL;
+}
+
+static void *clusterListener(void *arg) {
+    int listenFd = *(int *) arg;
+    struct sockaddr_in address;
+    socklen_t length;
+    pthread_t thread;
+
+    free(arg);
+    for (;;) {
+        Link *link = calloc(1, sizeof(Link));
+        length = sizeof(address);
+        if (link == NULL || (link->fd = accept(listenFd, (struct sockaddr *) &address, &length)) == -1) {
+            errnoPrint("accept() on cluster port");
+            free(link);
+            sleep(1);
+            continue;
+        }
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+        snprintf(link->address, sizeof(link->address), "%s:%d", host, ntohs(address.sin_port));
+        if (pthread_create(&thread, NULL, acceptedLink, link) != 0) {
+            errnoPrint("pthread_create(acceptedLink...)");
+            close(link->fd);
+            free(link);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static int connectPeer(const char *peer) {
+    char host[64];
+    const char *colon = strrchr(peer, ':');
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+    int fd = -1;
+
+    if (colon == NULL || (size_t) (colon - peer) >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host, peer, (size_t) (colon - peer));
+    host[colon - peer] = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &addresses) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (struct addrinfo *address = addresses; address != NULL && fd == -1; address = address->ai_next) {
+        if ((fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol)) != -1 &&
+            connect(fd, address->ai_addr, address->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+// keeps one outgoing link up
+static void *peerConnector(void *arg) {
+    const char *address = (const char *) arg;
+    unsigned int seed = (unsigned int) nodeId;
+    int fd;
+
+    for (;;) {
+        if ((fd = connectPeer(address)) != -1) {
+            runLink(fd, address);
+        }
+        // both nodes of a link that was refused as a duplicate on each side retry, not at once
+        struct timespec pause = {.tv_sec = 0,
+                                 .tv_nsec = (CLUSTER_RECONNECT_MS + rand_r(&seed) % CLUSTER_RECONNECT_MS) *
+                                            1000000L};
+        pause.tv_sec = pause.tv_nsec / 1000000000L;
+        pause.tv_nsec %= 1000000000L;
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+static int listenForPeers(in_port_t port) {
+    struct sockaddr_in address;
+    pthread_t thread;
+    int *fd = malloc(sizeof(int));
+
+    if (fd == NULL) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if ((*fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+        setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int)) == -1 ||
+        bind(*fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(*fd, SOMAXCONN) == -1) {
+        errnoPrint("could not listen for cluster peers on port %d", port);
+        if (*fd != -1) {
+            close(*fd);
+        }
+        free(fd);
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, clusterListener, fd) != 0) {
+        errnoPrint("error creating cluster listener thread");
+        close(*fd);
+        free(fd);
+        return -1;
+    }
+    infoPrint("Cluster links on port %d", port);
+    return 1;
+}
+
+int clusterStart(in_port_t port, char **peerAddresses, int count) {
+    pthread_t thread;
+
+    if (port == 0 && count == 0) {
+        return 1;
+    }
+    if (getrandom(&nodeId, sizeof(nodeId), 0) != sizeof(nodeId) || nodeId == 0) {
+        nodeId = (uint64_t) time(NULL) << 20 ^ (uint64_t) getpid();
+    }
+    enabled = 1;
+    if (port != 0 && listenForPeers(port) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (pthread_create(&thread, NULL, peerConnector, peerAddresses[i]) != 0) {
+            errnoPrint("error creating connector thread for %s", peerAddresses[i]);
+            return -1;
+        }
+    }
+    debugPrint("cluster node %016llx", (unsigned long long) nodeId);
+    return 1;
+}
+
+void clusterPrintStats(void) {
+    size_t remote = 0;
+    int linked;
+
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&clusterLock);
+    for (size_t i = 0; i < CLUSTER_NAME_BUCKETS; ++i) {
+        for (ClusterName *entry = names[i]; entry != NULL; entry = entry->next) {
+            remote += entry->nodeId != 0;
+        }
+    }
+    pthread_rwlock_rdlock(&peersLock);
+    linked = peerCount;
+    pthread_rwlock_unlock(&peersLock);
+    pthread_mutex_unlock(&clusterLock);
+    infoPrint("STATS cluster: %d peers, %zu remote users, %zu frames forwarded, %zu received, %zu dropped, "
+              "%zu name claims (%zu refused), %zu name conflicts", linked, remote, atomic_load(&forwarded),
+              atomic_load(&received), atomic_load(&dropped), atomic_load(&claimsAsked), atomic_load(&claimsRefused),
+              atomic_load(&conflicts));
+}
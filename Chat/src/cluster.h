@@ -0,0 +1,60 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+struct User;
+struct Frame;
+
+// every node of a cluster links to every other one, messages are not relayed: a chat frame or a
+// presence event crosses each link once. A link carries messages of uint8 type, uint32 payload
+// length (network byte order) and the payload.
+#define CLUSTER_MAGIC 0x434c5531
+#define CLUSTER_PEERS_MAX 16
+#define CLUSTER_PAYLOAD_MAX (64 * 1024)
+// how long a login waits for the other nodes to agree on its name before it is refused
+#define CLUSTER_CLAIM_TIMEOUT_MS 1000
+// a peer that does not take a message within this time is dropped
+#define CLUSTER_SEND_TIMEOUT_MS 1000
+// each link has a writer thread, a peer that falls this many bytes behind it is dropped
+#define CLUSTER_QUEUE_MAX (4 * 1024 * 1024)
+#define CLUSTER_RECONNECT_MS 1000
+#define CLUSTER_NAME_BUCKETS 1024
+
+// payload: uint32 magic, uint64 node id (random, the lower one wins a name both nodes claim)
+#define CLUSTER_HELLO 0
+// uint32 sequence number, the name
+#define CLUSTER_CLAIM 1
+// uint32 sequence number of the claim, uint8 1 if granted
+#define CLUSTER_CLAIM_RESULT 2
+// the name of a user that logged in, sent for every user when a link comes up
+#define CLUSTER_USER_ADDED 3
+// uint8 USER_REMOVED status, the name
+#define CLUSTER_USER_REMOVED 4
+// uint8 room name length, the room name (empty for messages to everyone), the version 0 frame
+#define CLUSTER_CHAT 5
+
+// accepts links from other nodes on port (0 for none) and keeps links to every peer ("host:port")
+// up, reconnecting after a failure; no port and no peers is a single server
+int clusterStart(in_port_t port, char **peers, int peerCount);
+
+// 1 once clusterStart() was given a port or peers
+int clusterEnabled(void);
+
+// called with a name just reserved locally: 1 once every linked node agreed, -1 if one of them
+// knows the name or the nodes did not answer in time; blocks for a round trip to every peer, up
+// to CLUSTER_CLAIM_TIMEOUT_MS, so a reactor leaves it to its login thread
+int clusterClaimName(const char *name);
+
+// tells the other nodes about a local user and lists theirs to it
+void clusterUserAdded(struct User *user);
+
+void clusterUserRemoved(struct User *user, uint8_t code);
+
+// sends a local user's message to every other node, room is NULL for messages to everyone
+void clusterForward(struct Frame *frame, const char *room);
+
+void clusterPrintStats(void);
+
+#endif
@@ -0,0 +1,166 @@
+#include "compact.h"
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include "frame.h"
+#include "protocol.h"
+#include "util.h"
+
+static uint64_t base = 0;
+
+static atomic_size_t encodedFrames = 0;
+static atomic_size_t originalBytes = 0;
+static atomic_size_t encodedBytes = 0;
+
+void compactStart(uint64_t start) {
+    base = start;
+}
+
+uint64_t compactBase(void) {
+    return base;
+}
+
+size_t compactPutVarint(unsigned char *out, uint64_t value) {
+    size_t length = 0;
+
+    while (value >= 0x80) {
+        out[length++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char) value;
+    return length;
+}
+
+int compactGetVarint(const unsigned char *in, size_t available, size_t max, uint64_t *value) {
+    uint64_t result = 0;
+
+    for (size_t i = 0; i < max; ++i) {
+        if (i == available) {
+            return 0;
+        }
+        result |= (uint64_t) (in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            *value = result;
+            return (int) i + 1;
+        }
+    }
+    return -1;
+}
+
+static uint64_t readTimestamp(const unsigned char *body) {
+    uint64_t timestamp;
+    memcpy(&timestamp, body, sizeof(timestamp));
+    timestamp = ntoh64u(timestamp);
+    if (timestamp == 0) {
+        return 0;
+    }
+    // 1 also stands for anything older than the base, version 1 cannot express it
+    return timestamp > base ? timestamp - base + 1 : 1;
+}
+
+// name is a fixed size field, padded with zeros if it is shorter
+static size_t putSender(unsigned char *out, uint32_t id, const unsigned char *name, size_t nameMax, int named) {
+    size_t nameLength = strnlen((const char *) name, nameMax);
+    size_t length;
+
+    // a sender without an id can only be told by its name
+    named = nameLength > 0 && (named || id == 0);
+    length = compactPutVarint(out, (uint64_t) id << 1 | (uint64_t) named);
+    if (named) {
+        out[length++] = (unsigned char) nameLength;
+        memcpy(out + length, name, nameLength);
+        length += nameLength;
+    }
+    return length;
+}
+
+Frame *compactEncode(const Frame *frame, int named) {
+    unsigned char body[sizeof(messageBody) + 2 * COMPACT_VARINT_MAX];
+    unsigned char out[COMPACT_HEADER_MAX + sizeof(body)];
+    const unsigned char *in = frame->data + sizeof(messageHeader);
+    size_t inLength = frame->length - sizeof(messageHeader);
+    size_t length = 0;
+    uint8_t type = frame->data[0];
+
+    switch (type) {
+        case LOGIN_RESPONSE:
+            // the client tells it apart by its type, it keeps the version 0 header
+            return frameCreate(frame->data, frame->length);
+        case SERVER_2_CLIENT: {
+            const size_t textOffset = sizeof(uint64_t) + sizeof(((server2Client *) 0)->originalSender);
+            if (inLength < textOffset) {
+                errno = EINVAL;
+                return NULL;
+            }
+            length += compactPutVarint(body, readTimestamp(in));
+            length += putSender(body + length, frame->sender, in + sizeof(uint64_t),
+                                sizeof(((server2Client *) 0)->originalSender), named);
+            memcpy(body + length, in + textOffset, inLength - textOffset);
+            length += inLength - textOffset;
+            break;
+        }
+        case USER_ADDED:
+            if (inLength < sizeof(uint64_t)) {
+                errno = EINVAL;
+                return NULL;
+            }
+            length += compactPutVarint(body, readTimestamp(in));
+            length += compactPutVarint(body + length, frame->sender);
+            memcpy(body + length, in + sizeof(uint64_t), inLength - sizeof(uint64_t));
+            length += inLength - sizeof(uint64_t);
+            break;
+        case USER_REMOVED: {
+            // the name is not zero terminated on the wire
+            unsigned char name[USERNAME_MAX + 1] = {0};
+            if (inLength < sizeof(uint64_t) + 1) {
+                errno = EINVAL;
+                return NULL;
+            }
+            length += compactPutVarint(body, readTimestamp(in));
+            body[length++] = in[sizeof(uint64_t)];
+            memcpy(name, in + sizeof(uint64_t) + 1,
+                   inLength - sizeof(uint64_t) - 1 < USERNAME_MAX ? inLength - sizeof(uint64_t) - 1 : USERNAME_MAX);
+            length += putSender(body + length, frame->sender, name, USERNAME_MAX, named);
+            break;
+        }
+        default:
+            memcpy(body, in, inLength);
+            length = inLength;
+    }
+    out[0] = type;
+    size_t headerLength = 1 + compactPutVarint(out + 1, length);
+    memcpy(out + headerLength, body, length);
+
+    Frame *encoded = frameCreate(out, headerLength + length);
+    if (encoded != NULL) {
+        encoded->sender = frame->sender;
+        atomic_fetch_add_explicit(&encodedFrames, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&originalBytes, frame->length, memory_order_relaxed);
+        atomic_fetch_add_explicit(&encodedBytes, encoded->length, memory_order_relaxed);
+    }
+    return encoded;
+}
+
+Frame *compactFrame(Frame *frame) {
+    Frame *encoded = atomic_load_explicit(&frame->compact, memory_order_acquire);
+    if (encoded != NULL) {
+        return encoded;
+    }
+    if ((encoded = compactEncode(frame, 0)) == NULL) {
+        return NULL;
+    }
+    // recipients on other threads may race to encode it, the first one wins
+    Frame *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&frame->compact, &expected, encoded, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        frameRelease(encoded);
+        return expected;
+    }
+    return encoded;
+}
+
+void compactStats(size_t *frames, size_t *original, size_t *compact) {
+    *frames = atomic_load(&encodedFrames);
+    *original = atomic_load(&originalBytes);
+    *compact = atomic_load(&encodedBytes);
+}
@@ -0,0 +1,48 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Frame;
+
+// Protocol version 1 (VERSION_COMPACT), asked for in loginRequest.version. The login request is
+// always sent as in version 0. The login response keeps the version 0 header, its body is magic,
+// code, uint64 base time (seconds since the epoch, network byte order), server name.
+// Every other frame in both directions is: uint8 type, varint body length, body. Varints are
+// little-endian groups of 7 bits, the high bit set on all but the last byte.
+//   time:          varint, 0 for none (the user list sent at login), otherwise 1 + seconds since base
+//   sender:        varint id << 1 | named, followed by uint8 length and name if named; id 0 with
+//                  no name is the server. Ids come from USER_ADDED and stay valid for the session.
+//   CLIENT_2_SERVER  text
+//   SERVER_2_CLIENT  time, sender, text
+//   USER_ADDED       time, varint id, name
+//   USER_REMOVED     time, uint8 code, sender
+//   HEARTBEAT        empty, the client answers one with one of its own
+#define COMPACT_VARINT_MAX 10
+// a body length never needs more than three bytes
+#define COMPACT_LENGTH_VARINT_MAX 3
+#define COMPACT_HEADER_MAX (1 + COMPACT_LENGTH_VARINT_MAX)
+
+// base of the compact timestamps, sent in every version 1 login response
+void compactStart(uint64_t base);
+
+uint64_t compactBase(void);
+
+size_t compactPutVarint(unsigned char *out, uint64_t value);
+
+// returns the bytes used, 0 if in does not hold the whole varint yet, -1 if it is longer than max
+int compactGetVarint(const unsigned char *in, size_t available, size_t max, uint64_t *value);
+
+// version 1 encoding of a version 0 frame, with the sender's name spelled out if named is set
+// (replayed frames whose sender the client may never have seen); the caller owns the result
+struct Frame *compactEncode(const struct Frame *frame, int named);
+
+// the version 1 encoding of frame, made by the first caller and shared with every later one;
+// valid as long as frame is
+struct Frame *compactFrame(struct Frame *frame);
+
+// bytes of frames sent in version 0 and their version 1 encodings, for /stats
+void compactStats(size_t *frames, size_t *originalBytes, size_t *compactBytes);
+
+#endif
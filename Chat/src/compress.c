@@ -0,0 +1,168 @@
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include "compact.h"
+#include "frame.h"
+#include "histogram.h"
+#include "util.h"
+
+static size_t threshold = COMPRESS_DEFAULT_THRESHOLD;
+
+// deflate state is large (about 256 KiB), every sending thread keeps one and resets it per frame;
+// client threads of the threaded mode send direct messages and replies themselves, so the key's
+// destructor frees it when such a thread exits
+static pthread_once_t streamKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t streamKey;
+static int streamKeyReady = 0;
+static __thread z_stream *localStream = NULL;
+
+static atomic_size_t compressedFrames = 0;
+static atomic_size_t smallFrames = 0;
+static atomic_size_t incompressibleFrames = 0;
+static atomic_size_t bytesIn = 0;
+static atomic_size_t bytesOut = 0;
+static atomic_size_t cpuNanoseconds = 0;
+// thread CPU time of one deflate call
+static Histogram cpuTime;
+
+static uint64_t threadCpuTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+void compressConfigure(size_t minimum) {
+    threshold = minimum;
+}
+
+static void streamDestroy(void *arg) {
+    deflateEnd((z_stream *) arg);
+    free(arg);
+}
+
+static void streamKeyCreate(void) {
+    if (pthread_key_create(&streamKey, streamDestroy) != 0) {
+        errorPrint("could not create the deflate stream key");
+        return;
+    }
+    streamKeyReady = 1;
+}
+
+// the calling thread's stream, NULL if it cannot be set up
+static z_stream *threadStream(void) {
+    if (localStream != NULL) {
+        deflateReset(localStream);
+        return localStream;
+    }
+    pthread_once(&streamKeyOnce, streamKeyCreate);
+    z_stream *created = calloc(1, sizeof(z_stream));
+    if (!streamKeyReady || created == NULL) {
+        free(created);
+        return NULL;
+    }
+    // negative window bits give raw deflate without the zlib header and checksum
+    if (deflateInit2(created, COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errorPrint("could not set up deflate");
+        free(created);
+        return NULL;
+    }
+    if (pthread_setspecific(streamKey, created) != 0) {
+        streamDestroy(created);
+        return NULL;
+    }
+    localStream = created;
+    return localStream;
+}
+
+// returns the compressed frame or NULL if it would not be smaller than encoded
+static Frame *deflateFrame(const Frame *encoded) {
+    unsigned char out[COMPACT_HEADER_MAX + 2 * sizeof(message)];
+    uint64_t bodyLength;
+    int lengthBytes = compactGetVarint(encoded->data + 1, encoded->length - 1, COMPACT_LENGTH_VARINT_MAX,
+                                       &bodyLength);
+    const unsigned char *body = encoded->data + 1 + lengthBytes;
+    z_stream *stream = threadStream();
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    // the length varint goes in front once the size is known, leave room for the longest one
+    uint64_t start = threadCpuTime();
+    stream->next_in = (unsigned char *) body;
+    stream->avail_in = (uInt) bodyLength;
+    stream->next_out = out + COMPACT_HEADER_MAX;
+    stream->avail_out = (uInt) (sizeof(out) - COMPACT_HEADER_MAX);
+    int status = deflate(stream, Z_FINISH);
+    uint64_t spent = threadCpuTime() - start;
+    histogramRecord(&cpuTime, spent);
+    atomic_fetch_add_explicit(&cpuNanoseconds, spent, memory_order_relaxed);
+    if (status != Z_STREAM_END) {
+        return NULL;
+    }
+
+    unsigned char header[COMPACT_HEADER_MAX];
+    size_t compressedLength = stream->total_out;
+    header[0] = (unsigned char) (encoded->data[0] | COMPRESS_TYPE_FLAG);
+    size_t headerLength = 1 + compactPutVarint(header + 1, compressedLength);
+    if (headerLength + compressedLength >= encoded->length) {
+        return NULL;
+    }
+    unsigned char *frameStart = out + COMPACT_HEADER_MAX - headerLength;
+    memcpy(frameStart, header, headerLength);
+
+    Frame *compressed = frameCreate(frameStart, headerLength + compressedLength);
+    if (compressed != NULL) {
+        compressed->sender = encoded->sender;
+        atomic_fetch_add_explicit(&compressedFrames, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytesIn, encoded->length, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytesOut, compressed->length, memory_order_relaxed);
+    }
+    return compressed;
+}
+
+Frame *compressFrame(Frame *frame) {
+    Frame *result = atomic_load_explicit(&frame->compressed, memory_order_acquire);
+    if (result != NULL) {
+        return result;
+    }
+    Frame *encoded = compactFrame(frame);
+    if (encoded == NULL) {
+        return NULL;
+    }
+    // a small frame gains little and is not worth the CPU time
+    if (encoded->length < threshold) {
+        atomic_fetch_add_explicit(&smallFrames, 1, memory_order_relaxed);
+        result = frameRetain(encoded);
+    } else if ((result = deflateFrame(encoded)) == NULL) {
+        atomic_fetch_add_explicit(&incompressibleFrames, 1, memory_order_relaxed);
+        result = frameRetain(encoded);
+    }
+    // like compactFrame(), recipients on other threads may race and the first one wins
+    Frame *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&frame->compressed, &expected, result, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        frameRelease(result);
+        return expected;
+    }
+    return result;
+}
+
+void compressPrintStats(void) {
+    size_t in = atomic_load(&bytesIn);
+    size_t out = atomic_load(&bytesOut);
+    size_t frames = atomic_load(&compressedFrames);
+    size_t deflateCalls = histogramCount(&cpuTime);
+
+    infoPrint("STATS compression: %zu frames compressed, %zu bytes to %zu (ratio %.2f), %zu below %zu bytes "
+              "and %zu that did not shrink sent as they were", frames, in, out, out > 0 ? (double) in / (double) out : 0.0,
+              atomic_load(&smallFrames), threshold, atomic_load(&incompressibleFrames));
+    infoPrint("STATS compression CPU time: %.3f ms in %zu deflate calls, p50 %.1f us, p99 %.1f us, max %.1f us",
+              (double) atomic_load(&cpuNanoseconds) / 1e6, deflateCalls,
+              (double) histogramPercentile(&cpuTime, 0.5) / 1000.0, (double) histogramPercentile(&cpuTime, 0.99) / 1000.0,
+              (double) histogramMax(&cpuTime) / 1000.0);
+}
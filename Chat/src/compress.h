@@ -0,0 +1,26 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+struct Frame;
+
+// Protocol version 2 (VERSION_COMPRESSED) is version 1 in which the server may set
+// COMPRESS_TYPE_FLAG in the type of a frame it sends. The body of such a frame is the version 1
+// body compressed as raw deflate (RFC 1951, no zlib header). Clients always send uncompressed.
+#define COMPRESS_TYPE_FLAG 0x80
+
+// version 1 frames shorter than this are sent uncompressed
+#define COMPRESS_DEFAULT_THRESHOLD 256
+#define COMPRESS_LEVEL 6
+
+void compressConfigure(size_t threshold);
+
+// what a version 2 client gets for frame: its version 1 encoding, compressed if that is large
+// enough and gets smaller, made by the first caller and shared with every later one; valid as
+// long as frame is
+struct Frame *compressFrame(struct Frame *frame);
+
+void compressPrintStats(void);
+
+#endif
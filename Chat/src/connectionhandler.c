@@ -1,14 +1,71 @@
+#define _GNU_SOURCE
+
 #include "connectionhandler.h"
 #include "clientthread.h"
+#include "reactor.h"
+#include "upgrade.h"
 #include "util.h"
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include "user.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+typedef struct Shard {
+    pthread_t thread;
+    int listenFileDescriptor;
+    // -1 for every shard but the one accepting on the AF_UNIX socket
+    int unixFileDescriptor;
+    int index;
+    int count;
+} Shard;
+
+static int connectionMode = CONNECTION_MODE_THREADED;
+static const char *unixPath = NULL;
+static int unixType = SOCK_STREAM;
+
+int connectionHandlerMode(void) {
+    return connectionMode;
+}
+
+void connectionHandlerUnix(const char *path, int seqpacket) {
+    unixPath = path;
+    unixType = seqpacket ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+const char *connectionPeerName(const struct sockaddr_storage *address, char *name, size_t length) {
+    if (address->ss_family == AF_INET) {
+        return inet_ntop(AF_INET, &((const struct sockaddr_in *) address)->sin_addr, name, (socklen_t) length);
+    }
+    snprintf(name, length, "%s", unixPath != NULL ? unixPath : "local");
+    return name;
+}
+
+// a listening socket of the process taken over, if it is of the kind asked for
+static int takeOverSocket(int index, int domain, int type) {
+    int fileDescriptor = upgradeListenSocket(index);
+    int value = 0;
+    socklen_t length = sizeof(value);
 
-static int createPassiveSocket(in_port_t port) {
+    if (fileDescriptor == -1) {
+        return -1;
+    }
+    if (getsockopt(fileDescriptor, SOL_SOCKET, SO_DOMAIN, &value, &length) == 0 && value == domain &&
+        getsockopt(fileDescriptor, SOL_SOCKET, SO_TYPE, &value, &length) == 0 && value == type) {
+        return fileDescriptor;
+    }
+    // the previous process listened on other sockets, a new one is opened instead
+    close(fileDescriptor);
+    return -1;
+}
+
+static int createPassiveSocket(in_port_t port, int reusePort) {
     int fileDescriptor = -1;
     struct sockaddr_in sockaddr;
 
@@ -23,8 +80,13 @@ static int createPassiveSocket(in_port_t port) {
         perror("setsockopt(SO_REUSEADDR) failed");
         return -1;
     }
+    // lets every shard bind its own socket to the same port, the kernel spreads new connections
+    if (reusePort && setsockopt(fileDescriptor, SOL_SOCKET, SO_REUSEPORT, &(int) {1}, sizeof(int)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        return -1;
+    }
     if (bind(fileDescriptor, (struct sockaddr *) &sockaddr, (socklen_t) sizeof(sockaddr)) < 0) {
-        infoPrint("Could not open socket on port %d", ntohs((int) sockaddr.sin_port));
+        errnoPrint("Could not open socket on port %d", ntohs((int) sockaddr.sin_port));
         return -1;
     }
     if (listen(fileDescriptor, SOMAXCONN) < 0) {
@@ -36,32 +98,161 @@ static int createPassiveSocket(in_port_t port) {
     return fileDescriptor;
 }
 
-int connectionHandler(in_port_t port) {
-    User *userToThread;
-    int socketFileDescriptor;
-    char str[INET_ADDRSTRLEN];
-    struct sockaddr_in socketAdress;
+// the socket of the process taken over if there is one, a new one otherwise; offered to the next
+static int openPassiveSocket(in_port_t port, int reusePort, int index) {
+    int fileDescriptor = takeOverSocket(index, AF_INET, SOCK_STREAM);
 
-    const int fileDescriptor = createPassiveSocket(port);
-    if (fileDescriptor == -1) {
+    if (fileDescriptor != -1) {
+        infoPrint("Listening on port %d (taken over)", (int) port);
+    } else if ((fileDescriptor = createPassiveSocket(port, reusePort)) == -1) {
         return -1;
     }
+    upgradeOfferListenSocket(fileDescriptor);
+    return fileDescriptor;
+}
+
+static int createUnixSocket(void) {
+    struct sockaddr_un sockaddr;
+    struct stat status;
+    int fileDescriptor;
+
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    if (strlen(unixPath) >= sizeof(sockaddr.sun_path)) {
+        errorPrint("Socket path %s is too long", unixPath);
+        return -1;
+    }
+    strcpy(sockaddr.sun_path, unixPath);
+    // a socket that refuses connections is left over from a server that is gone and replaced,
+    // anything else at path stays
+    if (lstat(unixPath, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        int refused = 0;
+        if ((fileDescriptor = socket(AF_UNIX, unixType | SOCK_CLOEXEC, 0)) != -1) {
+            refused = connect(fileDescriptor, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) == -1 &&
+                      errno == ECONNREFUSED;
+            close(fileDescriptor);
+        }
+        if (!refused) {
+            errorPrint("%s is in use", unixPath);
+            return -1;
+        }
+        unlink(unixPath);
+    }
+    if ((fileDescriptor = socket(AF_UNIX, unixType, 0)) == -1) {
+        errnoPrint("socket(AF_UNIX)");
+        return -1;
+    }
+    if (bind(fileDescriptor, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) < 0) {
+        errnoPrint("Could not open socket %s", unixPath);
+        close(fileDescriptor);
+        return -1;
+    }
+    if (listen(fileDescriptor, SOMAXCONN) < 0) {
+        errnoPrint("listen() failed");
+        close(fileDescriptor);
+        return -1;
+    }
+    infoPrint("Listening on %s (%s)", unixPath, unixType == SOCK_SEQPACKET ? "seqpacket" : "stream");
+    return fileDescriptor;
+}
 
-    memset(&socketAdress, 0, sizeof(socketAdress));
-    socketAdress.sin_addr.s_addr = htonl(INADDR_ANY);
-    socketAdress.sin_family = AF_INET;
-    socketAdress.sin_port = htons(port);
-    socklen_t addr_size = sizeof(socketAdress);
+// opened after the TCP sockets and offered after them, index is the number of TCP sockets
+static int openUnixSocket(int index) {
+    int fileDescriptor;
 
+    if (unixPath == NULL) {
+        return -1;
+    }
+    if ((fileDescriptor = takeOverSocket(index, AF_UNIX, unixType)) != -1) {
+        infoPrint("Listening on %s (taken over)", unixPath);
+    } else if ((fileDescriptor = createUnixSocket()) == -1) {
+        return -1;
+    }
+    upgradeOfferListenSocket(fileDescriptor);
+    return fileDescriptor;
+}
+
+static void *shardThread(void *arg) {
+    Shard *shard = (Shard *) arg;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpuSet;
+
+    if (cores > 0) {
+        CPU_ZERO(&cpuSet);
+        CPU_SET(shard->index % cores, &cpuSet);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0) {
+            debugPrint("could not pin shard %d to a core", shard->index);
+        }
+    }
+    debugPrint("Shard %d serving socket %d", shard->index, shard->listenFileDescriptor);
+    reactorRun(shard->listenFileDescriptor, shard->unixFileDescriptor, shard->index, shard->count);
+    return NULL;
+}
+
+static int runShards(in_port_t port, int shards) {
+    Shard *shardList = calloc((size_t) shards, sizeof(Shard));
+    if (shardList == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // open every socket up front so a failing bind is reported before any shard runs
+    for (int i = 0; i < shards; ++i) {
+        shardList[i].index = i;
+        shardList[i].count = shards;
+        shardList[i].unixFileDescriptor = -1;
+        if ((shardList[i].listenFileDescriptor = openPassiveSocket(port, 1, i)) == -1) {
+            for (int j = 0; j < i; ++j) {
+                close(shardList[j].listenFileDescriptor);
+            }
+            free(shardList);
+            return -1;
+        }
+    }
+    // local clients are few, the first shard accepts them all
+    if (unixPath != NULL && (shardList[0].unixFileDescriptor = openUnixSocket(shards)) == -1) {
+        for (int i = 0; i < shards; ++i) {
+            close(shardList[i].listenFileDescriptor);
+        }
+        free(shardList);
+        return -1;
+    }
+    upgradeRestoreUsers();
+    infoPrint("Serving clients from %d reactor shards", shards);
+    for (int i = 1; i < shards; ++i) {
+        if (pthread_create(&shardList[i].thread, NULL, shardThread, &shardList[i]) != 0) {
+            errnoPrint("pthread_create(shardThread...)");
+        }
+    }
+    // the calling thread serves the first shard
+    shardThread(&shardList[0]);
+    return -1;
+}
+
+// one thread per client, until a handover interrupts accept() and parks the calling thread
+static void acceptClients(int fileDescriptor) {
+    User *userToThread;
+    int socketFileDescriptor;
+    char str[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+    struct sockaddr_storage socketAdress;
+    socklen_t addr_size;
+
+    upgradeRegisterThread();
     for (;;) {
+        if (upgradeRequested()) {
+            upgradeParkThread();
+        }
+        addr_size = sizeof(socketAdress);
         if ((socketFileDescriptor = accept(fileDescriptor, (struct sockaddr *) &socketAdress, &addr_size)) < 0) {
-            errnoPrint("connection on port %d", (int) socketAdress.sin_port);
+            if (errno == EINTR) {
+                continue;
+            }
+            errnoPrint("accept() on socket %d", fileDescriptor);
 
         } else {
 
-            inet_ntop(AF_INET, &socketAdress.sin_addr, str, INET_ADDRSTRLEN);
+            connectionPeerName(&socketAdress, str, sizeof(str));
             infoPrint("Client %s connected successfully on socket: %d!", str, socketFileDescriptor);
-            userToThread = malloc(sizeof(User));
+            userToThread = allocUser();
             userToThread->socketFileDescriptor = socketFileDescriptor;
             if (pthread_create(&userToThread->thread, NULL, clientthread, userToThread) < 0) {
                 errnoPrint("pthread_create(clientthread...)");
@@ -70,3 +261,47 @@ int connectionHandler(in_port_t port) {
 
     }
 }
+
+static void *unixAcceptThread(void *arg) {
+    acceptClients((int) (intptr_t) arg);
+    return NULL;
+}
+
+int connectionHandler(in_port_t port, int mode, int shards) {
+    User *userToThread;
+    pthread_t unixThread;
+
+    connectionMode = mode;
+    if (mode == CONNECTION_MODE_REACTOR && shards > 1) {
+        return runShards(port, shards);
+    }
+
+    const int fileDescriptor = openPassiveSocket(port, 0, 0);
+    if (fileDescriptor == -1) {
+        return -1;
+    }
+    const int unixFileDescriptor = openUnixSocket(1);
+    if (unixPath != NULL && unixFileDescriptor == -1) {
+        close(fileDescriptor);
+        return -1;
+    }
+    size_t resumed = upgradeRestoreUsers();
+    if (mode == CONNECTION_MODE_REACTOR) {
+        infoPrint("Serving clients from an epoll reactor");
+        return reactorRun(fileDescriptor, unixFileDescriptor, 0, 1);
+    }
+    for (size_t i = 0; i < resumed; ++i) {
+        userToThread = upgradeSessionUser(i);
+        if (userToThread != NULL &&
+            pthread_create(&userToThread->thread, NULL, clientResume, (void *) i) != 0) {
+            errnoPrint("pthread_create(clientResume...)");
+        }
+    }
+    if (unixFileDescriptor != -1 &&
+        pthread_create(&unixThread, NULL, unixAcceptThread, (void *) (intptr_t) unixFileDescriptor) != 0) {
+        errnoPrint("pthread_create(unixAcceptThread...)");
+        return -1;
+    }
+    acceptClients(fileDescriptor);
+    return -1;
+}
@@ -1,8 +1,24 @@
 #ifndef CONNECTIONHANDLER_H
 #define CONNECTIONHANDLER_H
 
+#include <stddef.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
 
-int connectionHandler(in_port_t port);
+#define CONNECTION_MODE_THREADED 0
+#define CONNECTION_MODE_REACTOR 1
+
+// in reactor mode shards > 1 starts that many reactors, each on its own SO_REUSEPORT socket
+int connectionHandler(in_port_t port, int mode, int shards);
+
+int connectionHandlerMode(void);
+
+// before connectionHandler(): clients on the same host may also connect to an AF_UNIX socket at
+// path, served like TCP clients. A SOCK_SEQPACKET client sends whole frames in packets of at most
+// RECEIVE_BUFFER_SIZE bytes and receives one frame per packet.
+void connectionHandlerUnix(const char *path, int seqpacket);
+
+// the address of an accepted client for the log
+const char *connectionPeerName(const struct sockaddr_storage *address, char *name, size_t length);
 
 #endif
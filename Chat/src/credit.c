@@ -0,0 +1,141 @@
+#include "credit.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+static int creditsPerSender = CREDIT_DEFAULT;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+void creditConfigure(int credits) {
+    creditsPerSender = credits;
+}
+
+Credit *creditCreate(void) {
+    Credit *credit = calloc(1, sizeof(Credit));
+    if (credit == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    atomic_init(&credit->references, 1);
+    pthread_mutex_init(&credit->lock, NULL);
+    pthread_cond_init(&credit->returned, NULL);
+    credit->available = creditsPerSender;
+    return credit;
+}
+
+void creditRelease(Credit *credit) {
+    if (credit == NULL || atomic_fetch_sub(&credit->references, 1) != 1) {
+        return;
+    }
+    pthread_cond_destroy(&credit->returned);
+    pthread_mutex_destroy(&credit->lock);
+    free(credit);
+}
+
+Credit *creditTake(Credit *credit) {
+    atomic_fetch_add(&credit->references, 1);
+    pthread_mutex_lock(&credit->lock);
+    credit->available--;
+    pthread_mutex_unlock(&credit->lock);
+    return credit;
+}
+
+void creditReturn(Credit *credit) {
+    if (credit == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&credit->lock);
+    if (++credit->available == 1 && credit->throttledSince != 0) {
+        credit->throttledNanoseconds += now() - credit->throttledSince;
+        credit->throttledSince = 0;
+        if (credit->resume != NULL) {
+            void (*resume)(void *) = credit->resume;
+            credit->resume = NULL;
+            resume(credit->resumeArg);
+        }
+        pthread_cond_signal(&credit->returned);
+    }
+    pthread_mutex_unlock(&credit->lock);
+    creditRelease(credit);
+}
+
+// caller holds the credit's lock
+static void throttle(Credit *credit) {
+    if (credit->throttledSince == 0) {
+        credit->throttledSince = now();
+        credit->throttles++;
+    }
+}
+
+void creditWait(Credit *credit) {
+    pthread_mutex_lock(&credit->lock);
+    if (credit->available <= 0 && !credit->detached) {
+        throttle(credit);
+        while (credit->available <= 0 && !credit->detached) {
+            pthread_cond_wait(&credit->returned, &credit->lock);
+        }
+    }
+    pthread_mutex_unlock(&credit->lock);
+}
+
+int creditWatch(Credit *credit, void (*resume)(void *), void *arg) {
+    int result = 1;
+
+    pthread_mutex_lock(&credit->lock);
+    if (credit->available <= 0 && !credit->detached) {
+        throttle(credit);
+        credit->resume = resume;
+        credit->resumeArg = arg;
+        result = 0;
+    }
+    pthread_mutex_unlock(&credit->lock);
+    return result;
+}
+
+// caller holds the credit's lock
+static void detach(Credit *credit) {
+    credit->detached = 1;
+    credit->resume = NULL;
+    if (credit->throttledSince != 0) {
+        credit->throttledNanoseconds += now() - credit->throttledSince;
+        credit->throttledSince = 0;
+    }
+    pthread_cond_broadcast(&credit->returned);
+}
+
+void creditDetach(Credit *credit) {
+    if (credit == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&credit->lock);
+    detach(credit);
+    pthread_mutex_unlock(&credit->lock);
+}
+
+void creditInterrupt(Credit *credit) {
+    if (credit == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&credit->lock);
+    void (*resume)(void *) = credit->resume;
+    detach(credit);
+    if (resume != NULL) {
+        resume(credit->resumeArg);
+    }
+    pthread_mutex_unlock(&credit->lock);
+}
+
+void creditStats(Credit *credit, size_t *throttles, uint64_t *throttledNanoseconds) {
+    pthread_mutex_lock(&credit->lock);
+    *throttles = credit->throttles;
+    *throttledNanoseconds = credit->throttledNanoseconds;
+    if (credit->throttledSince != 0) {
+        *throttledNanoseconds += now() - credit->throttledSince;
+    }
+    pthread_mutex_unlock(&credit->lock);
+}
@@ -0,0 +1,60 @@
+#ifndef CREDIT_H
+#define CREDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define CREDIT_DEFAULT 16
+#define CREDIT_MAX 4096
+
+// flow control of one sender: every message it has queued for the broadcast agent holds one
+// credit, its socket is not read while none are left, so a flooding client only slows itself down
+typedef struct Credit {
+    // the user and every queued message, the credit outlives a user that disconnects meanwhile
+    atomic_size_t references;
+    pthread_mutex_t lock;
+    pthread_cond_t returned;
+    int available;
+    int detached;
+    // set by creditWatch(), called once by the thread returning the next credit
+    void (*resume)(void *arg);
+    void *resumeArg;
+    // 0 unless the sender is throttled right now
+    uint64_t throttledSince;
+    uint64_t throttledNanoseconds;
+    size_t throttles;
+} Credit;
+
+// credits of every sender created from now on
+void creditConfigure(int credits);
+
+Credit *creditCreate(void);
+
+void creditRelease(Credit *credit);
+
+// takes one credit for a message handed to the broadcast agent, returns the reference it holds
+Credit *creditTake(Credit *credit);
+
+// gives back the credit of a delivered (or dropped) message and drops its reference, resumes
+// the sender if it was throttled; resume callbacks run under the credit's lock
+void creditReturn(Credit *credit);
+
+// blocks a reader thread while no credit is left
+void creditWait(Credit *credit);
+
+// returns 1 if a credit is left, otherwise 0 and resume(arg) is called once one is returned
+int creditWatch(Credit *credit, void (*resume)(void *), void *arg);
+
+// the sender is gone: no more resume callbacks and waiters are let go
+void creditDetach(Credit *credit);
+
+// the sender is being disconnected: it is never throttled again and a waiting or watched reader
+// is let go, so it gets to see its socket shut down
+void creditInterrupt(Credit *credit);
+
+// how often and for how long in total the sender was throttled, including right now
+void creditStats(Credit *credit, size_t *throttles, uint64_t *throttledNanoseconds);
+
+#endif
@@ -0,0 +1,75 @@
+#include "directmessage.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "util.h"
+#include "frame.h"
+#include "epoch.h"
+#include "journal.h"
+#include "histogram.h"
+
+static Histogram latency;
+static atomic_size_t unknownRecipients = 0;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static Frame *encode(message *buffer, User *sender, const char *prefix, const char *text) {
+    memset(buffer, 0, sizeof(message));
+    snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text), "%s%s",
+             prefix, text);
+    prepareServerMessage(buffer, sender->name, SERVER_CODE_CLIENT_MESSAGE, "");
+    Frame *frame = frameFromMessage(buffer);
+    if (frame != NULL) {
+        frame->sender = sender->id;
+    }
+    return frame;
+}
+
+int directMessageSend(User *sender, const char *recipient, const char *text, message *buffer) {
+    char journalRoom[USERNAME_MAX + 2];
+    char confirmation[USERNAME_MAX + 8];
+    uint64_t start = now();
+
+    // the recipient's memory and socket stay valid until epochExit(), even if it logs out meanwhile
+    epochEnter();
+    User *user = findUserByName(recipient);
+    if (user == NULL || atomic_load(&user->kicked)) {
+        epochExit();
+        atomic_fetch_add(&unknownRecipients, 1);
+        return -1;
+    }
+    Frame *frame = encode(buffer, sender, DIRECT_MESSAGE_PREFIX, text);
+    if (frame == NULL) {
+        epochExit();
+        errnoPrint("could not encode message from %s to %s", sender->name, recipient);
+        return 1;
+    }
+    if (sendFrame(frame, user->socketFileDescriptor) == -1) {
+        errnoPrint("could not send message from %s to %s", sender->name, user->name);
+    }
+    epochExit();
+    histogramRecord(&latency, now() - start);
+
+    snprintf(journalRoom, sizeof(journalRoom), "@%s", recipient);
+    if (journalAppend(frame, journalRoom) == -1) {
+        errnoPrint("could not journal message to %s", recipient);
+    }
+    frameRelease(frame);
+    snprintf(confirmation, sizeof(confirmation), "(to %s) ", recipient);
+    if ((frame = encode(buffer, sender, confirmation, text)) != NULL) {
+        sendFrame(frame, sender->socketFileDescriptor);
+        frameRelease(frame);
+    }
+    return 1;
+}
+
+void directMessagePrintStats(void) {
+    infoPrint("STATS direct messages: %zu sent, %zu to unknown users, latency p50 %.1f us, p99 %.1f us, max %.1f us",
+              histogramCount(&latency), atomic_load(&unknownRecipients),
+              (double) histogramPercentile(&latency, 0.5) / 1000.0,
+              (double) histogramPercentile(&latency, 0.99) / 1000.0, (double) histogramMax(&latency) / 1000.0);
+}
@@ -0,0 +1,17 @@
+#ifndef DIRECTMESSAGE_H
+#define DIRECTMESSAGE_H
+
+#include "user.h"
+#include "protocol.h"
+
+// /msg <user> <text>: the recipient gets "(private) <text>", the sender a "(to <user>) <text>" copy
+#define DIRECT_MESSAGE_PREFIX "(private) "
+
+// delivers text straight into the recipient's send queue from the sender's own thread, the
+// broadcast agent never sees it; returns -1 if no user of that name is logged in
+int directMessageSend(User *sender, const char *recipient, const char *text, message *buffer);
+
+// count and latency from parsed command to the frame queued for the recipient, for /stats
+void directMessagePrintStats(void);
+
+#endif
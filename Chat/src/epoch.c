@@ -0,0 +1,143 @@
+#include "epoch.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct EpochRecord {
+    struct EpochRecord *next;
+    // epoch the owning thread entered its read section in, 0 outside of one
+    atomic_uint_fast64_t active;
+    atomic_int inUse;
+    // only touched by the owning thread
+    unsigned depth;
+} EpochRecord;
+
+typedef struct Retired {
+    struct Retired *next;
+    void *pointer;
+    void (*destructor)(void *);
+    uint64_t epoch;
+} Retired;
+
+static atomic_uint_fast64_t globalEpoch = 1;
+// records are never freed, threads that exit hand theirs back for reuse
+static _Atomic(EpochRecord *) records = NULL;
+static pthread_key_t recordKey;
+static pthread_once_t recordKeyOnce = PTHREAD_ONCE_INIT;
+static __thread EpochRecord *localRecord = NULL;
+
+static pthread_mutex_t limboLock = PTHREAD_MUTEX_INITIALIZER;
+static Retired *limbo = NULL;
+static atomic_size_t limboCount = 0;
+
+static void releaseRecord(void *arg) {
+    EpochRecord *record = (EpochRecord *) arg;
+    record->depth = 0;
+    atomic_store(&record->active, 0);
+    atomic_store(&record->inUse, 0);
+}
+
+static void createRecordKey(void) {
+    pthread_key_create(&recordKey, releaseRecord);
+}
+
+static EpochRecord *acquireRecord(void) {
+    EpochRecord *record;
+
+    if (localRecord != NULL) {
+        return localRecord;
+    }
+    pthread_once(&recordKeyOnce, createRecordKey);
+    for (record = atomic_load(&records); record != NULL; record = record->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&record->inUse, &expected, 1)) {
+            break;
+        }
+    }
+    if (record == NULL) {
+        if ((record = calloc(1, sizeof(EpochRecord))) == NULL) {
+            errorPrint("out of memory for epoch record");
+            abort();
+        }
+        atomic_init(&record->inUse, 1);
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record)) {
+        }
+    }
+    localRecord = record;
+    // hands the record back when the thread exits or is cancelled
+    pthread_setspecific(recordKey, record);
+    return record;
+}
+
+void epochEnter(void) {
+    EpochRecord *record = acquireRecord();
+    if (record->depth++ == 0) {
+        atomic_store(&record->active, atomic_load(&globalEpoch));
+    }
+}
+
+void epochExit(void) {
+    EpochRecord *record = localRecord;
+    if (record != NULL && record->depth > 0 && --record->depth == 0) {
+        atomic_store(&record->active, 0);
+        if (atomic_load_explicit(&limboCount, memory_order_relaxed) > 0) {
+            epochReclaim();
+        }
+    }
+}
+
+void epochRetire(void *pointer, void (*destructor)(void *)) {
+    Retired *retired = malloc(sizeof(Retired));
+    if (retired == NULL) {
+        // cannot tell when it becomes safe to free, leaking beats a use after free
+        errorPrint("out of memory retiring %p", pointer);
+        return;
+    }
+    retired->pointer = pointer;
+    retired->destructor = destructor;
+    retired->epoch = atomic_fetch_add(&globalEpoch, 1);
+
+    pthread_mutex_lock(&limboLock);
+    retired->next = limbo;
+    limbo = retired;
+    atomic_fetch_add(&limboCount, 1);
+    pthread_mutex_unlock(&limboLock);
+    epochReclaim();
+}
+
+void epochReclaim(void) {
+    uint64_t oldest = UINT64_MAX;
+    Retired *reclaimable = NULL;
+
+    for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+        uint64_t active = atomic_load(&record->active);
+        if (active != 0 && active < oldest) {
+            oldest = active;
+        }
+    }
+    pthread_mutex_lock(&limboLock);
+    Retired **link = &limbo;
+    while (*link != NULL) {
+        Retired *retired = *link;
+        // readers that entered in a later epoch cannot have seen it
+        if (retired->epoch < oldest) {
+            *link = retired->next;
+            retired->next = reclaimable;
+            reclaimable = retired;
+            atomic_fetch_sub(&limboCount, 1);
+        } else {
+            link = &retired->next;
+        }
+    }
+    pthread_mutex_unlock(&limboLock);
+
+    while (reclaimable != NULL) {
+        Retired *next = reclaimable->next;
+        reclaimable->destructor(reclaimable->pointer);
+        free(reclaimable);
+        reclaimable = next;
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// epoch based reclamation: memory retired by a writer is only freed after every reader
+// that could still see it has left its read section
+
+// read sections may nest, every epochEnter() needs a matching epochExit() on the same thread
+void epochEnter(void);
+
+void epochExit(void);
+
+// destructor(pointer) runs once no read section that started before this call is active
+void epochRetire(void *pointer, void (*destructor)(void *));
+
+// frees whatever retired memory has become unreachable
+void epochReclaim(void);
+
+#endif
@@ -0,0 +1,172 @@
+#include "fanout.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "user.h"
+#include "util.h"
+#include "frame.h"
+#include "protocol.h"
+#include "histogram.h"
+
+// one call of fanoutSend(), lives on the caller's stack
+typedef struct Batch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+} Batch;
+
+typedef struct Slice {
+    struct Slice *next;
+    Frame *frame;
+    User *const *users;
+    size_t count;
+    int skipSocket;
+    Batch *batch;
+} Slice;
+
+static pthread_t *threads = NULL;
+static int threadCount = 0;
+// slices waiting for a helper, oldest first
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static Slice *head = NULL;
+static Slice *tail = NULL;
+
+static atomic_size_t splitMessages = 0;
+static atomic_size_t helperSlices = 0;
+// from the first to the last copy of a message
+static Histogram fanoutTime;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void sendSlice(const Slice *slice) {
+    for (size_t i = 0; i < slice->count; ++i) {
+        User *user = slice->users[i];
+        if (atomic_load_explicit(&user->kicked, memory_order_relaxed) ||
+            user->socketFileDescriptor == slice->skipSocket) {
+            continue;
+        }
+        // a broken or slow client must not cost the remaining users their copy
+        if (sendFrame(slice->frame, user->socketFileDescriptor) == -1) {
+            errnoPrint("error sending message to %s", user->name);
+        }
+    }
+}
+
+static void *fanoutHelper(void *arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&queueLock);
+        while (head == NULL) {
+            pthread_cond_wait(&queued, &queueLock);
+        }
+        Slice *slice = head;
+        if ((head = slice->next) == NULL) {
+            tail = NULL;
+        }
+        pthread_mutex_unlock(&queueLock);
+
+        // the slice belongs to the waiting caller, it must not be touched after pending drops
+        Batch *batch = slice->batch;
+        sendSlice(slice);
+        atomic_fetch_add(&helperSlices, 1);
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->pending == 0) {
+            pthread_cond_signal(&batch->done);
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+int fanoutStart(int count) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (count == 0) {
+        return 1;
+    }
+    if (cores > 0 && count >= cores) {
+        infoPrint("%d fan-out threads on %ld cores compete with the broadcast workers, delivery may get slower",
+                  count, cores);
+    }
+    if ((threads = calloc((size_t) count, sizeof(pthread_t))) == NULL) {
+        errnoPrint("error allocating fan-out threads");
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (pthread_create(&threads[i], NULL, fanoutHelper, NULL) != 0) {
+            errnoPrint("error creating fan-out thread");
+            return -1;
+        }
+        threadCount++;
+    }
+    debugPrint("%d fan-out threads", count);
+    return 1;
+}
+
+int fanoutThreads(void) {
+    return threadCount;
+}
+
+void fanoutSend(Frame *frame, User *const *users, size_t count, int skipSocket) {
+    Slice slices[FANOUT_THREADS_MAX + 1];
+    Batch batch = {.lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+    uint64_t start = now();
+    size_t sliceCount = count / FANOUT_SLICE_MIN;
+
+    if (sliceCount > (size_t) threadCount + 1) {
+        sliceCount = (size_t) threadCount + 1;
+    }
+    if (sliceCount <= 1) {
+        Slice all = {.frame = frame, .users = users, .count = count, .skipSocket = skipSocket};
+        sendSlice(&all);
+        histogramRecord(&fanoutTime, now() - start);
+        return;
+    }
+
+    // equal slices, the first ones take one more user each if count does not divide evenly
+    size_t offset = 0;
+    for (size_t i = 0; i < sliceCount; ++i) {
+        size_t length = count / sliceCount + (i < count % sliceCount ? 1 : 0);
+        slices[i] = (Slice) {.next = NULL, .frame = frame, .users = users + offset, .count = length,
+                             .skipSocket = skipSocket, .batch = &batch};
+        offset += length;
+    }
+    batch.pending = (int) sliceCount - 1;
+    pthread_mutex_lock(&queueLock);
+    for (size_t i = 1; i < sliceCount; ++i) {
+        if (tail != NULL) {
+            tail->next = &slices[i];
+        } else {
+            head = &slices[i];
+        }
+        tail = &slices[i];
+    }
+    pthread_cond_broadcast(&queued);
+    pthread_mutex_unlock(&queueLock);
+
+    sendSlice(&slices[0]);
+    // the next message of this worker may only start once every recipient has this one queued
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0) {
+        pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    pthread_mutex_destroy(&batch.lock);
+    atomic_fetch_add(&splitMessages, 1);
+    histogramRecord(&fanoutTime, now() - start);
+}
+
+void fanoutPrintStats(void) {
+    infoPrint("STATS fan-out: %d helper threads, %zu messages split, %zu slices sent by helpers, "
+              "p50 %.1f us, p99 %.1f us, max %.1f us", threadCount, atomic_load(&splitMessages),
+              atomic_load(&helperSlices), (double) histogramPercentile(&fanoutTime, 0.5) / 1000.0,
+              (double) histogramPercentile(&fanoutTime, 0.99) / 1000.0, (double) histogramMax(&fanoutTime) / 1000.0);
+}
@@ -0,0 +1,31 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Frame;
+struct User;
+
+#define FANOUT_THREADS_MAX 64
+// fewer recipients per slice are sent by the broadcast worker alone, a handoff costs more than that
+#define FANOUT_SLICE_MIN 128
+
+// starts threads that help the broadcast workers deliver a message to many users, 0 starts none.
+// Off by default: helpers only send in parallel on cores the workers and reactors leave idle. On a
+// single core they were measured no faster than the worker alone (3 helpers slower than 1), and
+// no multi-core numbers exist yet.
+int fanoutStart(int threads);
+
+int fanoutThreads(void);
+
+// sends frame to every user that is not kicked and not on skipSocket (-1 for nobody): the users
+// are cut into slices, helpers send all but the first, which the caller sends itself before it
+// waits for the rest. Returns after every copy was handed to its send queue, so a recipient gets
+// the messages of one broadcast worker in queue order. users must stay valid until then.
+void fanoutSend(struct Frame *frame, struct User *const *users, size_t count, int skipSocket);
+
+// counters for /stats: messages that were split, slices sent by helpers, fan-out time percentiles
+void fanoutPrintStats(void);
+
+#endif
@@ -0,0 +1,45 @@
+#include "frame.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "pool.h"
+
+static Pool framePool = POOL_INITIALIZER("frame", sizeof(Frame) + sizeof(message));
+
+Frame *frameCreate(const void *data, size_t length) {
+    int pooled = length <= sizeof(message);
+    Frame *frame = pooled ? poolAlloc(&framePool) : malloc(sizeof(Frame) + length);
+    if (frame == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    atomic_init(&frame->references, 1);
+    frame->length = length;
+    frame->pooled = pooled;
+    frame->sender = 0;
+    atomic_init(&frame->compact, NULL);
+    atomic_init(&frame->compressed, NULL);
+    memcpy(frame->data, data, length);
+    return frame;
+}
+
+Frame *frameFromMessage(const message *buffer) {
+    return frameCreate(buffer, sizeof(messageHeader) + ntohs(buffer->messageHeader.length));
+}
+
+Frame *frameRetain(Frame *frame) {
+    atomic_fetch_add_explicit(&frame->references, 1, memory_order_relaxed);
+    return frame;
+}
+
+void frameRelease(Frame *frame) {
+    if (frame != NULL && atomic_fetch_sub_explicit(&frame->references, 1, memory_order_acq_rel) == 1) {
+        frameRelease(atomic_load_explicit(&frame->compact, memory_order_acquire));
+        frameRelease(atomic_load_explicit(&frame->compressed, memory_order_acquire));
+        if (frame->pooled) {
+            poolFree(&framePool, frame);
+        } else {
+            free(frame);
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "protocol.h"
+
+// immutable, reference counted wire encoding of one message, shared by every send queue holding it
+typedef struct Frame {
+    atomic_size_t references;
+    size_t length;
+    // frames up to the size of a message come from a pool
+    int pooled;
+    // user whose message or arrival this is, 0 for the server; version 1 sends the id instead of the name
+    uint32_t sender;
+    // version 1 encoding, made once by compactFrame() and released with this frame
+    _Atomic(struct Frame *) compact;
+    // version 2 encoding, made once by compressFrame() and released with this frame
+    _Atomic(struct Frame *) compressed;
+    unsigned char data[];
+} Frame;
+
+// copies length bytes of wire data, the caller owns the only reference
+Frame *frameCreate(const void *data, size_t length);
+
+// wire encoding of a message whose header is already in network byte order
+Frame *frameFromMessage(const message *buffer);
+
+Frame *frameRetain(Frame *frame);
+
+// frees the frame once the last reference is gone
+void frameRelease(Frame *frame);
+
+#endif
@@ -0,0 +1,56 @@
+#include "histogram.h"
+
+static size_t bucketOf(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (size_t) value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    size_t sub = (size_t) (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (size_t) (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t upperBoundOf(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = (int) (bucket / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void histogramRecord(Histogram *histogram, uint64_t value) {
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&histogram->buckets[bucketOf(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed,
+                                                                 memory_order_relaxed)) {
+    }
+}
+
+size_t histogramCount(Histogram *histogram) {
+    return atomic_load_explicit(&histogram->count, memory_order_relaxed);
+}
+
+uint64_t histogramPercentile(Histogram *histogram, double fraction) {
+    size_t count = histogramCount(histogram);
+    size_t rank = (size_t) (fraction * (double) count);
+    size_t seen = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (seen > rank) {
+            uint64_t bound = upperBoundOf(i);
+            uint64_t max = histogramMax(histogram);
+            return bound < max ? bound : max;
+        }
+    }
+    return histogramMax(histogram);
+}
+
+uint64_t histogramMax(Histogram *histogram) {
+    return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
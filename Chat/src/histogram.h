@@ -0,0 +1,30 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// log-linear buckets: every power of two is split into HISTOGRAM_SUB_BUCKETS, so a percentile is
+// off by at most 1/HISTOGRAM_SUB_BUCKETS of its value
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+// recorded from any thread without a lock, zero initialized
+typedef struct Histogram {
+    atomic_size_t buckets[HISTOGRAM_BUCKETS];
+    atomic_size_t count;
+    _Atomic uint64_t max;
+} Histogram;
+
+void histogramRecord(Histogram *histogram, uint64_t value);
+
+size_t histogramCount(Histogram *histogram);
+
+// upper bound of the bucket holding the given fraction (0..1) of the values
+uint64_t histogramPercentile(Histogram *histogram, double fraction);
+
+uint64_t histogramMax(Histogram *histogram);
+
+#endif
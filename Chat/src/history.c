@@ -0,0 +1,114 @@
+#include "history.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "util.h"
+#include "frame.h"
+#include "room.h"
+#include "sendqueue.h"
+
+// joins and records are serialized, so a frame is either replayed to a new member or sent to it live
+static pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+static Frame **frames = NULL;
+static size_t capacity = 0;
+static size_t next = 0;
+static size_t count = 0;
+// frames recorded since the start
+static uint64_t recorded = 0;
+
+int historyStart(size_t frameCount) {
+    if (frameCount == 0) {
+        return 1;
+    }
+    if ((frames = calloc(frameCount, sizeof(Frame *))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    capacity = frameCount;
+    return 1;
+}
+
+static int isRecorded(const Room *room) {
+    return capacity > 0 && room != NULL && strcmp(room->name, ROOM_DEFAULT_NAME) == 0;
+}
+
+UserSnapshot *historyRecord(mqMessage *buffer) {
+    UserSnapshot *members;
+
+    if (!isRecorded(buffer->room) || buffer->message.messageHeader.type != SERVER_2_CLIENT) {
+        return roomMembersAcquire(buffer->room);
+    }
+    if (buffer->frame == NULL && (buffer->frame = frameFromMessage(&buffer->message)) == NULL) {
+        errnoPrint("could not record message in history");
+        return roomMembersAcquire(buffer->room);
+    }
+    pthread_mutex_lock(&historyLock);
+    frameRelease(frames[next]);
+    frames[next] = frameRetain(buffer->frame);
+    next = (next + 1) % capacity;
+    if (count < capacity) {
+        count++;
+    }
+    recorded++;
+    members = roomMembersAcquire(buffer->room);
+    pthread_mutex_unlock(&historyLock);
+    return members;
+}
+
+// caller holds historyLock, retains the frames recorded after the first since ones that are still kept
+static size_t retainSince(Frame **copy, uint64_t since) {
+    size_t missed = recorded - since < count ? (size_t) (recorded - since) : count;
+
+    for (size_t i = 0; i < missed; ++i) {
+        copy[i] = frameRetain(frames[(next + capacity - missed + i) % capacity]);
+    }
+    return missed;
+}
+
+// the send queue does not block, a broken connection is noticed by its reader like after any other failed send
+static void replay(User *user, Frame **copy, size_t frameCount) {
+    if (frameCount > 0 && sendQueuePushFrames(user->socketFileDescriptor, copy, frameCount) == -1) {
+        errnoPrint("could not replay history to %s", user->name);
+    }
+}
+
+static void releaseAll(Frame **copy, size_t frameCount) {
+    for (size_t i = 0; i < frameCount; ++i) {
+        frameRelease(copy[i]);
+    }
+}
+
+int historyJoin(User *user) {
+    if (capacity == 0) {
+        return roomJoin(user, ROOM_DEFAULT_NAME);
+    }
+    Frame **copy = malloc(capacity * sizeof(Frame *));
+    if (copy == NULL) {
+        errnoPrint("could not replay history to %s", user->name);
+        return roomJoin(user, ROOM_DEFAULT_NAME);
+    }
+    // the bulk of the replay, encoded for the user's version on the way, is queued without the lock,
+    // so the broadcast workers recording meanwhile are not held up
+    pthread_mutex_lock(&historyLock);
+    uint64_t since = recorded;
+    size_t replayed = retainSince(copy, since - count);
+    pthread_mutex_unlock(&historyLock);
+    replay(user, copy, replayed);
+    releaseAll(copy, replayed);
+
+    // frames recorded meanwhile go out before the first live one, that is usually none at all
+    pthread_mutex_lock(&historyLock);
+    if (roomJoin(user, ROOM_DEFAULT_NAME) == -1) {
+        pthread_mutex_unlock(&historyLock);
+        free(copy);
+        return -1;
+    }
+    size_t missed = retainSince(copy, since);
+    replay(user, copy, missed);
+    pthread_mutex_unlock(&historyLock);
+    releaseAll(copy, missed);
+    free(copy);
+    debugPrint("replayed %zu messages to %s", replayed + missed, user->name);
+    return 1;
+}
@@ -0,0 +1,22 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include "user.h"
+
+#define HISTORY_FRAMES_MAX 65536
+
+// keeps the last frames messages of the default room for replay on login, every retained frame
+// takes at most sizeof(message) bytes, 0 turns the history off
+int historyStart(size_t frames);
+
+// remembers the frame of a message to the default room and returns the members of buffer->room
+// at that point, valid until roomMembersRelease()
+UserSnapshot *historyRecord(mqMessage *buffer);
+
+// puts a freshly logged in user into the default room and sends it the retained messages, every
+// message of the room reaches the user exactly once and in order, replayed or live; a user that
+// misses more than the retained messages while its replay is queued only gets the newest ones
+int historyJoin(User *user);
+
+#endif
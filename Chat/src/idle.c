@@ -0,0 +1,242 @@
+#include "idle.h"
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "user.h"
+#include "util.h"
+#include "frame.h"
+#include "epoch.h"
+#include "pool.h"
+#include "credit.h"
+#include "protocol.h"
+
+static Pool idleTimerPool = POOL_INITIALIZER("IdleTimer", sizeof(IdleTimer));
+
+static uint64_t timeoutMs = 0;
+static uint64_t heartbeatMs = 0;
+
+static pthread_t idleThread;
+// guards the wheel and every timer's tracked flag
+static pthread_mutex_t wheelLock = PTHREAD_MUTEX_INITIALIZER;
+static TimerWheel wheel;
+// held by the thread while it handles a tick, idleSuspend() keeps it
+static pthread_mutex_t tickLock = PTHREAD_MUTEX_INITIALIZER;
+// milliseconds, advanced once per tick so stamping a frame needs no system call
+static _Atomic uint64_t clockMs = 0;
+static Frame *heartbeat = NULL;
+
+static atomic_size_t heartbeats = 0;
+static atomic_size_t evictions = 0;
+static atomic_size_t checks = 0;
+
+static uint64_t monotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000u + (uint64_t) ts.tv_nsec / 1000000u;
+}
+
+static uint64_t toTicks(uint64_t ms) {
+    return (ms + IDLE_TICK_MS - 1) / IDLE_TICK_MS;
+}
+
+// when the peer's TCP stack last acknowledged anything, 0 if the socket cannot tell
+static uint64_t lastAcknowledged(int sockfd, uint64_t now) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1 || info.tcpi_last_ack_recv > now) {
+        return 0;
+    }
+    return now - info.tcpi_last_ack_recv;
+}
+
+static void evict(User *user) {
+    // claimed first, so neither the user's own thread nor /kick announces the close again
+    if (atomic_exchange(&user->kicked, 1) != 0) {
+        return;
+    }
+    infoPrint("User %s was silent for %" PRIu64 " s, removing", user->name, timeoutMs / 1000);
+    if (notifyUserRemoved(user, USER_REMOVED_STATUS_TIMED_OUT) == -1) {
+        errnoPrint("error sending notifyUserRemoved");
+    }
+    // the thread or reactor reading the socket sees the shutdown and removes the user
+    shutdown(user->socketFileDescriptor, SHUT_RDWR);
+    // a throttled reader would not look at its socket before the paused agent returns a credit
+    creditInterrupt(user->credit);
+    atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+}
+
+// returns when the timer has to fire next, 0 once the user is gone
+static uint64_t check(IdleTimer *idle, uint64_t now) {
+    User *user = idle->user;
+    uint64_t last = atomic_load_explicit(&idle->lastActivity, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&checks, 1, memory_order_relaxed);
+    if (atomic_load(&user->kicked)) {
+        return 0;
+    }
+    if (user->version == VERSION) {
+        uint64_t acknowledged = lastAcknowledged(user->socketFileDescriptor, now);
+        last = acknowledged > last ? acknowledged : last;
+    }
+    if (now - last >= timeoutMs) {
+        evict(user);
+        return 0;
+    }
+    if (now - last < heartbeatMs) {
+        return last + heartbeatMs;
+    }
+    if (user->version >= VERSION_COMPACT && idle->heartbeatFor != last) {
+        if (sendFrame(heartbeat, user->socketFileDescriptor) == -1) {
+            errnoPrint("error sending heartbeat to %s", user->name);
+        }
+        idle->heartbeatFor = last;
+        atomic_fetch_add_explicit(&heartbeats, 1, memory_order_relaxed);
+    }
+    // an answer moves last, looking again after another interval keeps the heartbeats regular
+    return now + heartbeatMs < last + timeoutMs ? now + heartbeatMs : last + timeoutMs;
+}
+
+static void *idleLoop(void *arg) {
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+        next.tv_nsec += IDLE_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+        pthread_mutex_lock(&tickLock);
+        uint64_t now = monotonicMs();
+        atomic_store_explicit(&clockMs, now, memory_order_relaxed);
+
+        pthread_mutex_lock(&wheelLock);
+        Timer *expired = timerWheelAdvance(&wheel, now / IDLE_TICK_MS);
+        // a user still in the wheel has not been retired, the read section keeps it alive until
+        // its timer is handled even if it is removed as soon as the lock is released
+        epochEnter();
+        pthread_mutex_unlock(&wheelLock);
+        if (expired == NULL) {
+            epochExit();
+            pthread_mutex_unlock(&tickLock);
+            continue;
+        }
+
+        for (Timer *timer = expired; timer != NULL; timer = timer->next) {
+            timer->expires = check((IdleTimer *) timer, now);
+        }
+        pthread_mutex_lock(&wheelLock);
+        while (expired != NULL) {
+            Timer *timer = expired;
+            expired = timer->next;
+            timer->next = NULL;
+            if (timer->expires != 0 && ((IdleTimer *) timer)->tracked) {
+                timerWheelAdd(&wheel, timer, toTicks(timer->expires));
+            }
+        }
+        pthread_mutex_unlock(&wheelLock);
+        epochExit();
+        pthread_mutex_unlock(&tickLock);
+    }
+    return arg;
+}
+
+int idleStart(long timeout) {
+    messageHeader header = {.type = HEARTBEAT, .length = 0};
+
+    if (timeout == 0) {
+        return 1;
+    }
+    timeoutMs = (uint64_t) timeout * 1000u;
+    heartbeatMs = timeoutMs / 3;
+    if ((heartbeat = frameCreate(&header, sizeof(header))) == NULL) {
+        errnoPrint("error creating heartbeat frame");
+        return -1;
+    }
+    atomic_store(&clockMs, monotonicMs());
+    timerWheelInit(&wheel, atomic_load(&clockMs) / IDLE_TICK_MS);
+    if (pthread_create(&idleThread, NULL, idleLoop, NULL) != 0) {
+        errnoPrint("error creating idle thread");
+        return -1;
+    }
+    debugPrint("idle timeout %ld s", timeout);
+    return 1;
+}
+
+int idleTrack(User *user) {
+    int domain = 0;
+    socklen_t length = sizeof(domain);
+
+    // a local client that goes away closes its end, the kernel reports that at once
+    if (timeoutMs == 0 || (getsockopt(user->socketFileDescriptor, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 &&
+                           domain == AF_UNIX)) {
+        return 1;
+    }
+    IdleTimer *idle = poolAlloc(&idleTimerPool);
+    if (idle == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(idle, 0, sizeof(IdleTimer));
+    idle->user = user;
+    atomic_init(&idle->lastActivity, atomic_load_explicit(&clockMs, memory_order_relaxed));
+    if (user->version == VERSION) {
+        int on = 1;
+        int seconds = heartbeatMs >= 1000 ? (int) (heartbeatMs / 1000) : 1;
+        if (setsockopt(user->socketFileDescriptor, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1 ||
+            setsockopt(user->socketFileDescriptor, IPPROTO_TCP, TCP_KEEPIDLE, &seconds, sizeof(seconds)) == -1 ||
+            setsockopt(user->socketFileDescriptor, IPPROTO_TCP, TCP_KEEPINTVL, &seconds, sizeof(seconds)) == -1) {
+            debugPrint("no keepalive on socket %d, only its frames count", user->socketFileDescriptor);
+        }
+    }
+    user->idle = idle;
+
+    pthread_mutex_lock(&wheelLock);
+    idle->tracked = 1;
+    timerWheelAdd(&wheel, &idle->timer, toTicks(atomic_load(&idle->lastActivity) + heartbeatMs));
+    pthread_mutex_unlock(&wheelLock);
+    return 1;
+}
+
+void idleUntrack(User *user) {
+    if (user->idle == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&wheelLock);
+    user->idle->tracked = 0;
+    timerWheelRemove(&wheel, &user->idle->timer);
+    pthread_mutex_unlock(&wheelLock);
+}
+
+void idleSuspend(void) {
+    pthread_mutex_lock(&tickLock);
+}
+
+void idleRelease(IdleTimer *idle) {
+    poolFree(&idleTimerPool, idle);
+}
+
+void idleTouch(User *user) {
+    if (user->idle != NULL) {
+        atomic_store_explicit(&user->idle->lastActivity, atomic_load_explicit(&clockMs, memory_order_relaxed),
+                              memory_order_relaxed);
+    }
+}
+
+void idlePrintStats(void) {
+    size_t tracked;
+
+    pthread_mutex_lock(&wheelLock);
+    tracked = wheel.count;
+    pthread_mutex_unlock(&wheelLock);
+    infoPrint("STATS idle: timeout %" PRIu64 " s, %zu timers, %zu checks, %zu heartbeats, %zu users removed",
+              timeoutMs / 1000, tracked, atomic_load(&checks), atomic_load(&heartbeats), atomic_load(&evictions));
+}
@@ -0,0 +1,47 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "timerwheel.h"
+
+#define IDLE_DEFAULT_TIMEOUT 300
+#define IDLE_TICK_MS 100
+
+struct User;
+
+// a logged in user's place in the idle wheel; it only moves when it fires, a frame just stamps
+// lastActivity, so the hot path takes no lock
+typedef struct IdleTimer {
+    Timer timer;
+    struct User *user;
+    _Atomic uint64_t lastActivity;
+    // lastActivity when the last heartbeat went out, at most one per silence
+    uint64_t heartbeatFor;
+    // cleared by idleUntrack(), the wheel thread may still hold the timer in its expired list
+    int tracked;
+} IdleTimer;
+
+// starts the thread that sends heartbeats after a third of timeout seconds of silence and removes
+// users silent for timeout seconds; 0 disables both
+int idleStart(long timeout);
+
+// version 0 clients cannot be sent a heartbeat, the kernel's keepalive probes stand in for it and
+// an acknowledgement counts as activity
+int idleTrack(struct User *user);
+
+// before the user is retired, the timer itself is freed with the user
+void idleUntrack(struct User *user);
+
+// waits for the tick being handled and stops the thread for good, no user is removed or sent a
+// heartbeat afterwards; used before the users are handed over to the next process
+void idleSuspend(void);
+
+void idleRelease(IdleTimer *idle);
+
+// called for every frame a logged in user sends
+void idleTouch(struct User *user);
+
+void idlePrintStats(void);
+
+#endif
@@ -0,0 +1,559 @@
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "frame.h"
+#include "protocol.h"
+
+#define SEGMENT_NAME_LENGTH 24
+// index entries collected before they are written out
+#define INDEX_BATCH 256
+
+typedef struct Segment {
+    int fd;
+    int indexFd;
+    unsigned long long sequence;
+    size_t size;
+    // end of the records written so far
+    size_t offset;
+    // records starting at or after this offset get an index entry
+    size_t nextIndexed;
+    off_t indexSize;
+} Segment;
+
+typedef struct JournalRecord {
+    uint64_t timestamp;
+    char room[256];
+    const unsigned char *frame;
+    size_t length;
+} JournalRecord;
+
+// leaves room for the segment file names in PATH_MAX
+static char journalDirectory[PATH_MAX - SEGMENT_NAME_LENGTH - 1];
+static size_t segmentSize = JOURNAL_SEGMENT_DEFAULT_SIZE;
+// only touched by the writer thread once it runs
+static Segment segment = {.fd = -1, .indexFd = -1};
+
+static pthread_t journalThread;
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t groupFilled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t groupTaken = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t groupWritten = PTHREAD_COND_INITIALIZER;
+// appenders fill one buffer while the writer writes and syncs the other one
+static unsigned char *buffers[2];
+static int collecting = 0;
+static size_t used = 0;
+static uint64_t lastTimestamp = 0;
+static size_t appended = 0;
+// records on disk, the group being written ends at record groupEnd
+static size_t written = 0;
+static size_t groupEnd = 0;
+static size_t commits = 0;
+static size_t stalls = 0;
+// set once a group could not be written, nothing is appended after that
+static int failed = 0;
+static const struct timespec commitInterval = {.tv_sec = 0, .tv_nsec = JOURNAL_COMMIT_INTERVAL_US * 1000};
+
+static void putUint32(unsigned char *bytes, uint32_t value) {
+    for (int i = 3; i >= 0; --i, value >>= 8) {
+        bytes[i] = (unsigned char) value;
+    }
+}
+
+static void putUint64(unsigned char *bytes, uint64_t value) {
+    for (int i = 7; i >= 0; --i, value >>= 8) {
+        bytes[i] = (unsigned char) value;
+    }
+}
+
+static uint32_t getUint32(const unsigned char *bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+static uint64_t getUint64(const unsigned char *bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+// returns the size of the record at data, 0 at the end of the records or at a torn write
+static size_t parseRecord(const unsigned char *data, size_t available, JournalRecord *record) {
+    if (available < JOURNAL_RECORD_HEADER_SIZE) {
+        return 0;
+    }
+    size_t length = getUint32(data);
+    size_t roomLength = data[12];
+    size_t size = JOURNAL_RECORD_HEADER_SIZE + roomLength + length;
+    if (length < sizeof(messageHeader) || size > available) {
+        return 0;
+    }
+    const unsigned char *frame = data + JOURNAL_RECORD_HEADER_SIZE + roomLength;
+    // the frame repeats its own length, a record whose tail never reached the disk does not match
+    if (((size_t) frame[1] << 8 | frame[2]) + sizeof(messageHeader) != length) {
+        return 0;
+    }
+    if (record != NULL) {
+        record->timestamp = getUint64(data + 4);
+        memcpy(record->room, data + JOURNAL_RECORD_HEADER_SIZE, roomLength);
+        record->room[roomLength] = '\0';
+        record->frame = frame;
+        record->length = length;
+    }
+    return size;
+}
+
+static int writeAll(int fd, const void *data, size_t length, off_t offset) {
+    const unsigned char *bytes = data;
+    ssize_t written;
+
+    while (length > 0) {
+        if ((written = pwrite(fd, bytes, length, offset)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t) written;
+        offset += written;
+    }
+    return 1;
+}
+
+static void segmentPath(char *path, unsigned long long sequence, const char *suffix) {
+    snprintf(path, PATH_MAX, "%s/%020llu.%s", journalDirectory, sequence, suffix);
+}
+
+// new files only survive a crash once the directory entry is synced as well
+static void syncDirectory(void) {
+    int fd = open(journalDirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fsync(fd) == -1) {
+        errnoPrint("could not sync journal directory %s", journalDirectory);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+static void closeSegment(void) {
+    if (segment.fd != -1) {
+        close(segment.fd);
+        close(segment.indexFd);
+    }
+    segment.fd = -1;
+    segment.indexFd = -1;
+}
+
+static int openSegment(unsigned long long sequence, int create) {
+    char path[PATH_MAX];
+    struct stat status;
+    int error;
+
+    closeSegment();
+    segmentPath(path, sequence, "log");
+    if ((segment.fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644)) == -1) {
+        errnoPrint("could not open journal segment %s", path);
+        return -1;
+    }
+    // the full size is allocated up front, appending never changes the file's metadata
+    if (create && (error = posix_fallocate(segment.fd, 0, (off_t) segmentSize)) != 0) {
+        errno = error;
+        errnoPrint("could not allocate journal segment %s", path);
+        // an empty segment would be taken for the newest one on the next start
+        unlink(path);
+        close(segment.fd);
+        segment.fd = -1;
+        return -1;
+    }
+    if (fstat(segment.fd, &status) == -1) {
+        close(segment.fd);
+        segment.fd = -1;
+        return -1;
+    }
+    segmentPath(path, sequence, "idx");
+    // the index is rebuilt from the records, so it never points past what survived a crash
+    if ((segment.indexFd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        errnoPrint("could not open journal index %s", path);
+        close(segment.fd);
+        segment.fd = -1;
+        return -1;
+    }
+    segment.sequence = sequence;
+    segment.size = (size_t) status.st_size;
+    segment.offset = 0;
+    segment.nextIndexed = 0;
+    segment.indexSize = 0;
+    if (create) {
+        syncDirectory();
+        debugPrint("journal segment %020llu created", sequence);
+    }
+    return 1;
+}
+
+static int appendIndex(const unsigned char *entries, size_t count) {
+    if (count == 0) {
+        return 1;
+    }
+    if (writeAll(segment.indexFd, entries, count * JOURNAL_INDEX_ENTRY_SIZE, segment.indexSize) == -1) {
+        errnoPrint("could not write journal index %020llu", segment.sequence);
+        return -1;
+    }
+    segment.indexSize += (off_t) (count * JOURNAL_INDEX_ENTRY_SIZE);
+    return 1;
+}
+
+// adds an entry for the record at the end of the segment if the last one is far enough back
+static void indexRecord(unsigned char *entries, size_t *count, uint64_t timestamp) {
+    if (segment.offset < segment.nextIndexed) {
+        return;
+    }
+    putUint64(entries + *count * JOURNAL_INDEX_ENTRY_SIZE, timestamp);
+    putUint64(entries + *count * JOURNAL_INDEX_ENTRY_SIZE + 8, segment.offset);
+    segment.nextIndexed = segment.offset + JOURNAL_INDEX_INTERVAL;
+    if (++*count == INDEX_BATCH) {
+        appendIndex(entries, *count);
+        *count = 0;
+    }
+}
+
+// finds the end of the records of the current segment and indexes them again
+static int recoverSegment(void) {
+    unsigned char entries[INDEX_BATCH * JOURNAL_INDEX_ENTRY_SIZE];
+    size_t count = 0;
+    size_t size;
+    JournalRecord record;
+
+    unsigned char *data = mmap(NULL, segment.size, PROT_READ, MAP_SHARED, segment.fd, 0);
+    if (data == MAP_FAILED) {
+        errnoPrint("could not map journal segment %020llu", segment.sequence);
+        return -1;
+    }
+    while ((size = parseRecord(data + segment.offset, segment.size - segment.offset, &record)) > 0) {
+        indexRecord(entries, &count, record.timestamp);
+        lastTimestamp = record.timestamp;
+        segment.offset += size;
+    }
+    munmap(data, segment.size);
+    appendIndex(entries, count);
+    // whatever a torn write left behind would otherwise be taken for records later on
+    if (segment.offset < segment.size) {
+        unsigned char zeros[JOURNAL_RECORD_HEADER_SIZE] = {0};
+        size_t length = segment.size - segment.offset < sizeof(zeros) ? segment.size - segment.offset
+                                                                        : sizeof(zeros);
+        writeAll(segment.fd, zeros, length, (off_t) segment.offset);
+    }
+    infoPrint("journal continues segment %020llu at offset %zu", segment.sequence, segment.offset);
+    return 1;
+}
+
+static int isSegment(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    return length == SEGMENT_NAME_LENGTH && strcmp(entry->d_name + length - 4, ".log") == 0;
+}
+
+// writes one group of records, moving on to a new segment whenever the current one is full; returns -1
+// if the group did not reach the disk as a whole
+static int writeGroup(const unsigned char *group, size_t length) {
+    unsigned char entries[INDEX_BATCH * JOURNAL_INDEX_ENTRY_SIZE];
+    size_t count = 0;
+    size_t runStart = 0;
+    size_t runOffset = segment.offset;
+    size_t position = 0;
+    JournalRecord record;
+
+    while (position < length) {
+        size_t size = parseRecord(group + position, length - position, &record);
+        if (segment.offset + size > segment.size) {
+            if (writeAll(segment.fd, group + runStart, position - runStart, (off_t) runOffset) == -1 ||
+                fdatasync(segment.fd) == -1) {
+                errnoPrint("could not write journal segment %020llu", segment.sequence);
+                return -1;
+            }
+            appendIndex(entries, count);
+            count = 0;
+            if (openSegment(segment.sequence + 1, 1) == -1) {
+                return -1;
+            }
+            runStart = position;
+            runOffset = 0;
+        }
+        indexRecord(entries, &count, record.timestamp);
+        segment.offset += size;
+        position += size;
+    }
+    if (writeAll(segment.fd, group + runStart, length - runStart, (off_t) runOffset) == -1 ||
+        fdatasync(segment.fd) == -1) {
+        errnoPrint("could not write journal segment %020llu", segment.sequence);
+        return -1;
+    }
+    // index entries only ever point at synced records
+    appendIndex(entries, count);
+    return 1;
+}
+
+static void *journalWriter(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&journalLock);
+        while (used == 0) {
+            pthread_cond_wait(&groupFilled, &journalLock);
+        }
+        // everything appended while the previous group was synced goes to disk with one fsync
+        unsigned char *group = buffers[collecting];
+        size_t length = used;
+        collecting ^= 1;
+        used = 0;
+        groupEnd = appended;
+        pthread_cond_broadcast(&groupTaken);
+        pthread_mutex_unlock(&journalLock);
+
+        int result = writeGroup(group, length);
+        pthread_mutex_lock(&journalLock);
+        // the records of this group and every later one are lost, appenders and journalSync() learn of it
+        if (result == -1) {
+            failed = 1;
+            pthread_cond_broadcast(&groupTaken);
+            pthread_cond_broadcast(&groupWritten);
+            pthread_mutex_unlock(&journalLock);
+            errorPrint("journal stopped, %zu records are not on disk and no more are taken", appended - written);
+            return arg;
+        }
+        commits++;
+        written = groupEnd;
+        pthread_cond_broadcast(&groupWritten);
+        pthread_mutex_unlock(&journalLock);
+        // a fast disk would otherwise sync nearly every record on its own, let the next group grow
+        if (length < JOURNAL_BUFFER_SIZE / 2) {
+            nanosleep(&commitInterval, NULL);
+        }
+    }
+    return arg;
+}
+
+int journalStart(const char *directory, size_t size) {
+    struct dirent **entries;
+    int count;
+    int result;
+
+    if (strlen(directory) >= sizeof(journalDirectory)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(journalDirectory, directory);
+    segmentSize = size;
+    if (mkdir(journalDirectory, 0755) == -1 && errno != EEXIST) {
+        errnoPrint("could not create journal directory %s", journalDirectory);
+        return -1;
+    }
+    if ((count = scandir(journalDirectory, &entries, isSegment, alphasort)) == -1) {
+        errnoPrint("could not list journal directory %s", journalDirectory);
+        return -1;
+    }
+    if (count == 0) {
+        result = openSegment(0, 1);
+    } else {
+        result = openSegment(strtoull(entries[count - 1]->d_name, NULL, 10), 0);
+        if (result != -1) {
+            result = recoverSegment();
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        free(entries[i]);
+    }
+    free(entries);
+    if (result == -1) {
+        closeSegment();
+        return -1;
+    }
+    if ((buffers[0] = malloc(JOURNAL_BUFFER_SIZE)) == NULL || (buffers[1] = malloc(JOURNAL_BUFFER_SIZE)) == NULL) {
+        free(buffers[0]);
+        buffers[0] = NULL;
+        closeSegment();
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pthread_create(&journalThread, NULL, journalWriter, NULL) != 0) {
+        errnoPrint("error creating journal writer thread");
+        return -1;
+    }
+    return 1;
+}
+
+int journalAppend(const Frame *frame, const char *room) {
+    struct timespec now;
+    size_t roomLength = room != NULL ? strlen(room) : 0;
+    size_t size = JOURNAL_RECORD_HEADER_SIZE + roomLength + frame->length;
+
+    if (buffers[0] == NULL) {
+        return 1;
+    }
+    if (roomLength > UINT8_MAX || size > JOURNAL_BUFFER_SIZE || size > segmentSize) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&journalLock);
+    // the writer is a whole buffer behind, waiting here is the only backpressure the disk applies
+    if (!failed && used + size > JOURNAL_BUFFER_SIZE) {
+        stalls++;
+        while (!failed && used + size > JOURNAL_BUFFER_SIZE) {
+            pthread_cond_wait(&groupTaken, &journalLock);
+        }
+    }
+    if (failed) {
+        pthread_mutex_unlock(&journalLock);
+        errno = EIO;
+        return -1;
+    }
+    uint64_t timestamp = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+    // queries rely on timestamps that never go back, even if the clock does
+    if (timestamp < lastTimestamp) {
+        timestamp = lastTimestamp;
+    }
+    lastTimestamp = timestamp;
+    unsigned char *record = buffers[collecting] + used;
+    putUint32(record, (uint32_t) frame->length);
+    putUint64(record + 4, timestamp);
+    record[12] = (unsigned char) roomLength;
+    memcpy(record + JOURNAL_RECORD_HEADER_SIZE, room, roomLength);
+    memcpy(record + JOURNAL_RECORD_HEADER_SIZE + roomLength, frame->data, frame->length);
+    if (used == 0) {
+        pthread_cond_signal(&groupFilled);
+    }
+    used += size;
+    appended++;
+    pthread_mutex_unlock(&journalLock);
+    return 1;
+}
+
+int journalSync(void) {
+    int result;
+
+    if (buffers[0] == NULL) {
+        return 1;
+    }
+    pthread_mutex_lock(&journalLock);
+    while (!failed && written < appended) {
+        pthread_cond_wait(&groupWritten, &journalLock);
+    }
+    result = written < appended ? -1 : 1;
+    pthread_mutex_unlock(&journalLock);
+    return result;
+}
+
+void journalStats(size_t *records, size_t *groups, size_t *waits) {
+    pthread_mutex_lock(&journalLock);
+    *records = appended;
+    *groups = commits;
+    *waits = stalls;
+    pthread_mutex_unlock(&journalLock);
+}
+
+// offset of the last indexed record before from, scanning from there finds every match
+static size_t seekIndex(const unsigned char *index, size_t entries, uint64_t from) {
+    size_t low = 0;
+    size_t high = entries;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (getUint64(index + middle * JOURNAL_INDEX_ENTRY_SIZE) < from) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low == 0 ? 0 : getUint64(index + (low - 1) * JOURNAL_INDEX_ENTRY_SIZE + 8);
+}
+
+static void *mapFile(const char *path, size_t *size) {
+    struct stat status;
+    void *data = MAP_FAILED;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return MAP_FAILED;
+    }
+    if (fstat(fd, &status) == 0 && status.st_size > 0) {
+        *size = (size_t) status.st_size;
+        data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return data;
+}
+
+// returns 1 to go on with the next segment, 0 once the range is done, -1 on error
+static int querySegment(const char *directory, const char *name, uint64_t from, uint64_t to,
+                        JournalVisitor visitor, void *arg, ssize_t *visited) {
+    char path[PATH_MAX];
+    size_t size = 0;
+    size_t indexSize = 0;
+    size_t offset = 0;
+    size_t recordSize;
+    int result = 1;
+    JournalRecord record;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    unsigned char *data = mapFile(path, &size);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    // a segment without a usable index is scanned from its start
+    snprintf(path, sizeof(path), "%s/%.20s.idx", directory, name);
+    unsigned char *index = mapFile(path, &indexSize);
+    if (index != MAP_FAILED) {
+        offset = seekIndex(index, indexSize / JOURNAL_INDEX_ENTRY_SIZE, from);
+        munmap(index, indexSize);
+    }
+    madvise(data + offset / 4096 * 4096, size - offset / 4096 * 4096, MADV_SEQUENTIAL);
+    while (offset < size && (recordSize = parseRecord(data + offset, size - offset, &record)) > 0) {
+        if (record.timestamp > to) {
+            result = 0;
+            break;
+        }
+        if (record.timestamp >= from) {
+            (*visited)++;
+            if (visitor(record.timestamp, record.room[0] != '\0' ? record.room : NULL, record.frame, record.length,
+                        arg) != 0) {
+                result = 0;
+                break;
+            }
+        }
+        offset += recordSize;
+    }
+    munmap(data, size);
+    return result;
+}
+
+ssize_t journalQuery(const char *directory, uint64_t from, uint64_t to, JournalVisitor visitor, void *arg) {
+    struct dirent **entries;
+    ssize_t visited = 0;
+    int result = 1;
+    int count;
+
+    if ((count = scandir(directory, &entries, isSegment, alphasort)) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        if (result == 1) {
+            result = querySegment(directory, entries[i]->d_name, from, to, visitor, arg, &visited);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return result == -1 ? -1 : visited;
+}
@@ -0,0 +1,48 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct Frame;
+
+// the journal is a directory of fixed-size segment files (%020llu.log) holding records in network
+// byte order: uint32 frame length, uint64 nanoseconds since the epoch (never decreasing),
+// uint8 room name length, the room name (empty for messages to everyone), the wire frame;
+// the unused rest of a segment is zero. Each segment has a sparse index (%020llu.idx) of
+// uint64 timestamp, uint64 offset pairs, one per JOURNAL_INDEX_INTERVAL bytes of records.
+#define JOURNAL_SEGMENT_DEFAULT_SIZE (64 * 1024 * 1024)
+#define JOURNAL_SEGMENT_MIN_SIZE (64 * 1024)
+#define JOURNAL_SEGMENT_MAX_SIZE (1L << 30)
+#define JOURNAL_INDEX_INTERVAL 4096
+#define JOURNAL_RECORD_HEADER_SIZE 13
+#define JOURNAL_INDEX_ENTRY_SIZE 16
+// records buffered while the previous group is written and synced
+#define JOURNAL_BUFFER_SIZE (1024 * 1024)
+// pause after a small commit so the next group collects more records, delays durability by this much
+#define JOURNAL_COMMIT_INTERVAL_US 2000
+
+// continues the newest segment in directory, or creates the first one, and starts the thread
+// that writes and fsyncs buffered records in groups
+int journalStart(const char *directory, size_t segmentSize);
+
+// copies the frame into the group being collected, only waits if a whole buffer of records is
+// still waiting for the disk; room is NULL for messages to everyone. Returns -1 (EIO) once a group
+// could not be written or a new segment not be created: the journal stops then, nothing is retried
+int journalAppend(const struct Frame *frame, const char *room);
+
+// waits until every record appended so far is written and synced, -1 if some never will be
+int journalSync(void);
+
+// counters for /stats: records appended, groups synced, appends that had to wait for the disk
+void journalStats(size_t *records, size_t *commits, size_t *stalls);
+
+typedef int (*JournalVisitor)(uint64_t timestamp, const char *room, const unsigned char *frame, size_t length,
+                              void *arg);
+
+// maps the segments of directory and calls visitor for every record with from <= timestamp <= to,
+// in log order, until it returns something other than 0; returns the number of visited records
+ssize_t journalQuery(const char *directory, uint64_t from, uint64_t to, JournalVisitor visitor, void *arg);
+
+#endif
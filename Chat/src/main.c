@@ -1,46 +1,331 @@
 #include <stdlib.h>
+#include <getopt.h>
 #include "connectionhandler.h"
 #include "broadcastagent.h"
+#include "sendqueue.h"
+#include "history.h"
+#include "journal.h"
+#include "credit.h"
+#include "fanout.h"
+#include "compact.h"
+#include "compress.h"
+#include "idle.h"
+#include "upgrade.h"
+#include "cluster.h"
+#include "admin.h"
 #include "util.h"
 #include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+static void printUsage(void) {
+    normalPrint("Usage : ./server [--reactor] [--shards N] [--queue ring|mq] [--queue-capacity N] [--broadcast-workers N]");
+    normalPrint("                [--send-queue-limit BYTES] [--slow-consumer drop|kick] [--log-level LEVEL]");
+    normalPrint("                [--history N] [--journal DIR] [--journal-segment BYTES] [--sender-credits N]");
+    normalPrint("                [--fanout-threads N] [--compress-min BYTES] [--idle-timeout S]");
+    normalPrint("                [--upgrade-socket PATH] [--cluster-port PORT] [--peer HOST:PORT]...");
+    normalPrint("                [--unix-socket PATH] [--unix-seqpacket] [PORT]");
+    normalPrint("  --shards N  N reactors on SO_REUSEPORT sockets, 0 for one per core");
+    normalPrint("  --queue ring|mq  broadcast queue backend (default ring)");
+    normalPrint("  --queue-capacity N  messages the broadcast queue holds (default %d, mq: %d)",
+                BROADCAST_QUEUE_DEFAULT_CAPACITY, BROADCAST_QUEUE_MQ_DEFAULT_CAPACITY);
+    normalPrint("  --broadcast-workers N  threads delivering room messages, rooms are spread over them (default 1)");
+    normalPrint("  --send-queue-limit BYTES  outbound bytes queued per client (default %d)", SEND_QUEUE_DEFAULT_LIMIT);
+    normalPrint("  --slow-consumer drop|kick  drop a full queue's oldest frames or disconnect the client");
+    normalPrint("  --log-level debug|info|error  least severe messages to print (default info)");
+    normalPrint("  --history N  replay the last N lobby messages on login, at most %zu bytes each (default 0)",
+                sizeof(message));
+    normalPrint("  --journal DIR  append every broadcast message to segment files in DIR, synced in groups");
+    normalPrint("  --journal-segment BYTES  size of one journal segment file (default %d)", JOURNAL_SEGMENT_DEFAULT_SIZE);
+    normalPrint("  --sender-credits N  messages of a client awaiting broadcast before its socket is not read (default %d)",
+                CREDIT_DEFAULT);
+    normalPrint("  --fanout-threads N  threads helping to send a message to %d or more users, only worth it with",
+                2 * FANOUT_SLICE_MIN);
+    normalPrint("                      idle cores (default 0)");
+    normalPrint("  --compress-min BYTES  smallest message deflated for clients of protocol version %d (default %d)",
+                VERSION_COMPRESSED, COMPRESS_DEFAULT_THRESHOLD);
+    normalPrint("  --idle-timeout S  remove users silent for S seconds, heartbeat after S/3, 0 never (default %d)",
+                IDLE_DEFAULT_TIMEOUT);
+    normalPrint("  --upgrade-socket PATH  take the clients over from a server listening on PATH, then offer them");
+    normalPrint("                         to the next one started with the same PATH");
+    normalPrint("  --cluster-port PORT  accept links from the other servers of a cluster on PORT");
+    normalPrint("  --peer HOST:PORT  link to the server with that cluster port, once for every other server (at most %d)",
+                CLUSTER_PEERS_MAX);
+    normalPrint("  --unix-socket PATH  also accept clients on the same host on an AF_UNIX socket at PATH");
+    normalPrint("  --unix-seqpacket  make it a SOCK_SEQPACKET socket, one frame per packet to the client");
+}
 
 int main(int argc, char **argv) {
     int result = 0;
+    int option;
+    int mode = CONNECTION_MODE_THREADED;
+    long shards = 1;
+    int queueBackend = BROADCAST_QUEUE_RING;
+    long queueCapacity = 0;
+    long broadcastWorkers = 1;
+    long sendQueueLimit = SEND_QUEUE_DEFAULT_LIMIT;
+    int slowConsumerPolicy = SEND_QUEUE_POLICY_DROP_OLDEST;
+    long historyFrames = 0;
+    const char *journalDirectory = NULL;
+    long journalSegment = JOURNAL_SEGMENT_DEFAULT_SIZE;
+    long senderCredits = CREDIT_DEFAULT;
+    long fanoutThreads = 0;
+    long compressMin = COMPRESS_DEFAULT_THRESHOLD;
+    long idleTimeout = IDLE_DEFAULT_TIMEOUT;
+    const char *upgradePath = NULL;
+    int takenOver = 0;
+    long clusterPort = 0;
+    char *peers[CLUSTER_PEERS_MAX];
+    int peerCount = 0;
+    const char *unixPath = NULL;
+    int unixSeqpacket = 0;
+    long port = 8111;
     char *endptr = NULL;
-    debugEnable();
+    static const struct option longOptions[] = {
+            {"reactor",           no_argument,       NULL, 'r'},
+            {"shards",            required_argument, NULL, 's'},
+            {"queue",             required_argument, NULL, 'q'},
+            {"queue-capacity",    required_argument, NULL, 'c'},
+            {"broadcast-workers", required_argument, NULL, 'w'},
+            {"send-queue-limit",  required_argument, NULL, 'l'},
+            {"slow-consumer",     required_argument, NULL, 'p'},
+            {"log-level",         required_argument, NULL, 'L'},
+            {"history",           required_argument, NULL, 'H'},
+            {"journal",           required_argument, NULL, 'j'},
+            {"journal-segment",   required_argument, NULL, 'J'},
+            {"sender-credits",    required_argument, NULL, 'C'},
+            {"fanout-threads",    required_argument, NULL, 'F'},
+            {"compress-min",      required_argument, NULL, 'z'},
+            {"idle-timeout",      required_argument, NULL, 'i'},
+            {"upgrade-socket",    required_argument, NULL, 'u'},
+            {"cluster-port",      required_argument, NULL, 'K'},
+            {"peer",              required_argument, NULL, 'N'},
+            {"unix-socket",       required_argument, NULL, 'U'},
+            {"unix-seqpacket",    no_argument,       NULL, 'S'},
+            {NULL, 0,                                NULL, 0}
+    };
     styleEnable();
     setProgName(argv[0]);
 
-
-    if (argc <= 1) {
-        if (broadcastAgentStart() == -1) {
-            return EXIT_FAILURE;
-        }
-        infoPrint("Chat server, group 12");
-        result = connectionHandler((in_port_t) 8111);
-    } else if (argc == 2) {
-        if (broadcastAgentStart() == -1) {
-            return EXIT_FAILURE;
+    while ((option = getopt_long(argc, argv, "rs:q:c:w:l:p:L:H:j:J:C:F:z:i:u:K:N:U:S", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'r':
+                mode = CONNECTION_MODE_REACTOR;
+                break;
+            case 's':
+                shards = strtol(optarg, &endptr, 10);
+                if (*endptr || shards < 0 || shards > 1024) {
+                    errorPrint("Invalid shard count! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                if (shards == 0) {
+                    shards = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                // shards are reactors, there is no threaded variant
+                mode = CONNECTION_MODE_REACTOR;
+                break;
+            case 'q':
+                if (strcmp(optarg, "ring") == 0) {
+                    queueBackend = BROADCAST_QUEUE_RING;
+                } else if (strcmp(optarg, "mq") == 0) {
+                    queueBackend = BROADCAST_QUEUE_MQ;
+                } else {
+                    errorPrint("Unknown queue backend %s! Exiting..", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                queueCapacity = strtol(optarg, &endptr, 10);
+                if (*endptr || queueCapacity < 1 || queueCapacity > 1L << 20) {
+                    errorPrint("Invalid queue capacity! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                broadcastWorkers = strtol(optarg, &endptr, 10);
+                if (*endptr || broadcastWorkers < 0 || broadcastWorkers > BROADCAST_WORKERS_MAX) {
+                    errorPrint("Invalid broadcast worker count! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                if (broadcastWorkers == 0) {
+                    broadcastWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            case 'l':
+                sendQueueLimit = strtol(optarg, &endptr, 10);
+                if (*endptr || sendQueueLimit < SEND_QUEUE_MIN_LIMIT) {
+                    errorPrint("Send queue limit must be at least %d bytes! Exiting..", SEND_QUEUE_MIN_LIMIT);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "drop") == 0) {
+                    slowConsumerPolicy = SEND_QUEUE_POLICY_DROP_OLDEST;
+                } else if (strcmp(optarg, "kick") == 0) {
+                    slowConsumerPolicy = SEND_QUEUE_POLICY_DISCONNECT;
+                } else {
+                    errorPrint("Unknown slow consumer policy %s! Exiting..", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                if (logLevelFromName(optarg) == -1) {
+                    errorPrint("Unknown log level %s! Exiting..", optarg);
+                    return EXIT_FAILURE;
+                }
+                logLevelSet(logLevelFromName(optarg));
+                break;
+            case 'H':
+                historyFrames = strtol(optarg, &endptr, 10);
+                if (*endptr || historyFrames < 0 || historyFrames > HISTORY_FRAMES_MAX) {
+                    errorPrint("Invalid history size! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':
+                journalDirectory = optarg;
+                break;
+            case 'C':
+                senderCredits = strtol(optarg, &endptr, 10);
+                if (*endptr || senderCredits < 1 || senderCredits > CREDIT_MAX) {
+                    errorPrint("Invalid sender credits! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'J':
+                journalSegment = strtol(optarg, &endptr, 10);
+                if (*endptr || journalSegment < JOURNAL_SEGMENT_MIN_SIZE || journalSegment > JOURNAL_SEGMENT_MAX_SIZE) {
+                    errorPrint("Journal segments must have %d to %ld bytes! Exiting..", JOURNAL_SEGMENT_MIN_SIZE,
+                               JOURNAL_SEGMENT_MAX_SIZE);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'F':
+                fanoutThreads = strtol(optarg, &endptr, 10);
+                if (*endptr || fanoutThreads < 0 || fanoutThreads > FANOUT_THREADS_MAX) {
+                    errorPrint("Invalid fan-out thread count! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'z':
+                compressMin = strtol(optarg, &endptr, 10);
+                if (*endptr || compressMin < 0) {
+                    errorPrint("Invalid compression threshold! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                idleTimeout = strtol(optarg, &endptr, 10);
+                if (*endptr || idleTimeout < 0 || idleTimeout > INT_MAX / 1000) {
+                    errorPrint("Invalid idle timeout! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                upgradePath = optarg;
+                break;
+            case 'K':
+                clusterPort = strtol(optarg, &endptr, 10);
+                if (*endptr || clusterPort <= 0 || clusterPort > UINT16_MAX) {
+                    errorPrint("Invalid cluster port! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N':
+                if (peerCount == CLUSTER_PEERS_MAX || strchr(optarg, ':') == NULL) {
+                    errorPrint("Invalid peer! Exiting..");
+                    return EXIT_FAILURE;
+                }
+                peers[peerCount++] = optarg;
+                break;
+            case 'U':
+                unixPath = optarg;
+                break;
+            case 'S':
+                unixSeqpacket = 1;
+                break;
+            default:
+                printUsage();
+                return EXIT_FAILURE;
         }
+    }
+    if (argc - optind > 1) {
+        errorPrint("No valid parameters given.");
+        printUsage();
+        return EXIT_FAILURE;
+    }
+    if (optind < argc) {
         //check if long too long
-        long port = strtol(argv[1], &endptr, 10);
+        port = strtol(argv[optind], &endptr, 10);
         debugPrint("port %ld | endptr = %s", port, endptr);
         if (port > UINT16_MAX) {
-            infoPrint("Port number too big!");
+            errorPrint("Port number too big!");
             return EXIT_FAILURE;
         }
-        if (!*endptr) {
-            if ((result = connectionHandler((in_port_t) port) == -1)) {
-                debugPrint("could not open socket on port %ld", port);
-                return EXIT_FAILURE;
-            }
-            infoPrint("Chat server, group 12");
-        } else {
-            infoPrint("Invalid Port! Exiting..");
+        if (*endptr) {
+            errorPrint("Invalid Port! Exiting..");
             return EXIT_FAILURE;
         }
-    } else if (argc < 1 || argc >= 2) {
-        infoPrint("No valid parameters given. Usage : ./server [PORT]");
+    }
+
+    if (unixSeqpacket && unixPath == NULL) {
+        errorPrint("--unix-seqpacket needs --unix-socket! Exiting..");
+        return EXIT_FAILURE;
+    }
+
+    // before anything is opened: the journal must be synced and the sockets handed over
+    if (upgradePath != NULL && (takenOver = upgradeReceive(upgradePath)) == -1) {
+        return EXIT_FAILURE;
+    }
+    creditConfigure((int) senderCredits);
+    // clients that are taken over keep decoding timestamps against the base they were sent
+    compactStart(takenOver ? upgradeCompactBase() : (uint64_t) time(NULL));
+    compressConfigure((size_t) compressMin);
+    if (logAsyncStart() == -1) {
+        errnoPrint("could not start the log writer, logging synchronously");
+    }
+    if (sendQueueStart((size_t) sendQueueLimit, slowConsumerPolicy) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (queueCapacity == 0) {
+        // unprivileged processes may not exceed /proc/sys/fs/mqueue/msg_max, which defaults to 10
+        queueCapacity = queueBackend == BROADCAST_QUEUE_MQ ? BROADCAST_QUEUE_MQ_DEFAULT_CAPACITY
+                                                           : BROADCAST_QUEUE_DEFAULT_CAPACITY;
+    }
+    if (historyStart((size_t) historyFrames) == -1) {
+        errnoPrint("could not allocate a history of %ld messages", historyFrames);
+        return EXIT_FAILURE;
+    }
+    if (journalDirectory != NULL && journalStart(journalDirectory, (size_t) journalSegment) == -1) {
+        errnoPrint("could not open journal %s", journalDirectory);
+        return EXIT_FAILURE;
+    }
+    if (fanoutStart((int) fanoutThreads) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (idleStart(idleTimeout) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (broadcastAgentStart(queueBackend, (size_t) queueCapacity, (int) broadcastWorkers) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (clusterStart((in_port_t) clusterPort, peers, peerCount) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (adminStart() == -1) {
+        return EXIT_FAILURE;
+    }
+    if (upgradePath != NULL && upgradeListen(upgradePath) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (unixPath != NULL) {
+        connectionHandlerUnix(unixPath, unixSeqpacket);
+    }
+    infoPrint("Chat server, group 12");
+    if ((result = connectionHandler((in_port_t) port, mode, (int) shards)) == -1) {
+        debugPrint("could not open socket on port %ld", port);
+        return EXIT_FAILURE;
     }
     return result != -1 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,93 @@
+#include "mpscring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+
+// every slot starts with its sequence number, the element follows
+typedef struct SlotHeader {
+    _Atomic size_t sequence;
+} SlotHeader;
+
+static SlotHeader *slotAt(MpscRing *ring, size_t position) {
+    return (SlotHeader *) (ring->slots + (position & ring->mask) * ring->slotSize);
+}
+
+int mpscRingInit(MpscRing *ring, size_t capacity, size_t elementSize) {
+    size_t rounded = 2;
+    const size_t alignment = _Alignof(max_align_t);
+
+    while (rounded < capacity) {
+        rounded <<= 1U;
+    }
+    ring->capacity = rounded;
+    ring->mask = rounded - 1;
+    ring->elementSize = elementSize;
+    ring->slotSize = (sizeof(SlotHeader) + elementSize + alignment - 1) / alignment * alignment;
+    ring->tail = 0;
+    atomic_init(&ring->head, 0);
+    if ((ring->slots = malloc(ring->slotSize * rounded)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < rounded; ++i) {
+        atomic_init(&slotAt(ring, i)->sequence, i);
+    }
+    if (sem_init(&ring->available, 0, 0) == -1) {
+        free(ring->slots);
+        return -1;
+    }
+    return 1;
+}
+
+void mpscRingDestroy(MpscRing *ring) {
+    sem_destroy(&ring->available);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+int mpscRingPush(MpscRing *ring, const void *element) {
+    size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    SlotHeader *slot;
+
+    for (;;) {
+        slot = slotAt(ring, position);
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+        if (difference == 0) {
+            // slot is free for this lap, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // consumer has not released this slot yet
+            return -1;
+        } else {
+            position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    memcpy((unsigned char *) slot + sizeof(SlotHeader), element, ring->elementSize);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    sem_post(&ring->available);
+    return 1;
+}
+
+int mpscRingPop(MpscRing *ring, void *element) {
+    SlotHeader *slot = slotAt(ring, ring->tail);
+
+    while (sem_wait(&ring->available) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    // a later producer may have posted before an earlier one finished copying its slot
+    while (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ring->tail + 1) {
+        sched_yield();
+    }
+    memcpy(element, (unsigned char *) slot + sizeof(SlotHeader), ring->elementSize);
+    atomic_store_explicit(&slot->sequence, ring->tail + ring->capacity, memory_order_release);
+    ring->tail++;
+    return 1;
+}
@@ -0,0 +1,33 @@
+#ifndef MPSCRING_H
+#define MPSCRING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+// bounded lock-free multi-producer/single-consumer queue of fixed-size, preallocated slots
+typedef struct MpscRing {
+    size_t capacity;
+    size_t mask;
+    size_t elementSize;
+    size_t slotSize;
+    unsigned char *slots;
+    _Atomic size_t head;
+    // only touched by the consumer
+    size_t tail;
+    // counts published elements so an idle consumer sleeps instead of spinning
+    sem_t available;
+} MpscRing;
+
+// capacity is rounded up to the next power of two
+int mpscRingInit(MpscRing *ring, size_t capacity, size_t elementSize);
+
+void mpscRingDestroy(MpscRing *ring);
+
+// copies element into a free slot, returns -1 without blocking when the ring is full
+int mpscRingPush(MpscRing *ring, const void *element);
+
+// blocks until an element is available and copies it out, must only be called by one thread
+int mpscRingPop(MpscRing *ring, void *element);
+
+#endif
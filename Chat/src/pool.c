@@ -0,0 +1,138 @@
+#include "pool.h"
+#include "util.h"
+#include <stdlib.h>
+#include <errno.h>
+
+typedef struct PoolCache {
+    size_t count;
+    void *objects[POOL_CACHE_SIZE];
+} PoolCache;
+
+static pthread_mutex_t registrationLock = PTHREAD_MUTEX_INITIALIZER;
+static Pool *pools[POOL_MAX_POOLS];
+static atomic_int poolCount = 0;
+
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+static __thread PoolCache threadCaches[POOL_MAX_POOLS];
+static __thread int cacheRegistered = 0;
+
+static void **nextOf(void *object) {
+    return (void **) object;
+}
+
+static void pushShared(Pool *pool, void **objects, size_t count) {
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < count; ++i) {
+        *nextOf(objects[i]) = pool->freeList;
+        pool->freeList = objects[i];
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// hands the cache of an exiting thread back to the shared free lists
+static void flushCaches(void *arg) {
+    PoolCache *caches = (PoolCache *) arg;
+    for (int i = 0; i < atomic_load(&poolCount); ++i) {
+        pushShared(pools[i], caches[i].objects, caches[i].count);
+        caches[i].count = 0;
+    }
+}
+
+static void createCacheKey(void) {
+    pthread_key_create(&cacheKey, flushCaches);
+}
+
+static int registerPool(Pool *pool) {
+    int index = atomic_load(&pool->index);
+    if (index >= 0) {
+        return index;
+    }
+    pthread_mutex_lock(&registrationLock);
+    if ((index = atomic_load(&pool->index)) < 0) {
+        index = atomic_load(&poolCount);
+        if (index >= POOL_MAX_POOLS) {
+            pthread_mutex_unlock(&registrationLock);
+            errorPrint("too many pools, raise POOL_MAX_POOLS");
+            abort();
+        }
+        // round up so every object in a slab stays aligned
+        const size_t alignment = _Alignof(max_align_t);
+        if (pool->objectSize < sizeof(void *)) {
+            pool->objectSize = sizeof(void *);
+        }
+        pool->objectSize = (pool->objectSize + alignment - 1) / alignment * alignment;
+        pools[index] = pool;
+        atomic_store(&poolCount, index + 1);
+        atomic_store(&pool->index, index);
+    }
+    pthread_mutex_unlock(&registrationLock);
+    return index;
+}
+
+static PoolCache *threadCache(int index) {
+    if (!cacheRegistered) {
+        pthread_once(&cacheKeyOnce, createCacheKey);
+        pthread_setspecific(cacheKey, threadCaches);
+        cacheRegistered = 1;
+    }
+    return &threadCaches[index];
+}
+
+// moves half a cache worth of objects from the shared list, carving a new slab if it is empty
+static int refill(Pool *pool, PoolCache *cache) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->freeList == NULL) {
+        unsigned char *slab = malloc(pool->objectSize * POOL_SLAB_OBJECTS);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        atomic_fetch_add_explicit(&pool->slabs, 1, memory_order_relaxed);
+        for (size_t i = 0; i < POOL_SLAB_OBJECTS; ++i) {
+            *nextOf(slab + i * pool->objectSize) = pool->freeList;
+            pool->freeList = slab + i * pool->objectSize;
+        }
+    }
+    while (pool->freeList != NULL && cache->count < POOL_CACHE_SIZE / 2) {
+        cache->objects[cache->count++] = pool->freeList;
+        pool->freeList = *nextOf(pool->freeList);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+void *poolAlloc(Pool *pool) {
+    PoolCache *cache = threadCache(registerPool(pool));
+    if (cache->count == 0 && refill(pool, cache) == -1) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&pool->allocations, 1, memory_order_relaxed);
+    return cache->objects[--cache->count];
+}
+
+void poolFree(Pool *pool, void *object) {
+    if (object == NULL) {
+        return;
+    }
+    PoolCache *cache = threadCache(registerPool(pool));
+    if (cache->count == POOL_CACHE_SIZE) {
+        // keep half so alternating alloc/free does not bounce on the shared list
+        pushShared(pool, cache->objects + POOL_CACHE_SIZE / 2, POOL_CACHE_SIZE / 2);
+        cache->count = POOL_CACHE_SIZE / 2;
+    }
+    cache->objects[cache->count++] = object;
+    atomic_fetch_add_explicit(&pool->frees, 1, memory_order_relaxed);
+}
+
+void poolPrintStats(void) {
+    for (int i = 0; i < atomic_load(&poolCount); ++i) {
+        Pool *pool = pools[i];
+        size_t allocations = atomic_load(&pool->allocations);
+        size_t frees = atomic_load(&pool->frees);
+        infoPrint("POOL %s: %zu allocations, %zu frees, %zu in use, %zu slab mallocs (%zu bytes each)", pool->name,
+                  allocations, frees, allocations - frees, atomic_load(&pool->slabs),
+                  pool->objectSize * POOL_SLAB_OBJECTS);
+    }
+}
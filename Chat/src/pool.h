@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define POOL_MAX_POOLS 16
+// objects a thread keeps for itself before it touches the shared free list
+#define POOL_CACHE_SIZE 32
+#define POOL_SLAB_OBJECTS 64
+
+// fixed-size object pool: per-thread caches in front of a shared free list that is refilled
+// one slab (a single malloc) at a time, memory goes back to the pool, never to the system
+typedef struct Pool {
+    const char *name;
+    size_t objectSize;
+    pthread_mutex_t lock;
+    void *freeList;
+    atomic_int index;
+    atomic_size_t allocations;
+    atomic_size_t frees;
+    atomic_size_t slabs;
+} Pool;
+
+#define POOL_INITIALIZER(poolName, size) \
+    { .name = (poolName), .objectSize = (size), .lock = PTHREAD_MUTEX_INITIALIZER, .freeList = NULL, \
+      .index = -1, .allocations = 0, .frees = 0, .slabs = 0 }
+
+// returns uninitialized memory of pool->objectSize bytes
+void *poolAlloc(Pool *pool);
+
+void poolFree(Pool *pool, void *object);
+
+// allocation counters of every pool used so far, slab count stays flat in steady state
+void poolPrintStats(void);
+
+#endif
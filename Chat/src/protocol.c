@@ -3,9 +3,15 @@
 #include "util.h"
 #include "user.h"
 #include <stdlib.h>
-#include "broadcastagent.h"
+#include "sendqueue.h"
+#include "frame.h"
+#include "pool.h"
+#include "room.h"
+#include "directmessage.h"
+#include "compact.h"
+#include "admin.h"
+#include <stdio.h>
 #include <signal.h>
-#include <stdbool.h>
 #include <errno.h>
 #include <fcntl.h>
 
@@ -17,84 +23,136 @@ const char *notificationDontKickYourself = "Please do not kick yourself, disconn
 const char *notificationServerResumed = "Server resumed.";
 const char *notificationAlreadyPaused = "Cannot halt server, already halted";
 const char *notificationCannotResume = "Cannot resume server, not paused";
+const char *notificationRoomJoined = "Joined room ";
+const char *notificationRoomLeft = "Left room ";
+const char *notificationRoomInvalid = "Invalid room name.";
+const char *notificationUserUnknown = "No such user.";
+const char *notificationUserKicked = "Kicked ";
 const char *commandKick = "/kick";
 const char *commandPause = "/pause";
 const char *commandResume = "/resume";
-ssize_t headerSize = sizeof(uint8_t) + sizeof(uint16_t);
-bool isPaused = false;
+const char *commandStats = "/stats";
+const char *commandJoin = "/join";
+const char *commandLeave = "/leave";
+const char *commandMsg = "/msg";
+
+static Pool messagePool = POOL_INITIALIZER("message", sizeof(message));
+
+message *allocMessage(void) {
+    message *buffer = poolAlloc(&messagePool);
+    if (buffer != NULL) {
+        memset(buffer, 0, sizeof(message));
+    }
+    return buffer;
+}
+
+void freeMessage(message *buffer) {
+    poolFree(&messagePool, buffer);
+}
+
+static void *finishCommand(message *tmpMessage) {
+    freeMessage(tmpMessage);
+    return NULL;
+}
+
+// /join <room> moves the user into the room, /leave back into the default room
+static void processRoomCommand(User *user, char *buf, message *tmpMessage) {
+    char roomName[ROOM_NAME_MAX + 1];
+    char *save;
+    char *command = strtok_r(buf, " ", &save);
+
+    if (strcmp(command, commandJoin) == 0) {
+        char *name = strtok_r(NULL, " ", &save);
+        if (name == NULL || roomJoin(user, name) == -1) {
+            sendServerMessage(tmpMessage, user->socketFileDescriptor, "", SERVER_CODE_ROOM_INVALID, "");
+            return;
+        }
+        sendServerMessage(tmpMessage, user->socketFileDescriptor, "", SERVER_CODE_ROOM_JOINED, name);
+    } else if (strcmp(command, commandLeave) == 0 && user->room != NULL) {
+        strncpy(roomName, user->room->name, sizeof(roomName));
+        if (roomLeave(user) == -1) {
+            sendServerMessage(tmpMessage, user->socketFileDescriptor, "", SERVER_CODE_INVALID_COMMAND, "");
+            return;
+        }
+        sendServerMessage(tmpMessage, user->socketFileDescriptor, "", SERVER_CODE_ROOM_LEFT, roomName);
+    } else {
+        sendServerMessage(tmpMessage, user->socketFileDescriptor, "", SERVER_CODE_INVALID_COMMAND, "");
+    }
+}
+
+// /msg <user> <text> goes straight to the recipient
+static void processDirectMessage(User *user, char *buf, message *tmpMessage) {
+    char *save;
+    char *command = strtok_r(buf, " ", &save);
+    char *recipient = strtok_r(NULL, " ", &save);
+    char *text = strtok_r(NULL, "", &save);
+
+    if (strcmp(command, commandMsg) != 0 || recipient == NULL || text == NULL) {
+        sendServerMessage(tmpMessage, user->socketFileDescriptor, "", SERVER_CODE_INVALID_COMMAND, "");
+    } else if (directMessageSend(user, recipient, text, tmpMessage) == -1) {
+        memset(tmpMessage, 0, sizeof(message));
+        sendServerMessage(tmpMessage, user->socketFileDescriptor, "", SERVER_CODE_USER_UNKNOWN, "");
+    }
+}
 
 void *processCommand(const char *command, size_t len, int sockfd) {
-    message *tmpMessage = malloc(sizeof(message));
-    mqMessage *tmpMqMessage = malloc(sizeof(mqMessage));
+    message *tmpMessage = allocMessage();
+    if (tmpMessage == NULL) {
+        errnoPrint("could not allocate command buffer");
+        return finishCommand(tmpMessage);
+    }
     User *thisUser = accessViaSockfd(sockfd);
-    if (strncmp(thisUser->name, "Admin", sizeof(accessViaSockfd(sockfd)->name)) != 0) {
+    char buf[len + 1];
+    strncpy(buf, command, len);
+    buf[len] = '\0';
+    // room commands are open to everybody
+    if (thisUser != NULL && (strncmp(command, commandJoin, strlen(commandJoin)) == 0 ||
+                             strncmp(command, commandLeave, strlen(commandLeave)) == 0)) {
+        processRoomCommand(thisUser, buf, tmpMessage);
+        infoPrint("%s entered by %s", buf, thisUser->name);
+        return finishCommand(tmpMessage);
+    }
+    if (thisUser != NULL && strncmp(command, commandMsg, strlen(commandMsg)) == 0) {
+        processDirectMessage(thisUser, buf, tmpMessage);
+        // strtok_r() cut buf after the command, the text itself is not logged
+        infoPrint("%s entered by %s", buf, thisUser->name);
+        return finishCommand(tmpMessage);
+    }
+    if (thisUser == NULL || strncmp(thisUser->name, ADMIN_NAME, sizeof(thisUser->name)) != 0) {
         sendServerMessage(tmpMessage, sockfd, "", SERVER_CODE_INVALID_PERMISSIONS, "");
-        return NULL;
-    } else {
-        char buf[len + 1];
-        strncpy(buf, command, len);
-        buf[len + 1] = '\0';
-        if (strncmp(command, commandKick, strlen(commandKick)) == 0) {
-            strtok(buf, " ");
-            debugPrint("kick command entered");
-            tmpMqMessage->user = thisUser;
-            char *userToBeKicked = strtok(NULL, " ");
-            if (userToBeKicked == NULL) {
-                return NULL;
-            }
-            int sockfdToBeKicked = getSockfd(userToBeKicked);
-            if (sockfdToBeKicked == -1) {
-                debugPrint("couldnt find username %s", userToBeKicked);
-                return NULL;
-            }
-            User *toBeKicked = accessViaSockfd(sockfdToBeKicked);
-            if (strcmp(toBeKicked->name, "Admin") == 0) {
-                sendServerMessage(tmpMessage, sockfd, "", SERVER_CODE_DO_NOT_KICK_YOURSELF, "");
-                return NULL;
-            }
-            if (notifyUserRemoved(toBeKicked, USER_REMOVED_STATUS_KICKED_FROM_SERVER) == -1) {
-                errnoPrint("error sending notifyUserRemoved");
-            }
-            pthread_cancel(toBeKicked->thread);
-            pthread_join(toBeKicked->thread, NULL);
-            removeUser(toBeKicked);
-            //close(sockfdToBeKicked);
-        } else if (strncmp(command, commandPause, strlen(commandPause)) == 0) {
-            debugPrint("sending SERVER_CODE_PAUSED");
-            if (!isPaused) {
-                isPaused = true;
-                memset(tmpMqMessage->message.messageBody.server2Client.text, 0,
-                       sizeof(tmpMqMessage->message.messageBody.server2Client.text));
-                prepareServerMessage(&tmpMqMessage->message, "", SERVER_CODE_PAUSED, "");
-                sendMessageToAllUsers(&tmpMqMessage->message, SERVER_CODE_PAUSED);
-                pauseServer();
-            } else {
-                sendServerMessage(tmpMessage, sockfd, "", SERVER_CODE_ALREADY_PAUSED, "");
-            }
-        } else if (strncmp(command, commandResume, strlen(commandResume)) == 0) {
-            debugPrint("sending SERVER_CODE_RESUMED");
-            if (isPaused) {
-                memset(tmpMqMessage->message.messageBody.server2Client.text, 0,
-                       sizeof(tmpMqMessage->message.messageBody.server2Client.text));
-                prepareServerMessage(&tmpMqMessage->message, "", SERVER_CODE_RESUMED, "");
-                sendMessageToAllUsers(&tmpMqMessage->message, SERVER_CODE_RESUMED);
-                resumeServer();
-                isPaused = false;
-            } else {
-                sendServerMessage(tmpMessage, sockfd, "", SERVER_CODE_CANNOT_RESUME, "");
-            }
-        } else {
-            sendServerMessage(tmpMessage, sockfd, "", SERVER_CODE_INVALID_COMMAND, "");
+        return finishCommand(tmpMessage);
+    }
+    // run by the admin executor, the reply if any comes from there
+    int type = -1;
+    char *argument = NULL;
+    char *save;
+    if (strncmp(command, commandKick, strlen(commandKick)) == 0) {
+        strtok_r(buf, " ", &save);
+        debugPrint("kick command entered");
+        if ((argument = strtok_r(NULL, " ", &save)) == NULL) {
+            return finishCommand(tmpMessage);
         }
-        infoPrint("%s entered", buf);
-    }
-    free(tmpMessage);
-    free(tmpMqMessage);
-    return NULL;
+        type = ADMIN_COMMAND_KICK;
+    } else if (strncmp(command, commandPause, strlen(commandPause)) == 0) {
+        type = ADMIN_COMMAND_PAUSE;
+    } else if (strncmp(command, commandResume, strlen(commandResume)) == 0) {
+        type = ADMIN_COMMAND_RESUME;
+    } else if (strncmp(command, commandStats, strlen(commandStats)) == 0) {
+        type = ADMIN_COMMAND_STATS;
+    }
+    if (type == -1) {
+        sendServerMessage(tmpMessage, sockfd, "", SERVER_CODE_INVALID_COMMAND, "");
+    } else if (adminSubmit(type, thisUser->id, argument) == -1) {
+        errorPrint("admin queue full, %s dropped", buf);
+        sendServerMessage(tmpMessage, sockfd, "", SERVER_CODE_GENERAL_PROBLEMS, "");
+        return finishCommand(tmpMessage);
+    }
+    infoPrint("%s entered", buf);
+    return finishCommand(tmpMessage);
 }
 
 int validateType(int type) {
-    if (type >= 0 && type <= 5) {
+    if (type >= 0 && type <= HEARTBEAT) {
         return 1;
     } else return -1;
 }
@@ -107,70 +165,24 @@ int validateLength__(int min, int max, uint16_t val) {
 }
 
 
-ssize_t receiveHeader(messageHeader *buffer, int sockfd) {
-    ssize_t bytesRead;
-    if ((bytesRead = recv(sockfd, buffer, sizeof(buffer->type) + sizeof(buffer->length), 0)) < 0) {
-        if (errno == ECONNRESET) {
-            return -1;
-        }
-        return -1;
-    }
-    if (bytesRead == 0) {
-        return 0;
-    }
-    if ((ssize_t) bytesRead < (ssize_t) (sizeof(buffer->length) + sizeof(buffer->type))) {
-        errnoPrint("read too few bytes from messageHeader");
-        return -1;
-    }
-
-    buffer->length = ntohs(buffer->length);
-    debugHexdump(buffer, sizeof(buffer->length) + sizeof(buffer->type), "messageHeader");
-    if (validateType(buffer->type) == -1) {
-        errnoPrint("invalid type");
-        close(sockfd);
-        return -1;
-    }
-    return (int) (sizeof(buffer->length) + sizeof(buffer->type));
-}
-
+// the frame has been read completely by receiveBufferNext()
 int receiveLoginRequest(message *buffer, int sockfd) {
-    ssize_t bytesRead;
-    uint32_t magicExpected = MAGIC_LOGIN_REQUEST;
-    char *bufJump = (char *) buffer;
-
-
-    if ((bytesRead = recv(sockfd, bufJump + headerSize, buffer->messageHeader.length, MSG_WAITALL)) < 0) {
-        errnoPrint("error receiving loginRequest body");
-        errnoPrint("bytesRead %zi, sizeof %zi", bytesRead, sizeof(&buffer));
+    (void) sockfd;
+    if (validateLength__(LENGTH_MIN, LENGTH_MAX, buffer->messageHeader.length) == -1) {
+        errorPrint("invalid length");
         return -1;
     }
-
     if (validateLength__(USERNAME_MIN, USERNAME_MAX, (uint16_t) strlen(buffer->messageBody.loginRequest.name)) == -1) {
         return LOGIN_RESPONSE_STATUS_NAME_INVALID;
     }
-
-    if (validateLength__(LENGTH_MIN, LENGTH_MAX, buffer->messageHeader.length) == -1) {
-        errnoPrint("invalid length");
-        return -1;
-    }
-
-    if (bytesRead == 0) {
-        return 0;
-    }
-    buffer->messageBody.loginRequest.version = ntohs(buffer->messageBody.loginRequest.version);
-    debugHexdump(bufJump + headerSize, buffer->messageHeader.length, "loginRequest");
+    debugHexdump(&buffer->messageBody, buffer->messageHeader.length, "loginRequest");
     buffer->messageBody.loginRequest.magic = ntohl(buffer->messageBody.loginRequest.magic);
-    if (bytesRead < buffer->messageHeader.length) {
-        errnoPrint("too few bytes from loginRequest read");
-        return -1;
-    }
-    if (memcmp(&buffer->messageBody.loginRequest.magic, &magicExpected, sizeof(magicExpected)) == 0) {
-    } else {
-        errnoPrint("corrupted message");
-        close(sockfd);
+    if (buffer->messageBody.loginRequest.magic != MAGIC_LOGIN_REQUEST) {
+        errorPrint("corrupted message");
         return -1;
     }
-    if (buffer->messageBody.loginRequest.version != VERSION) {
+    // a single byte, there is no byte order to fix
+    if (buffer->messageBody.loginRequest.version > VERSION_MAX) {
         return LOGIN_RESPONSE_STATUS_PROTOCOL_VERSION_MISMATCH;
     }
     if (nameBytesValidate(buffer->messageBody.loginRequest.name, sizeof(buffer->messageBody.loginRequest.name)) !=
@@ -179,13 +191,8 @@ int receiveLoginRequest(message *buffer, int sockfd) {
         errorPrint("Name invalid!");
         return LOGIN_RESPONSE_STATUS_NAME_INVALID;
     }
-    if (sizeof(buffer->messageBody.loginRequest.name) < USERNAME_MIN ||
-        sizeof(buffer->messageBody.loginRequest.name) > USERNAME_MAX) {
-        errnoPrint("corrupted name");
-        close(sockfd);
-        return -1;
-    }
-    if (testUserName(buffer->messageBody.loginRequest.name) == -1) {
+    // reserved until addNewUser() registers the user, so two logins cannot both get the name
+    if (reserveUserName(buffer->messageBody.loginRequest.name) == -1) {
         return LOGIN_RESPONSE_STATUS_NAME_TAKEN;
     }
     return LOGIN_RESPONSE_STATUS_SUCCESS;
@@ -204,7 +211,7 @@ int sendHeader(messageHeader *buffer, int sockfd) {
     return 1;
 }
 
-int sendLoginResponse(message *buffer, int sockfd, uint8_t code) {
+int sendLoginResponse(message *buffer, int sockfd, uint8_t code, uint8_t version) {
     ssize_t bytesSend;
     buffer->messageBody.loginResponse.magic = htonl(MAGIC_LOGIN_RESPONSE);
     buffer->messageBody.loginResponse.code = code;
@@ -225,14 +232,21 @@ int sendLoginResponse(message *buffer, int sockfd, uint8_t code) {
         return -1;
 
     }
+    if (version >= VERSION_COMPACT) {
+        // the base goes between code and server name, both still fit into the message
+        uint64_t base = hton64u(compactBase());
+        memmove(buffer->messageBody.loginResponse.serverName + sizeof(base),
+                buffer->messageBody.loginResponse.serverName, strlen(SERVER_NAME));
+        memcpy(buffer->messageBody.loginResponse.serverName, &base, sizeof(base));
+        buffer->messageHeader.length = htons((uint16_t) (ntohs(buffer->messageHeader.length) + sizeof(base)));
+    }
     signal(SIGPIPE, SIG_IGN);
     if (fcntl(sockfd, F_GETFD) == -1) {
         return -1;
     }
-    if ((bytesSend = send(sockfd, buffer,
-                          ntohs(buffer->messageHeader.length) + sizeof(buffer->messageHeader.length) +
-                          sizeof(buffer->messageHeader.type),
-                          0)) < 0) {
+    if ((bytesSend = sendQueuePush(sockfd, buffer,
+                                   ntohs(buffer->messageHeader.length) + sizeof(buffer->messageHeader.length) +
+                                   sizeof(buffer->messageHeader.type))) < 0) {
         if (errno == EPIPE) {
             return -1;
         }
@@ -250,38 +264,22 @@ int sendLoginResponse(message *buffer, int sockfd, uint8_t code) {
     return 1;
 }
 
+// the frame has been read completely by receiveBufferNext()
 int receiveClientMessage(message *buffer, int sockfd) {
-    ssize_t bytesRead;
-    char *bufJump = (char *) buffer;
     if (buffer->messageHeader.length > TEXT_MAX) {
-        errnoPrint("invalid text length");
-        return -1;
-    }
-    memset(buffer->messageBody.client2Server.text, 0, sizeof(buffer->messageBody.client2Server.text));
-    if ((bytesRead = recv(sockfd, bufJump + headerSize, buffer->messageHeader.length, 0)) < 0) {
-        errnoPrint("error receiving client message");
-        return -1;
-    }
-    if (bytesRead == 0) {
-        return 0;
-    }
-    if (bytesRead < buffer->messageHeader.length) {
-        errnoPrint("too few bytes of client Message read");
+        errorPrint("invalid text length");
         return -1;
     }
-    debugHexdump(bufJump + headerSize, buffer->messageHeader.length, "client message");
+    debugHexdump(&buffer->messageBody, buffer->messageHeader.length, "client message");
     if (buffer->messageBody.client2Server.text[0] == '/') {
         processCommand(buffer->messageBody.client2Server.text, strlen(buffer->messageBody.client2Server.text) + 1,
                        sockfd);
         return 0;
-    } else {
-
     }
     return 1;
 }
 
-int sendUserAdded(message *buffer, int sockfd, char *username, uint8_t type) {
-    ssize_t bytesSend;
+message *prepareUserAdded(message *buffer, char *username, uint8_t type) {
     memset(buffer->messageBody.userAdded.name, 0, sizeof(buffer->messageBody.userAdded.name));
     buffer->messageHeader.type = USER_ADDED;
     if (type == 0) {
@@ -292,7 +290,13 @@ int sendUserAdded(message *buffer, int sockfd, char *username, uint8_t type) {
     strncpy(buffer->messageBody.userAdded.name, username, strlen(username));
     buffer->messageHeader.length = htons(
             (uint16_t) (strlen(buffer->messageBody.userAdded.name) + sizeof(buffer->messageBody.userAdded.timestamp)));
-    if ((bytesSend = send(sockfd, buffer, sizeof(buffer->messageHeader) + ntohs(buffer->messageHeader.length), 0)) <
+    return buffer;
+}
+
+int sendUserAdded(message *buffer, int sockfd, char *username, uint8_t type) {
+    ssize_t bytesSend;
+    prepareUserAdded(buffer, username, type);
+    if ((bytesSend = sendQueuePush(sockfd, buffer, sizeof(buffer->messageHeader) + ntohs(buffer->messageHeader.length))) <
         0) {
         errnoPrint("error sending user added message");
         return -1;
@@ -306,9 +310,7 @@ int sendUserAdded(message *buffer, int sockfd, char *username, uint8_t type) {
     return 1;
 }
 
-int sendUserRemoved(message *buffer, int sockfd, char *username, uint8_t code) {
-
-    ssize_t bytesSend;
+message *prepareUserRemoved(message *buffer, char *username, uint8_t code) {
     memset(buffer->messageBody.userRemoved.name, 0, sizeof(buffer->messageBody.userRemoved.name));
     buffer->messageHeader.type = USER_REMOVED;
     buffer->messageBody.userRemoved.timestamp = hton64u(time(NULL));
@@ -318,11 +320,18 @@ int sendUserRemoved(message *buffer, int sockfd, char *username, uint8_t code) {
             (uint16_t) (strlen(buffer->messageBody.userRemoved.name) +
                         sizeof(buffer->messageBody.userRemoved.timestamp) +
                         sizeof(buffer->messageBody.userRemoved.code)));
+    return buffer;
+}
+
+int sendUserRemoved(message *buffer, int sockfd, char *username, uint8_t code) {
+
+    ssize_t bytesSend;
+    prepareUserRemoved(buffer, username, code);
     debugPrint("user removed len = %d", ntohs(buffer->messageHeader.length));
     if (fcntl(sockfd, F_GETFD) == -1) {
         return -1;
     }
-    if ((bytesSend = send(sockfd, buffer, sizeof(buffer->messageHeader) + ntohs(buffer->messageHeader.length), 0)) <
+    if ((bytesSend = sendQueuePush(sockfd, buffer, sizeof(buffer->messageHeader) + ntohs(buffer->messageHeader.length))) <
         0) {
         if (errno == EBADFD) {
             return -1;
@@ -385,6 +394,31 @@ message *prepareServerMessage(message *buffer, char *username, int code, char *o
             strncpy(buffer->messageBody.server2Client.text, notificationDontKickYourself,
                     strlen(notificationDontKickYourself));
             break;
+
+        case SERVER_CODE_ROOM_JOINED:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text),
+                     "%s%s.", notificationRoomJoined, originalMessage);
+            break;
+
+        case SERVER_CODE_ROOM_LEFT:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text),
+                     "%s%s.", notificationRoomLeft, originalMessage);
+            break;
+
+        case SERVER_CODE_ROOM_INVALID:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text), "%s",
+                     notificationRoomInvalid);
+            break;
+
+        case SERVER_CODE_USER_UNKNOWN:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text), "%s",
+                     notificationUserUnknown);
+            break;
+
+        case SERVER_CODE_USER_KICKED:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text),
+                     "%s%s.", notificationUserKicked, originalMessage);
+            break;
     }
     buffer->messageHeader.type = SERVER_2_CLIENT;
     buffer->messageBody.server2Client.timestamp = hton64u(time(NULL));
@@ -398,7 +432,7 @@ message *prepareServerMessage(message *buffer, char *username, int code, char *o
 
 int sendSth(message *buffer, int sockfd) {
     ssize_t bytesSend;
-    if ((bytesSend = send(sockfd, buffer, sizeof(messageHeader) + ntohs(buffer->messageHeader.length), 0)) < 0) {
+    if ((bytesSend = sendQueuePush(sockfd, buffer, sizeof(messageHeader) + ntohs(buffer->messageHeader.length))) < 0) {
         errnoPrint("error sending server 2 client message");
         return -1;
     }
@@ -409,6 +443,19 @@ int sendSth(message *buffer, int sockfd) {
     return 1;
 }
 
+int sendFrame(Frame *frame, int sockfd) {
+    ssize_t bytesSend;
+    if ((bytesSend = sendQueuePushFrame(sockfd, frame)) < 0) {
+        errnoPrint("error sending frame");
+        return -1;
+    }
+    if (bytesSend < (ssize_t) frame->length) {
+        errnoPrint("sent too few bytes of frame");
+        return -1;
+    }
+    return 1;
+}
+
 int sendServerMessage(message *buffer, int sockfd, char *username, int code, char *originalMessage) {
     switch (code) {
         case SERVER_CODE_INVALID_COMMAND:
@@ -447,6 +494,31 @@ int sendServerMessage(message *buffer, int sockfd, char *username, int code, cha
         case SERVER_CODE_CANNOT_RESUME:
             strncpy(buffer->messageBody.server2Client.text, notificationCannotResume, strlen(notificationCannotResume));
             break;
+
+        case SERVER_CODE_ROOM_JOINED:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text),
+                     "%s%s.", notificationRoomJoined, originalMessage);
+            break;
+
+        case SERVER_CODE_ROOM_LEFT:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text),
+                     "%s%s.", notificationRoomLeft, originalMessage);
+            break;
+
+        case SERVER_CODE_ROOM_INVALID:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text), "%s",
+                     notificationRoomInvalid);
+            break;
+
+        case SERVER_CODE_USER_UNKNOWN:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text), "%s",
+                     notificationUserUnknown);
+            break;
+
+        case SERVER_CODE_USER_KICKED:
+            snprintf(buffer->messageBody.server2Client.text, sizeof(buffer->messageBody.server2Client.text),
+                     "%s%s.", notificationUserKicked, originalMessage);
+            break;
     }
 
     ssize_t bytesSend;
@@ -461,7 +533,7 @@ int sendServerMessage(message *buffer, int sockfd, char *username, int code, cha
         errnoPrint("invalid length of server2 client");
         return -1;
     }
-    if ((bytesSend = send(sockfd, buffer, sizeof(messageHeader) + ntohs(buffer->messageHeader.length), 0)) < 0) {
+    if ((bytesSend = sendQueuePush(sockfd, buffer, sizeof(messageHeader) + ntohs(buffer->messageHeader.length))) < 0) {
         errnoPrint("error sending server 2 client message");
         return -1;
     }
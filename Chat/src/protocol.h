@@ -14,6 +14,8 @@
 #define SERVER_2_CLIENT 3
 #define USER_ADDED 4
 #define USER_REMOVED 5
+// version 1 and later: sent to a silent client, which answers with an empty HEARTBEAT of its own
+#define HEARTBEAT 6
 
 #define LENGTH_MAX 36
 #define LENGTH_MIN 6
@@ -30,6 +32,12 @@
 #define SERVER_CODE_DO_NOT_KICK_YOURSELF 7
 #define SERVER_CODE_ALREADY_PAUSED 8
 #define SERVER_CODE_CANNOT_RESUME 9
+#define SERVER_CODE_ROOM_JOINED 10
+#define SERVER_CODE_ROOM_LEFT 11
+#define SERVER_CODE_ROOM_INVALID 12
+#define SERVER_CODE_USER_UNKNOWN 13
+// confirms /kick to the admin once the user is being disconnected
+#define SERVER_CODE_USER_KICKED 14
 
 #define SERVERNAME_MAX 31
 
@@ -49,8 +57,14 @@
 
 #define USER_REMOVED_STATUS_CONN_CLOSED_BY_CLIENT 0
 #define USER_REMOVED_STATUS_KICKED_FROM_SERVER 1
+#define USER_REMOVED_STATUS_TIMED_OUT 2
 
 #define VERSION 0
+// varint lengths, sender ids and timestamp deltas, see compact.h
+#define VERSION_COMPACT 1
+// version 1 plus deflated server frames, see compress.h
+#define VERSION_COMPRESSED 2
+#define VERSION_MAX VERSION_COMPRESSED
 
 #pragma pack(1)
 typedef struct messageHeader {
@@ -109,16 +123,27 @@ typedef struct message {
 #pragma pack(0)
 
 
-ssize_t receiveHeader(messageHeader *buffer, int sockfd);
+// pooled, zeroed message buffers
+message *allocMessage(void);
 
+void freeMessage(message *buffer);
+
+int validateType(int type);
+
+// receive* check a frame that has already been read by receiveBufferNext()
 int receiveLoginRequest(message *buffer, int sockfd);
 
-int sendLoginResponse(message *buffer, int sockfd, uint8_t code);
+// version 1 clients get the base of their timestamps in the login response
+int sendLoginResponse(message *buffer, int sockfd, uint8_t code, uint8_t version);
 
 int sendUserRemoved(message *buffer, int sockfd, char *username, uint8_t code);
 
+message *prepareUserRemoved(message *buffer, char *username, uint8_t code);
+
 int sendUserAdded(message *buffer, int sockfd, char *username, uint8_t type);
 
+message *prepareUserAdded(message *buffer, char *username, uint8_t type);
+
 int receiveClientMessage(message *buffer, int sockfd);
 
 int sendServerMessage(message *buffer, int sockfd, char *username, int code, char *originalMessage);
@@ -127,4 +152,9 @@ message *prepareServerMessage(message *buffer, char *username, int code, char *o
 
 int sendSth(message *buffer, int sockfd);
 
+struct Frame;
+
+// queues a shared, already encoded frame without copying it
+int sendFrame(struct Frame *frame, int sockfd);
+
 #endif
@@ -0,0 +1,580 @@
+#include "reactor.h"
+#include "clientthread.h"
+#include "connectionhandler.h"
+#include "user.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "pool.h"
+#include "receivebuffer.h"
+#include "credit.h"
+#include "upgrade.h"
+#include "cluster.h"
+#include "broadcastagent.h"
+#include "frame.h"
+#include "room.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+struct Reactor;
+
+typedef struct Connection {
+    User *user;
+    int loggedIn;
+    ReceiveBuffer *receiveBuffer;
+    struct Reactor *reactor;
+    // out of credits or logging in, the socket is not watched for input until it is resumed
+    int throttled;
+    // a copy of the login request while the login thread has the connection, NULL otherwise
+    message *login;
+    int loginResult;
+    // login queue, guarded by the reactor's lock
+    struct Connection *nextLogin;
+    // resume list, guarded by the reactor's lock
+    struct Connection *nextResumed;
+    int resumeQueued;
+    // a message the broadcast queue had no room for, the socket is not read until it is queued
+    mqMessage *pending;
+    struct Connection *nextBlocked;
+    // every connection of the reactor, only walked for a handover to the next process
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+typedef struct Reactor {
+    int epollFileDescriptor;
+    // written by broadcast workers that returned a credit to a throttled connection
+    int wakeupFileDescriptor;
+    pthread_mutex_t lock;
+    Connection *resumed;
+    Connection *connections;
+    // logins waiting for the login thread, which only runs in a cluster
+    pthread_cond_t loginQueued;
+    Connection *logins;
+    Connection *lastLogin;
+    int loginThread;
+    // connections holding a pending message, only touched by the reactor
+    Connection *blocked;
+    BroadcastWaiter roomWaiter;
+} Reactor;
+
+static Pool connectionPool = POOL_INITIALIZER("Connection", sizeof(Connection));
+
+// called by a broadcast worker under the credit's lock or by the login thread, the reactor takes
+// it from there
+static void resumeConnection(void *arg) {
+    Connection *connection = (Connection *) arg;
+    Reactor *reactor = connection->reactor;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&reactor->lock);
+    if (!connection->resumeQueued) {
+        connection->resumeQueued = 1;
+        connection->nextResumed = reactor->resumed;
+        reactor->resumed = connection;
+    }
+    pthread_mutex_unlock(&reactor->lock);
+    if (write(reactor->wakeupFileDescriptor, &one, sizeof(one)) == -1) {
+        errnoPrint("could not wake up reactor");
+    }
+}
+
+// a throttled socket is taken out of the epoll set, hang ups would be reported even without EPOLLIN
+static void watchInput(Connection *connection, int watch) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(connection->reactor->epollFileDescriptor, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                  connection->user->socketFileDescriptor, &event) == -1) {
+        errnoPrint("epoll_ctl() for throttled socket %d", connection->user->socketFileDescriptor);
+    }
+}
+
+// the message was not queued, its sender gets its credit back
+static void dropPending(Connection *connection) {
+    frameRelease(connection->pending->frame);
+    roomRelease(connection->pending->room);
+    creditReturn(connection->pending->credit);
+    freeMqMessage(connection->pending);
+    connection->pending = NULL;
+}
+
+static void closeConnection(int epollFileDescriptor, Connection *connection) {
+    if (connection->pending != NULL) {
+        Connection **link = &connection->reactor->blocked;
+        while (*link != connection) {
+            link = &(*link)->nextBlocked;
+        }
+        *link = connection->nextBlocked;
+        dropPending(connection);
+    }
+    // no worker may queue the connection for a resume once it is gone
+    creditDetach(connection->user->credit);
+    pthread_mutex_lock(&connection->reactor->lock);
+    if (connection->resumeQueued) {
+        Connection **link = &connection->reactor->resumed;
+        while (*link != connection) {
+            link = &(*link)->nextResumed;
+        }
+        *link = connection->nextResumed;
+    }
+    pthread_mutex_unlock(&connection->reactor->lock);
+    if (!connection->throttled) {
+        epoll_ctl(epollFileDescriptor, EPOLL_CTL_DEL, connection->user->socketFileDescriptor, NULL);
+    }
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        connection->reactor->connections = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    infoPrint("User %s disconnected!", connection->user->name);
+    removeUser(connection->user);
+    receiveBufferDestroy(connection->receiveBuffer);
+    poolFree(&connectionPool, connection);
+}
+
+// watches the connection's socket and links it into the reactor's list
+static int registerConnection(Reactor *reactor, Connection *connection) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(reactor->epollFileDescriptor, EPOLL_CTL_ADD, connection->user->socketFileDescriptor, &event) == -1) {
+        errnoPrint("epoll_ctl(EPOLL_CTL_ADD)");
+        return -1;
+    }
+    connection->prev = NULL;
+    connection->next = reactor->connections;
+    if (reactor->connections != NULL) {
+        reactor->connections->prev = connection;
+    }
+    reactor->connections = connection;
+    return 1;
+}
+
+static void acceptConnection(Reactor *reactor, int listenFileDescriptor) {
+    struct sockaddr_storage socketAdress;
+    socklen_t addr_size = sizeof(socketAdress);
+    char str[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+    int socketFileDescriptor;
+
+    if ((socketFileDescriptor = accept(listenFileDescriptor, (struct sockaddr *) &socketAdress, &addr_size)) < 0) {
+        errnoPrint("accept() failed");
+        return;
+    }
+    connectionPeerName(&socketAdress, str, sizeof(str));
+    infoPrint("Client %s connected successfully on socket: %d!", str, socketFileDescriptor);
+
+    Connection *connection = poolAlloc(&connectionPool);
+    User *user = allocUser();
+    ReceiveBuffer *receiveBuffer = receiveBufferCreate();
+    if (connection == NULL || user == NULL || receiveBuffer == NULL) {
+        errnoPrint("could not allocate connection");
+        poolFree(&connectionPool, connection);
+        freeUser(user);
+        if (receiveBuffer != NULL) {
+            receiveBufferDestroy(receiveBuffer);
+        }
+        close(socketFileDescriptor);
+        return;
+    }
+    user->socketFileDescriptor = socketFileDescriptor;
+    user->thread = pthread_self();
+    memset(connection, 0, sizeof(Connection));
+    connection->user = user;
+    connection->receiveBuffer = receiveBuffer;
+    connection->reactor = reactor;
+
+    if (registerConnection(reactor, connection) == -1) {
+        receiveBufferDestroy(receiveBuffer);
+        poolFree(&connectionPool, connection);
+        freeUser(user);
+        close(socketFileDescriptor);
+    }
+}
+
+// a failed login closes the connection and returns -1
+static int loginFinished(int epollFileDescriptor, Connection *connection, int result) {
+    if (result != 1) {
+        closeConnection(epollFileDescriptor, connection);
+        return -1;
+    }
+    connection->loggedIn = 1;
+    connection->receiveBuffer->version = connection->user->version;
+    return 1;
+}
+
+// a cluster login waits for every peer to agree on the name, the login thread does that while
+// the reactor serves the shard's other connections; logins of one shard are done one after the
+// other, so a peer that does not answer delays each by up to CLUSTER_CLAIM_TIMEOUT_MS
+static void *loginLoop(void *arg) {
+    Reactor *reactor = (Reactor *) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&reactor->lock);
+        while (reactor->logins == NULL) {
+            pthread_cond_wait(&reactor->loginQueued, &reactor->lock);
+        }
+        Connection *connection = reactor->logins;
+        if ((reactor->logins = connection->nextLogin) == NULL) {
+            reactor->lastLogin = NULL;
+        }
+        pthread_mutex_unlock(&reactor->lock);
+        connection->loginResult = clientLogin(&connection->user, connection->login);
+        resumeConnection(connection);
+    }
+    return NULL;
+}
+
+// the connection is not watched until the login thread is done with it
+static int queueLogin(Connection *connection, message *buffer) {
+    Reactor *reactor = connection->reactor;
+
+    if ((connection->login = allocMessage()) == NULL) {
+        errnoPrint("could not queue the login of socket %d", connection->user->socketFileDescriptor);
+        return -1;
+    }
+    memcpy(connection->login, buffer, sizeof(message));
+    connection->throttled = 1;
+    watchInput(connection, 0);
+    pthread_mutex_lock(&reactor->lock);
+    connection->nextLogin = NULL;
+    if (reactor->lastLogin != NULL) {
+        reactor->lastLogin->nextLogin = connection;
+    } else {
+        reactor->logins = connection;
+    }
+    reactor->lastLogin = connection;
+    pthread_cond_signal(&reactor->loginQueued);
+    pthread_mutex_unlock(&reactor->lock);
+    return 1;
+}
+
+// a worker made room in a broadcast queue, the reactor offers its pending messages again
+static void resumeBlocked(void *arg) {
+    Reactor *reactor = (Reactor *) arg;
+    uint64_t one = 1;
+
+    if (write(reactor->wakeupFileDescriptor, &one, sizeof(one)) == -1) {
+        errnoPrint("could not wake up reactor");
+    }
+}
+
+// the broadcast queue is full: the reactor never waits for it, the connection keeps the message and
+// is not read until a worker made room; returns 1 if the message could be queued right away
+static int holdMessage(Connection *connection, mqMessage *mqBuffer) {
+    Reactor *reactor = connection->reactor;
+
+    if ((connection->pending = allocMqMessage()) == NULL) {
+        errnoPrint("broadcast queue is full, dropping message of %s", connection->user->name);
+        frameRelease(mqBuffer->frame);
+        roomRelease(mqBuffer->room);
+        creditReturn(mqBuffer->credit);
+    } else {
+        memcpy(connection->pending, mqBuffer, sizeof(mqMessage));
+        if (broadcastAgentOffer(connection->pending, &reactor->roomWaiter) == 1) {
+            freeMqMessage(connection->pending);
+            connection->pending = NULL;
+        }
+    }
+    mqBuffer->frame = NULL;
+    mqBuffer->room = NULL;
+    mqBuffer->credit = NULL;
+    if (connection->pending == NULL) {
+        return 1;
+    }
+    connection->throttled = 1;
+    watchInput(connection, 0);
+    connection->nextBlocked = reactor->blocked;
+    reactor->blocked = connection;
+    return 0;
+}
+
+// every frame that is complete while the user has credits left, a partial one waits for the next event
+static void processFrames(int epollFileDescriptor, Connection *connection, message *buffer,
+                          mqMessage *mqBuffer) {
+    int result;
+    int received;
+
+    for (;;) {
+        // a sender whose messages all wait in the broadcast queue is not read until one is delivered
+        if (connection->loggedIn && !creditWatch(connection->user->credit, resumeConnection, connection)) {
+            connection->throttled = 1;
+            watchInput(connection, 0);
+            return;
+        }
+        if ((result = receiveBufferNext(connection->receiveBuffer, buffer)) != 1) {
+            break;
+        }
+        if (!connection->loggedIn) {
+            if (buffer->messageHeader.type != LOGIN_REQUEST) {
+                closeConnection(epollFileDescriptor, connection);
+                return;
+            }
+            if (connection->reactor->loginThread) {
+                if (queueLogin(connection, buffer) == -1) {
+                    closeConnection(epollFileDescriptor, connection);
+                }
+                return;
+            }
+            if (loginFinished(epollFileDescriptor, connection, clientLogin(&connection->user, buffer)) == -1) {
+                return;
+            }
+        } else if ((received = clientReceive(connection->user, buffer, mqBuffer)) == CLIENT_RECEIVE_QUEUE_FULL) {
+            if (holdMessage(connection, mqBuffer) == 0) {
+                return;
+            }
+        } else if (received != 1) {
+            closeConnection(epollFileDescriptor, connection);
+            return;
+        }
+    }
+    if (result == -1) {
+        if (connection->loggedIn) {
+            clientClosed(connection->user);
+        }
+        closeConnection(epollFileDescriptor, connection);
+    }
+}
+
+// one recv() per readiness event, then the frames it completed
+static void handleConnection(int epollFileDescriptor, Connection *connection, message *buffer,
+                             mqMessage *mqBuffer) {
+    ssize_t bytesRead;
+
+    if ((bytesRead = receiveBufferFill(connection->receiveBuffer, connection->user->socketFileDescriptor)) <= 0) {
+        debugPrint("receive = %zi, closing..", bytesRead);
+        if (connection->loggedIn) {
+            clientClosed(connection->user);
+        }
+        closeConnection(epollFileDescriptor, connection);
+        return;
+    }
+    processFrames(epollFileDescriptor, connection, buffer, mqBuffer);
+}
+
+// serves the users of every shards-th upgrade session from shard on, as the previous process left them
+static void adoptConnections(Reactor *reactor, int shard, int shards, message *buffer, mqMessage *mqBuffer) {
+    for (size_t i = (size_t) shard; i < upgradeSessionCount(); i += (size_t) shards) {
+        User *user = upgradeSessionUser(i);
+        if (user == NULL) {
+            continue;
+        }
+        Connection *connection = poolAlloc(&connectionPool);
+        ReceiveBuffer *receiveBuffer = receiveBufferCreate();
+        if (connection == NULL || receiveBuffer == NULL) {
+            errnoPrint("could not allocate connection of %s", user->name);
+            poolFree(&connectionPool, connection);
+            if (receiveBuffer != NULL) {
+                receiveBufferDestroy(receiveBuffer);
+            }
+            continue;
+        }
+        memset(connection, 0, sizeof(Connection));
+        user->thread = pthread_self();
+        connection->user = upgradeResume(i, receiveBuffer);
+        connection->receiveBuffer = receiveBuffer;
+        connection->reactor = reactor;
+        connection->loggedIn = 1;
+        if (registerConnection(reactor, connection) == -1) {
+            receiveBufferDestroy(receiveBuffer);
+            poolFree(&connectionPool, connection);
+            continue;
+        }
+        // frames that were complete already would not raise an event
+        processFrames(reactor->epollFileDescriptor, connection, buffer, mqBuffer);
+    }
+}
+
+// hands every logged in connection over to the next process and stops for good
+static void parkConnections(Reactor *reactor) {
+    for (Connection *connection = reactor->connections; connection != NULL; connection = connection->next) {
+        // the reactor stops anyway, a held back message may wait for the queue like a reader thread does
+        if (connection->pending != NULL) {
+            if (broadcastAgentPut(connection->pending) == -1) {
+                errnoPrint("broadcast queue stayed full, dropping message of %s", connection->user->name);
+                dropPending(connection);
+            } else {
+                freeMqMessage(connection->pending);
+                connection->pending = NULL;
+            }
+        }
+        if (connection->loggedIn) {
+            upgradePark(connection->user, connection->receiveBuffer);
+        }
+    }
+    upgradeParkThread();
+}
+
+// runs after a batch of events, so no event of this batch refers to a connection closed here
+static void resumeConnections(Reactor *reactor, message *buffer, mqMessage *mqBuffer) {
+    uint64_t count;
+
+    if (read(reactor->wakeupFileDescriptor, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        errnoPrint("could not read reactor wakeup");
+    }
+    pthread_mutex_lock(&reactor->lock);
+    Connection *resumed = reactor->resumed;
+    reactor->resumed = NULL;
+    for (Connection *connection = resumed; connection != NULL; connection = connection->nextResumed) {
+        connection->resumeQueued = 0;
+    }
+    pthread_mutex_unlock(&reactor->lock);
+    // every wakeup may be a worker that made room, held back messages are offered again
+    Connection *blocked = reactor->blocked;
+    reactor->blocked = NULL;
+    while (blocked != NULL) {
+        Connection *connection = blocked;
+        blocked = connection->nextBlocked;
+        if (broadcastAgentOffer(connection->pending, &reactor->roomWaiter) == 0) {
+            connection->nextBlocked = reactor->blocked;
+            reactor->blocked = connection;
+            continue;
+        }
+        freeMqMessage(connection->pending);
+        connection->pending = NULL;
+        connection->throttled = 0;
+        watchInput(connection, 1);
+        processFrames(reactor->epollFileDescriptor, connection, buffer, mqBuffer);
+    }
+    while (resumed != NULL) {
+        Connection *connection = resumed;
+        resumed = connection->nextResumed;
+        connection->throttled = 0;
+        watchInput(connection, 1);
+        if (connection->login != NULL) {
+            freeMessage(connection->login);
+            connection->login = NULL;
+            if (loginFinished(reactor->epollFileDescriptor, connection, connection->loginResult) == -1) {
+                continue;
+            }
+        }
+        // frames already buffered would not raise another event
+        processFrames(reactor->epollFileDescriptor, connection, buffer, mqBuffer);
+    }
+}
+
+int reactorRun(int listenFileDescriptor, int unixFileDescriptor, int shard, int shards) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct epoll_event event;
+    Reactor reactor = {.lock = PTHREAD_MUTEX_INITIALIZER, .resumed = NULL, .connections = NULL,
+                       .loginQueued = PTHREAD_COND_INITIALIZER, .logins = NULL, .lastLogin = NULL,
+                       .blocked = NULL, .roomWaiter = {.resume = resumeBlocked, .arg = NULL}};
+    pthread_t loginThread;
+    int epollFileDescriptor;
+    int count;
+    int wakeup;
+
+    // frames are handled one at a time, so a single set of buffers serves every connection
+    message *buffer = allocMessage();
+    mqMessage *mqBuffer = allocMqMessage();
+    if (buffer == NULL || mqBuffer == NULL) {
+        freeMessage(buffer);
+        freeMqMessage(mqBuffer);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ((epollFileDescriptor = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        errnoPrint("epoll_create1()");
+        freeMessage(buffer);
+        freeMqMessage(mqBuffer);
+        return -1;
+    }
+    reactor.epollFileDescriptor = epollFileDescriptor;
+    reactor.roomWaiter.arg = &reactor;
+    if ((reactor.wakeupFileDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        errnoPrint("eventfd()");
+        close(epollFileDescriptor);
+        freeMessage(buffer);
+        freeMqMessage(mqBuffer);
+        return -1;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, listenFileDescriptor, &event) == -1) {
+        errnoPrint("epoll_ctl(listen socket)");
+        close(reactor.wakeupFileDescriptor);
+        close(epollFileDescriptor);
+        freeMessage(buffer);
+        freeMqMessage(mqBuffer);
+        return -1;
+    }
+    // told apart from the TCP socket by its data
+    event.data.ptr = &unixFileDescriptor;
+    if (unixFileDescriptor != -1 && epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, unixFileDescriptor, &event) == -1) {
+        errnoPrint("epoll_ctl(unix socket)");
+        close(reactor.wakeupFileDescriptor);
+        close(epollFileDescriptor);
+        freeMessage(buffer);
+        freeMqMessage(mqBuffer);
+        return -1;
+    }
+    event.data.ptr = &reactor;
+    if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, reactor.wakeupFileDescriptor, &event) == -1) {
+        errnoPrint("epoll_ctl(wakeup)");
+        close(reactor.wakeupFileDescriptor);
+        close(epollFileDescriptor);
+        freeMessage(buffer);
+        freeMqMessage(mqBuffer);
+        return -1;
+    }
+    if (clusterEnabled()) {
+        if (pthread_create(&loginThread, NULL, loginLoop, &reactor) != 0) {
+            errnoPrint("error creating login thread, logins wait for the cluster in the reactor");
+        } else {
+            reactor.loginThread = 1;
+        }
+    }
+    debugPrint("Reactor[%zi] started.", (ssize_t) pthread_self());
+    adoptConnections(&reactor, shard, shards, buffer, mqBuffer);
+    // a handover interrupts epoll_wait() and parks this reactor
+    upgradeRegisterThread();
+
+    for (;;) {
+        if (upgradeRequested()) {
+            parkConnections(&reactor);
+        }
+        if ((count = epoll_wait(epollFileDescriptor, events, REACTOR_MAX_EVENTS, -1)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errnoPrint("epoll_wait()");
+            break;
+        }
+        wakeup = 0;
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == NULL) {
+                acceptConnection(&reactor, listenFileDescriptor);
+            } else if (events[i].data.ptr == &unixFileDescriptor) {
+                acceptConnection(&reactor, unixFileDescriptor);
+            } else if (events[i].data.ptr == &reactor) {
+                wakeup = 1;
+            } else {
+                handleConnection(epollFileDescriptor, (Connection *) events[i].data.ptr, buffer, mqBuffer);
+            }
+        }
+        if (wakeup) {
+            resumeConnections(&reactor, buffer, mqBuffer);
+        }
+    }
+    close(reactor.wakeupFileDescriptor);
+    close(epollFileDescriptor);
+    freeMessage(buffer);
+    freeMqMessage(mqBuffer);
+    return -1;
+}
@@ -0,0 +1,9 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// serves every connection accepted on listenFileDescriptor and unixFileDescriptor (-1 for none) from
+// one epoll loop in the calling thread, starting with the users of every shards-th session taken over
+// from the previous process
+int reactorRun(int listenFileDescriptor, int unixFileDescriptor, int shard, int shards);
+
+#endif
@@ -0,0 +1,134 @@
+#include "receivebuffer.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "util.h"
+#include "pool.h"
+#include "compact.h"
+#include "upgrade.h"
+
+static Pool receiveBufferPool = POOL_INITIALIZER("ReceiveBuffer", sizeof(ReceiveBuffer));
+
+ReceiveBuffer *receiveBufferCreate(void) {
+    ReceiveBuffer *receiveBuffer = poolAlloc(&receiveBufferPool);
+    if (receiveBuffer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    receiveBuffer->state = RECEIVE_STATE_HEADER;
+    receiveBuffer->version = VERSION;
+    receiveBuffer->start = 0;
+    receiveBuffer->end = 0;
+    return receiveBuffer;
+}
+
+void receiveBufferDestroy(ReceiveBuffer *receiveBuffer) {
+    poolFree(&receiveBufferPool, receiveBuffer);
+}
+
+ssize_t receiveBufferFill(ReceiveBuffer *receiveBuffer, int sockfd) {
+    struct iovec space;
+    struct msghdr header;
+    ssize_t bytesRead;
+
+    // only the tail of an incomplete frame is left over, move it to the front
+    if (receiveBuffer->start > 0) {
+        memmove(receiveBuffer->data, receiveBuffer->data + receiveBuffer->start,
+                receiveBuffer->end - receiveBuffer->start);
+        receiveBuffer->end -= receiveBuffer->start;
+        receiveBuffer->start = 0;
+    }
+    // a reader interrupted for a handover to the next process stops reading for good
+    do {
+        if (upgradeRequested()) {
+            errno = EINTR;
+            return -1;
+        }
+        space.iov_base = receiveBuffer->data + receiveBuffer->end;
+        space.iov_len = sizeof(receiveBuffer->data) - receiveBuffer->end;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = &space;
+        header.msg_iovlen = 1;
+        bytesRead = recvmsg(sockfd, &header, 0);
+    } while (bytesRead < 0 && errno == EINTR);
+    // the rest of a SOCK_SEQPACKET packet that did not fit is gone, the stream cannot be parsed anymore
+    if (bytesRead > 0 && (header.msg_flags & MSG_TRUNC)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (bytesRead > 0) {
+        receiveBuffer->end += (size_t) bytesRead;
+    }
+    return bytesRead;
+}
+
+int receiveBufferNext(ReceiveBuffer *receiveBuffer, message *buffer) {
+    size_t available = receiveBuffer->end - receiveBuffer->start;
+    unsigned char *next = receiveBuffer->data + receiveBuffer->start;
+
+    if (receiveBuffer->state == RECEIVE_STATE_HEADER) {
+        size_t headerLength;
+        if (receiveBuffer->version >= VERSION_COMPACT) {
+            uint64_t length;
+            int lengthBytes;
+            if (available < 2 ||
+                (lengthBytes = compactGetVarint(next + 1, available - 1, COMPACT_LENGTH_VARINT_MAX, &length)) == 0) {
+                return 0;
+            }
+            if (lengthBytes == -1) {
+                errorPrint("invalid length varint");
+                return -1;
+            }
+            receiveBuffer->header.type = next[0];
+            receiveBuffer->header.length = (uint16_t) (length > UINT16_MAX ? UINT16_MAX : length);
+            headerLength = 1 + (size_t) lengthBytes;
+        } else {
+            if (available < sizeof(messageHeader)) {
+                return 0;
+            }
+            memcpy(&receiveBuffer->header, next, sizeof(messageHeader));
+            receiveBuffer->header.length = ntohs(receiveBuffer->header.length);
+            headerLength = sizeof(messageHeader);
+        }
+        debugHexdump(next, headerLength, "messageHeader");
+        if (validateType(receiveBuffer->header.type) == -1) {
+            errorPrint("invalid type %u", receiveBuffer->header.type);
+            return -1;
+        }
+        // anything longer could never fit into a message, the stream cannot be resynchronized
+        if (receiveBuffer->header.length > sizeof(messageBody)) {
+            errorPrint("invalid length %u", receiveBuffer->header.length);
+            return -1;
+        }
+        receiveBuffer->start += headerLength;
+        available -= headerLength;
+        next += headerLength;
+        receiveBuffer->state = RECEIVE_STATE_BODY;
+    }
+    if (available < receiveBuffer->header.length) {
+        return 0;
+    }
+    buffer->messageHeader = receiveBuffer->header;
+    memcpy(&buffer->messageBody, next, receiveBuffer->header.length);
+    memset((char *) &buffer->messageBody + receiveBuffer->header.length, 0,
+           sizeof(messageBody) - receiveBuffer->header.length);
+    receiveBuffer->start += receiveBuffer->header.length;
+    receiveBuffer->state = RECEIVE_STATE_HEADER;
+    if (receiveBuffer->start == receiveBuffer->end) {
+        receiveBuffer->start = 0;
+        receiveBuffer->end = 0;
+    }
+    return 1;
+}
+
+int receiveFrame(ReceiveBuffer *receiveBuffer, message *buffer, int sockfd) {
+    int result;
+    ssize_t bytesRead;
+
+    while ((result = receiveBufferNext(receiveBuffer, buffer)) == 0) {
+        if ((bytesRead = receiveBufferFill(receiveBuffer, sockfd)) <= 0) {
+            return (int) bytesRead;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef RECEIVEBUFFER_H
+#define RECEIVEBUFFER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "protocol.h"
+
+// room for several frames, one recv() usually drains everything the client has sent
+#define RECEIVE_BUFFER_SIZE 4096
+
+#define RECEIVE_STATE_HEADER 0
+#define RECEIVE_STATE_BODY 1
+
+// bytes of one connection that have been read but not parsed yet, frames may be split anywhere
+typedef struct ReceiveBuffer {
+    int state;
+    // headers have a varint length from version 1 on, set once the login is through
+    int version;
+    // header of the frame whose body is awaited, length in host byte order
+    messageHeader header;
+    size_t start;
+    size_t end;
+    unsigned char data[RECEIVE_BUFFER_SIZE];
+} ReceiveBuffer;
+
+ReceiveBuffer *receiveBufferCreate(void);
+
+void receiveBufferDestroy(ReceiveBuffer *receiveBuffer);
+
+// one recv() into the free space, returns the bytes read, 0 on end of stream, -1 on error
+ssize_t receiveBufferFill(ReceiveBuffer *receiveBuffer, int sockfd);
+
+// copies the next complete frame into buffer (header in host byte order, rest of the body zeroed),
+// returns 1 for a frame, 0 if more bytes are needed, -1 if the stream is not a valid frame sequence
+int receiveBufferNext(ReceiveBuffer *receiveBuffer, message *buffer);
+
+// blocks until a complete frame is in buffer, same results as receiveBufferNext() plus 0 on end of stream
+int receiveFrame(ReceiveBuffer *receiveBuffer, message *buffer, int sockfd);
+
+#endif
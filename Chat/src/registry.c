@@ -0,0 +1,178 @@
+#include "registry.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define REGISTRY_INITIAL_BUCKETS 64
+
+typedef struct NameEntry {
+    struct NameEntry *next;
+    // NULL while the name is only reserved by a login in progress
+    User *user;
+    char name[32];
+} NameEntry;
+
+static NameEntry **nameBuckets = NULL;
+static size_t bucketCount = 0;
+static size_t nameCount = 0;
+
+static User **usersBySockfd = NULL;
+static size_t sockfdSlots = 0;
+
+// FNV-1a
+size_t registryHashName(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) name; *c != '\0'; ++c) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t) hash;
+}
+
+static NameEntry **findEntry(const char *name) {
+    if (bucketCount == 0) {
+        return NULL;
+    }
+    NameEntry **link = &nameBuckets[registryHashName(name) & (bucketCount - 1)];
+    while (*link != NULL) {
+        if (strncmp((*link)->name, name, sizeof((*link)->name)) == 0) {
+            return link;
+        }
+        link = &(*link)->next;
+    }
+    return NULL;
+}
+
+static int growBuckets(void) {
+    size_t newCount = bucketCount == 0 ? REGISTRY_INITIAL_BUCKETS : bucketCount * 2;
+    NameEntry **newBuckets = calloc(newCount, sizeof(NameEntry *));
+    if (newBuckets == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < bucketCount; ++i) {
+        NameEntry *entry = nameBuckets[i];
+        while (entry != NULL) {
+            NameEntry *next = entry->next;
+            size_t bucket = registryHashName(entry->name) & (newCount - 1);
+            entry->next = newBuckets[bucket];
+            newBuckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(nameBuckets);
+    nameBuckets = newBuckets;
+    bucketCount = newCount;
+    return 1;
+}
+
+static NameEntry *insertEntry(const char *name) {
+    // keep the load factor below 3/4
+    if ((nameCount + 1) * 4 > bucketCount * 3 && growBuckets() == -1) {
+        return NULL;
+    }
+    NameEntry *entry = calloc(1, sizeof(NameEntry));
+    if (entry == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    size_t bucket = registryHashName(entry->name) & (bucketCount - 1);
+    entry->next = nameBuckets[bucket];
+    nameBuckets[bucket] = entry;
+    nameCount++;
+    return entry;
+}
+
+static void removeEntry(NameEntry **link) {
+    NameEntry *entry = *link;
+    *link = entry->next;
+    free(entry);
+    nameCount--;
+}
+
+static int indexSockfd(User *user) {
+    int sockfd = user->socketFileDescriptor;
+    if (sockfd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if ((size_t) sockfd >= sockfdSlots) {
+        size_t slots = sockfdSlots == 0 ? 64 : sockfdSlots;
+        while (slots <= (size_t) sockfd) {
+            slots *= 2;
+        }
+        User **grown = realloc(usersBySockfd, slots * sizeof(User *));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(grown + sockfdSlots, 0, (slots - sockfdSlots) * sizeof(User *));
+        usersBySockfd = grown;
+        sockfdSlots = slots;
+    }
+    usersBySockfd[sockfd] = user;
+    return 1;
+}
+
+int registryReserveName(const char *name) {
+    if (findEntry(name) != NULL || insertEntry(name) == NULL) {
+        return -1;
+    }
+    return 1;
+}
+
+void registryReleaseName(const char *name) {
+    NameEntry **link = findEntry(name);
+    if (link != NULL && (*link)->user == NULL) {
+        removeEntry(link);
+    }
+}
+
+int registryInsert(User *user) {
+    NameEntry **link = findEntry(user->name);
+    NameEntry *entry;
+
+    if (link != NULL) {
+        if ((*link)->user != NULL) {
+            return -1;
+        }
+        entry = *link;
+    } else if ((entry = insertEntry(user->name)) == NULL) {
+        return -1;
+    }
+    if (indexSockfd(user) == -1) {
+        registryReleaseName(user->name);
+        return -1;
+    }
+    entry->user = user;
+    return 1;
+}
+
+void registryRemove(User *user) {
+    NameEntry **link = findEntry(user->name);
+    if (link != NULL && (*link)->user == user) {
+        removeEntry(link);
+    }
+    if (user->socketFileDescriptor >= 0 && (size_t) user->socketFileDescriptor < sockfdSlots &&
+        usersBySockfd[user->socketFileDescriptor] == user) {
+        usersBySockfd[user->socketFileDescriptor] = NULL;
+    }
+}
+
+int registryNameUsed(const char *name) {
+    return findEntry(name) != NULL;
+}
+
+User *registryFindByName(const char *name) {
+    NameEntry **link = findEntry(name);
+    return link != NULL ? (*link)->user : NULL;
+}
+
+User *registryFindBySockfd(int sockfd) {
+    if (sockfd < 0 || (size_t) sockfd >= sockfdSlots) {
+        return NULL;
+    }
+    return usersBySockfd[sockfd];
+}
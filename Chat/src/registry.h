@@ -0,0 +1,29 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "user.h"
+
+// name and socket indexes over the user list, callers serialize access with the user lock
+
+// claims name for a login in progress, -1 if it is taken or already reserved
+int registryReserveName(const char *name);
+
+void registryReleaseName(const char *name);
+
+// binds user to its (possibly reserved) name and socket, -1 if another user owns the name
+int registryInsert(User *user);
+
+// only drops index entries that still point at user
+void registryRemove(User *user);
+
+// 1 if the name belongs to a user or to a login in progress
+int registryNameUsed(const char *name);
+
+User *registryFindByName(const char *name);
+
+User *registryFindBySockfd(int sockfd);
+
+// hash used for the name index, also spreads rooms over the broadcast workers
+size_t registryHashName(const char *name);
+
+#endif
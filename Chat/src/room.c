@@ -0,0 +1,215 @@
+#include "room.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "util.h"
+#include "epoch.h"
+#include "registry.h"
+#include "broadcastagent.h"
+
+#define ROOM_INITIAL_CAPACITY 8
+
+static pthread_mutex_t roomLock = PTHREAD_MUTEX_INITIALIZER;
+static Room *roomBuckets[ROOM_BUCKETS];
+static UserSnapshot emptyMembers = {0};
+
+static Room **findRoom(const char *name) {
+    Room **link = &roomBuckets[registryHashName(name) % ROOM_BUCKETS];
+    while (*link != NULL) {
+        if (strncmp((*link)->name, name, sizeof((*link)->name)) == 0) {
+            return link;
+        }
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void destroyRoom(Room *room) {
+    UserSnapshot *members = atomic_load(&room->members);
+    if (members != NULL) {
+        epochRetire(members, free);
+    }
+    free(room->users);
+    free(room);
+}
+
+// caller holds roomLock
+static void publishMembers(Room *room) {
+    UserSnapshot *members = malloc(sizeof(UserSnapshot) + room->count * sizeof(User *));
+    if (members == NULL) {
+        errorPrint("out of memory, members of room %s not updated", room->name);
+        return;
+    }
+    members->count = room->count;
+    memcpy(members->users, room->users, room->count * sizeof(User *));
+    UserSnapshot *old = atomic_exchange(&room->members, members);
+    if (old != NULL) {
+        epochRetire(old, free);
+    }
+}
+
+// caller holds roomLock, returns the room with a reference for the caller
+static Room *lookupRoom(const char *name) {
+    Room **link = findRoom(name);
+    Room *room = *link;
+    if (room != NULL) {
+        size_t references = atomic_load(&room->references);
+        // a room whose count reached zero is being freed by its last releaser, never revive it
+        while (references > 0) {
+            if (atomic_compare_exchange_weak(&room->references, &references, references + 1)) {
+                return room;
+            }
+        }
+        *link = room->next;
+        room->linked = 0;
+    }
+    if ((room = calloc(1, sizeof(Room))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    strncpy(room->name, name, ROOM_NAME_MAX);
+    room->worker = (int) (registryHashName(room->name) % (size_t) broadcastAgentWorkers());
+    atomic_init(&room->references, 1);
+    atomic_init(&room->members, NULL);
+    room->linked = 1;
+    room->next = roomBuckets[registryHashName(name) % ROOM_BUCKETS];
+    roomBuckets[registryHashName(name) % ROOM_BUCKETS] = room;
+    debugPrint("room %s created on broadcast worker %d", room->name, room->worker);
+    return room;
+}
+
+// caller holds roomLock
+static int addMember(Room *room, User *user) {
+    if (room->count == room->capacity) {
+        size_t capacity = room->capacity == 0 ? ROOM_INITIAL_CAPACITY : room->capacity * 2;
+        User **users = realloc(room->users, capacity * sizeof(User *));
+        if (users == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        room->users = users;
+        room->capacity = capacity;
+    }
+    room->users[room->count++] = user;
+    publishMembers(room);
+    return 1;
+}
+
+// caller holds roomLock
+static void removeMember(Room *room, User *user) {
+    for (size_t i = 0; i < room->count; ++i) {
+        if (room->users[i] == user) {
+            // keep the join order, the snapshot is copied anyway
+            memmove(&room->users[i], &room->users[i + 1], (room->count - i - 1) * sizeof(User *));
+            room->count--;
+            publishMembers(room);
+            return;
+        }
+    }
+}
+
+static int validRoomName(const char *name) {
+    size_t length = strlen(name);
+    return length >= 1 && length <= ROOM_NAME_MAX && nameBytesValidate(name, length) == length;
+}
+
+int roomJoin(User *user, const char *name) {
+    if (!validRoomName(name)) {
+        return -1;
+    }
+    if (user->room != NULL && strcmp(user->room->name, name) == 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&roomLock);
+    Room *room = lookupRoom(name);
+    if (room == NULL || addMember(room, user) == -1) {
+        pthread_mutex_unlock(&roomLock);
+        if (room != NULL) {
+            roomRelease(room);
+        }
+        return -1;
+    }
+    Room *old = user->room;
+    if (old != NULL) {
+        removeMember(old, user);
+    }
+    user->room = room;
+    pthread_mutex_unlock(&roomLock);
+    // the member's reference, taken by lookupRoom(), now belongs to user->room
+    if (old != NULL) {
+        roomRelease(old);
+    }
+    return 1;
+}
+
+int roomLeave(User *user) {
+    if (user->room == NULL || strcmp(user->room->name, ROOM_DEFAULT_NAME) == 0) {
+        return -1;
+    }
+    return roomJoin(user, ROOM_DEFAULT_NAME);
+}
+
+void roomRemoveUser(User *user) {
+    pthread_mutex_lock(&roomLock);
+    Room *room = user->room;
+    if (room != NULL) {
+        removeMember(room, user);
+        user->room = NULL;
+    }
+    pthread_mutex_unlock(&roomLock);
+    if (room != NULL) {
+        roomRelease(room);
+    }
+}
+
+Room *roomFind(const char *name) {
+    Room *room;
+
+    pthread_mutex_lock(&roomLock);
+    room = *findRoom(name);
+    if (room != NULL) {
+        size_t references = atomic_load(&room->references);
+        while (references > 0 && !atomic_compare_exchange_weak(&room->references, &references, references + 1)) {
+        }
+        if (references == 0) {
+            room = NULL;
+        }
+    }
+    pthread_mutex_unlock(&roomLock);
+    return room;
+}
+
+Room *roomRetain(Room *room) {
+    if (room != NULL) {
+        atomic_fetch_add(&room->references, 1);
+    }
+    return room;
+}
+
+void roomRelease(Room *room) {
+    if (room == NULL || atomic_fetch_sub(&room->references, 1) != 1) {
+        return;
+    }
+    // only the thread that brought the count to zero gets here, lookups do not revive the room
+    pthread_mutex_lock(&roomLock);
+    if (room->linked) {
+        Room **link = findRoom(room->name);
+        if (*link == room) {
+            *link = room->next;
+        }
+        room->linked = 0;
+    }
+    pthread_mutex_unlock(&roomLock);
+    destroyRoom(room);
+}
+
+UserSnapshot *roomMembersAcquire(Room *room) {
+    epochEnter();
+    UserSnapshot *members = atomic_load(&room->members);
+    return members != NULL ? members : &emptyMembers;
+}
+
+void roomMembersRelease(void) {
+    epochExit();
+}
@@ -0,0 +1,51 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "user.h"
+
+#define ROOM_NAME_MAX 31
+// every user is in exactly one room, this one until they join another
+#define ROOM_DEFAULT_NAME "lobby"
+#define ROOM_BUCKETS 256
+
+typedef struct Room {
+    // hash chain, guarded by the room lock
+    struct Room *next;
+    char name[ROOM_NAME_MAX + 1];
+    // broadcast worker that delivers every message of this room, so they stay in order
+    int worker;
+    // one per member and per queued message, the room is freed when the last one is released
+    atomic_size_t references;
+    int linked;
+    // guarded by the room lock, readers use the published snapshot
+    User **users;
+    size_t count;
+    size_t capacity;
+    _Atomic(UserSnapshot *) members;
+} Room;
+
+// moves user from its current room into the named one, which is created on first use,
+// returns -1 if the name is invalid or memory runs out
+int roomJoin(User *user, const char *name);
+
+// moves user back into the default room, returns -1 if it already is there
+int roomLeave(User *user);
+
+// takes user out of its room for good, must happen before the user is retired
+void roomRemoveUser(User *user);
+
+// a reference to the room if it has members or queued messages, NULL otherwise
+Room *roomFind(const char *name);
+
+Room *roomRetain(Room *room);
+
+void roomRelease(Room *room);
+
+// members as of the last join/leave, valid until roomMembersRelease(), no lock is taken
+UserSnapshot *roomMembersAcquire(Room *room);
+
+void roomMembersRelease(void);
+
+#endif
@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+
+#include "sendqueue.h"
+#include "util.h"
+#include "frame.h"
+#include "pool.h"
+#include "compact.h"
+#include "compress.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define FLUSHER_MAX_EVENTS 64
+// frames handed to one sendmsg() call by sendQueuePushFrames
+#define SEND_BATCH_MAX 64
+
+typedef struct QueuedFrame {
+    struct QueuedFrame *next;
+    Frame *frame;
+    size_t offset;
+} QueuedFrame;
+
+static Pool queuedFramePool = POOL_INITIALIZER("QueuedFrame", sizeof(QueuedFrame));
+
+typedef struct SendQueue {
+    pthread_mutex_t lock;
+    int sockfd;
+    QueuedFrame *head;
+    QueuedFrame *tail;
+    size_t bytes;
+    size_t dropped;
+    int overflowed;
+    int registered;
+    int armed;
+    // protocol version of the client, frames are encoded for it on the way in
+    int version;
+    // a SOCK_SEQPACKET client reads one frame per packet, frames are never coalesced for it
+    int packets;
+} SendQueue;
+
+// queues are indexed by socket, the table lock only guards the table itself and queue lifetime
+static pthread_rwlock_t tableLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static SendQueue **queues = NULL;
+static size_t queueSlots = 0;
+
+static pthread_t flusherThread;
+static int flusherEpoll = -1;
+static size_t queueLimit = SEND_QUEUE_DEFAULT_LIMIT;
+static int queuePolicy = SEND_QUEUE_POLICY_DROP_OLDEST;
+// set while the sockets are handed to the next process, nothing is written to them anymore
+static int frozen = 0;
+
+static SendQueue *lookup(int sockfd) {
+    if (sockfd < 0 || (size_t) sockfd >= queueSlots) {
+        return NULL;
+    }
+    return queues[sockfd];
+}
+
+static void freeFrames(SendQueue *queue) {
+    QueuedFrame *frame = queue->head;
+    while (frame != NULL) {
+        QueuedFrame *next = frame->next;
+        frameRelease(frame->frame);
+        poolFree(&queuedFramePool, frame);
+        frame = next;
+    }
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->bytes = 0;
+}
+
+// returns 1 when everything was written, 0 if the socket is full, -1 on error
+static int writeFrames(SendQueue *queue) {
+    ssize_t bytesSend;
+
+    while (queue->head != NULL) {
+        QueuedFrame *frame = queue->head;
+        bytesSend = send(queue->sockfd, frame->frame->data + frame->offset, frame->frame->length - frame->offset,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytesSend < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        frame->offset += (size_t) bytesSend;
+        queue->bytes -= (size_t) bytesSend;
+        if (frame->offset == frame->frame->length) {
+            queue->head = frame->next;
+            if (queue->head == NULL) {
+                queue->tail = NULL;
+            }
+            frameRelease(frame->frame);
+            poolFree(&queuedFramePool, frame);
+        }
+    }
+    return 1;
+}
+
+static void arm(SendQueue *queue) {
+    struct epoll_event event;
+
+    if (queue->armed) {
+        return;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.fd = queue->sockfd;
+    if (epoll_ctl(flusherEpoll, queue->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, queue->sockfd, &event) == -1) {
+        errnoPrint("could not watch socket %d for writability", queue->sockfd);
+        return;
+    }
+    queue->registered = 1;
+    queue->armed = 1;
+}
+
+// drops whole frames that have not been started, so the stream stays parseable
+static void dropOldest(SendQueue *queue, size_t needed) {
+    QueuedFrame **link = &queue->head;
+
+    if (*link != NULL && (*link)->offset > 0) {
+        link = &(*link)->next;
+    }
+    while (*link != NULL && queue->bytes + needed > queueLimit) {
+        QueuedFrame *frame = *link;
+        *link = frame->next;
+        queue->bytes -= frame->frame->length;
+        queue->dropped++;
+        frameRelease(frame->frame);
+        poolFree(&queuedFramePool, frame);
+    }
+    queue->tail = queue->head;
+    while (queue->tail != NULL && queue->tail->next != NULL) {
+        queue->tail = queue->tail->next;
+    }
+}
+
+// takes over one reference of wireFrame, offset bytes of it have already been written
+static int append(SendQueue *queue, Frame *wireFrame, size_t offset) {
+    QueuedFrame *frame = poolAlloc(&queuedFramePool);
+    if (frame == NULL) {
+        frameRelease(wireFrame);
+        errno = ENOMEM;
+        return -1;
+    }
+    frame->next = NULL;
+    frame->frame = wireFrame;
+    frame->offset = offset;
+    if (queue->tail == NULL) {
+        queue->head = frame;
+    } else {
+        queue->tail->next = frame;
+    }
+    queue->tail = frame;
+    queue->bytes += wireFrame->length - offset;
+    return 1;
+}
+
+// queues the unsent rest of data by referencing wireFrame if given, copying data otherwise
+static ssize_t push(SendQueue *queue, const void *data, size_t length, Frame *wireFrame) {
+    const unsigned char *bytes = data;
+    ssize_t bytesSend = 0;
+
+    if (queue->overflowed || frozen) {
+        errno = EPIPE;
+        return -1;
+    }
+    // nothing pending: try the socket first and only copy what it does not take
+    if (queue->head == NULL) {
+        while ((bytesSend = send(queue->sockfd, bytes, length, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 &&
+               errno == EINTR) {
+        }
+        if (bytesSend < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            bytesSend = 0;
+        }
+        if ((size_t) bytesSend == length) {
+            return (ssize_t) length;
+        }
+    }
+    if (queue->bytes + length - (size_t) bytesSend > queueLimit) {
+        if (queuePolicy == SEND_QUEUE_POLICY_DROP_OLDEST) {
+            dropOldest(queue, length - (size_t) bytesSend);
+        }
+        if (queue->bytes + length - (size_t) bytesSend > queueLimit) {
+            debugPrint("send queue of socket %d full, disconnecting slow consumer", queue->sockfd);
+            queue->overflowed = 1;
+            freeFrames(queue);
+            // the thread or reactor reading this socket sees the shutdown and removes the user
+            shutdown(queue->sockfd, SHUT_RDWR);
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    if (wireFrame != NULL) {
+        frameRetain(wireFrame);
+    } else if ((wireFrame = frameCreate(bytes, length)) == NULL) {
+        return -1;
+    }
+    if (append(queue, wireFrame, (size_t) bytesSend) == -1) {
+        return -1;
+    }
+    arm(queue);
+    return (ssize_t) length;
+}
+
+static void *sendQueueFlusher(void *arg) {
+    struct epoll_event events[FLUSHER_MAX_EVENTS];
+    int count;
+
+    for (;;) {
+        if ((count = epoll_wait(flusherEpoll, events, FLUSHER_MAX_EVENTS, -1)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errnoPrint("epoll_wait() in send queue flusher");
+            break;
+        }
+        pthread_rwlock_rdlock(&tableLock);
+        for (int i = 0; i < count; ++i) {
+            SendQueue *queue = lookup(events[i].data.fd);
+            if (queue == NULL || frozen) {
+                continue;
+            }
+            pthread_mutex_lock(&queue->lock);
+            queue->armed = 0;
+            if (writeFrames(queue) == 0) {
+                arm(queue);
+            }
+            pthread_mutex_unlock(&queue->lock);
+        }
+        pthread_rwlock_unlock(&tableLock);
+    }
+    return arg;
+}
+
+int sendQueueStart(size_t limit, int policy) {
+    queueLimit = limit < SEND_QUEUE_MIN_LIMIT ? SEND_QUEUE_MIN_LIMIT : limit;
+    queuePolicy = policy;
+    if ((flusherEpoll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        errnoPrint("epoll_create1() for send queues");
+        return -1;
+    }
+    if (pthread_create(&flusherThread, NULL, sendQueueFlusher, NULL) != 0) {
+        errnoPrint("error creating send queue flusher thread");
+        return -1;
+    }
+    return 1;
+}
+
+int sendQueueAdd(int sockfd, int version) {
+    int type = 0;
+    socklen_t length = sizeof(type);
+    SendQueue *queue = calloc(1, sizeof(SendQueue));
+    if (queue == NULL || sockfd < 0) {
+        free(queue);
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->sockfd = sockfd;
+    queue->version = version;
+    queue->packets = getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &length) == 0 && type == SOCK_SEQPACKET;
+
+    pthread_rwlock_wrlock(&tableLock);
+    if ((size_t) sockfd >= queueSlots) {
+        size_t slots = queueSlots == 0 ? 64 : queueSlots;
+        while (slots <= (size_t) sockfd) {
+            slots *= 2;
+        }
+        SendQueue **grown = realloc(queues, slots * sizeof(SendQueue *));
+        if (grown == NULL) {
+            pthread_rwlock_unlock(&tableLock);
+            free(queue);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(grown + queueSlots, 0, (slots - queueSlots) * sizeof(SendQueue *));
+        queues = grown;
+        queueSlots = slots;
+    }
+    queues[sockfd] = queue;
+    pthread_rwlock_unlock(&tableLock);
+    return 1;
+}
+
+void sendQueueRemove(int sockfd) {
+    pthread_rwlock_wrlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue != NULL) {
+        queues[sockfd] = NULL;
+        if (queue->registered) {
+            epoll_ctl(flusherEpoll, EPOLL_CTL_DEL, sockfd, NULL);
+        }
+    }
+    pthread_rwlock_unlock(&tableLock);
+    if (queue != NULL) {
+        freeFrames(queue);
+        pthread_mutex_destroy(&queue->lock);
+        free(queue);
+    }
+}
+
+void sendQueueFreeze(void) {
+    pthread_rwlock_wrlock(&tableLock);
+    frozen = 1;
+    pthread_rwlock_unlock(&tableLock);
+}
+
+ssize_t sendQueueTake(int sockfd, unsigned char **data) {
+    size_t length = 0;
+    size_t size;
+
+    *data = NULL;
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue == NULL) {
+        pthread_rwlock_unlock(&tableLock);
+        return 0;
+    }
+    pthread_mutex_lock(&queue->lock);
+    size = queue->bytes;
+    for (QueuedFrame *frame = queue->head; queue->packets && frame != NULL; frame = frame->next) {
+        size += sizeof(uint32_t);
+    }
+    if (size > 0 && (*data = malloc(size)) == NULL) {
+        pthread_mutex_unlock(&queue->lock);
+        pthread_rwlock_unlock(&tableLock);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (QueuedFrame *frame = queue->head; frame != NULL; frame = frame->next) {
+        // a packet is sent whole or not at all, its length keeps it apart from the next one
+        if (queue->packets) {
+            uint32_t packetLength = (uint32_t) (frame->frame->length - frame->offset);
+            memcpy(*data + length, &packetLength, sizeof(packetLength));
+            length += sizeof(packetLength);
+        }
+        memcpy(*data + length, frame->frame->data + frame->offset, frame->frame->length - frame->offset);
+        length += frame->frame->length - frame->offset;
+    }
+    freeFrames(queue);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_rwlock_unlock(&tableLock);
+    return (ssize_t) length;
+}
+
+int sendQueueRestore(int sockfd, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    size_t done = 0;
+    int result = 1;
+
+    if (length == 0) {
+        return 1;
+    }
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue == NULL) {
+        pthread_rwlock_unlock(&tableLock);
+        errno = ENOENT;
+        return -1;
+    }
+    pthread_mutex_lock(&queue->lock);
+    // already encoded for the client; restored before the server serves anyone, so nothing can be
+    // queued ahead of it, the flusher writes it once the socket is writable
+    while (result == 1 && done < length) {
+        size_t frameLength = length - done;
+        Frame *frame;
+        if (queue->packets) {
+            uint32_t packetLength;
+            if (frameLength < sizeof(packetLength)) {
+                errno = EINVAL;
+                result = -1;
+                break;
+            }
+            memcpy(&packetLength, bytes + done, sizeof(packetLength));
+            done += sizeof(packetLength);
+            if (packetLength > length - done) {
+                errno = EINVAL;
+                result = -1;
+                break;
+            }
+            frameLength = packetLength;
+        }
+        if ((frame = frameCreate(bytes + done, frameLength)) == NULL) {
+            result = -1;
+            break;
+        }
+        result = append(queue, frame, 0);
+        done += frameLength;
+    }
+    if (queue->head != NULL) {
+        arm(queue);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    pthread_rwlock_unlock(&tableLock);
+    return result;
+}
+
+// a version 1 client gets frames in their compact encoding, version 2 shared frames compressed
+// on top, result is in bytes of the original
+static ssize_t pushEncoded(SendQueue *queue, Frame *frame, int named) {
+    Frame *encoded;
+
+    if (named) {
+        encoded = compactEncode(frame, 1);
+    } else {
+        encoded = queue->version == VERSION_COMPRESSED ? compressFrame(frame) : compactFrame(frame);
+    }
+    ssize_t result;
+
+    if (encoded == NULL) {
+        return -1;
+    }
+    result = push(queue, encoded->data, encoded->length, encoded);
+    if (named) {
+        frameRelease(encoded);
+    }
+    return result == -1 ? -1 : (ssize_t) frame->length;
+}
+
+ssize_t sendQueuePush(int sockfd, const void *data, size_t length) {
+    ssize_t result;
+
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue == NULL) {
+        pthread_rwlock_unlock(&tableLock);
+        return send(sockfd, data, length, MSG_NOSIGNAL);
+    }
+    pthread_mutex_lock(&queue->lock);
+    if (queue->version >= VERSION_COMPACT) {
+        // replies to one client, there is no sender id and nothing to share
+        Frame *frame = frameCreate(data, length);
+        result = frame != NULL ? pushEncoded(queue, frame, 1) : -1;
+        frameRelease(frame);
+    } else {
+        result = push(queue, data, length, NULL);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    pthread_rwlock_unlock(&tableLock);
+    return result;
+}
+
+ssize_t sendQueuePushFrame(int sockfd, Frame *frame) {
+    ssize_t result;
+
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue == NULL) {
+        pthread_rwlock_unlock(&tableLock);
+        return send(sockfd, frame->data, frame->length, MSG_NOSIGNAL);
+    }
+    pthread_mutex_lock(&queue->lock);
+    if (queue->version >= VERSION_COMPACT) {
+        result = pushEncoded(queue, frame, 0);
+    } else {
+        result = push(queue, frame->data, frame->length, frame);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    pthread_rwlock_unlock(&tableLock);
+    return result;
+}
+
+// sockets without a queue get the frames one by one with blocking sends
+static ssize_t sendUnqueued(int sockfd, Frame **frames, size_t count) {
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (send(sockfd, frames[i]->data, frames[i]->length, MSG_NOSIGNAL) == -1) {
+            return -1;
+        }
+        total += frames[i]->length;
+    }
+    return (ssize_t) total;
+}
+
+// writes frames from next on with as few sendmsg() calls of at most batchMax frames as possible,
+// advances next and offset past what the socket took, returns 0 once it is full and -1 on error
+static int writeBatches(int sockfd, Frame **frames, size_t count, size_t batchMax, size_t *next, size_t *offset) {
+    struct iovec iov[SEND_BATCH_MAX];
+    struct msghdr header;
+    ssize_t bytesSend;
+
+    while (*next < count) {
+        size_t batch = 0;
+        for (; batch < batchMax && *next + batch < count; ++batch) {
+            size_t skip = batch == 0 ? *offset : 0;
+            iov[batch].iov_base = frames[*next + batch]->data + skip;
+            iov[batch].iov_len = frames[*next + batch]->length - skip;
+        }
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = iov;
+        header.msg_iovlen = batch;
+        if ((bytesSend = sendmsg(sockfd, &header, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        size_t written = (size_t) bytesSend;
+        while (written > 0) {
+            size_t rest = frames[*next]->length - *offset;
+            if (written < rest) {
+                *offset += written;
+                break;
+            }
+            written -= rest;
+            (*next)++;
+            *offset = 0;
+        }
+    }
+    return 1;
+}
+
+// queues whatever of frames the socket does not take right away
+static ssize_t pushFrames(SendQueue *queue, Frame **frames, size_t count) {
+    size_t first = 0;
+    size_t offset = 0;
+    size_t total = 0;
+
+    if (queue->overflowed || frozen) {
+        errno = EPIPE;
+        return -1;
+    }
+    // leave out the oldest frames instead of overflowing the queue, whatever the policy
+    for (size_t i = 0; i < count; ++i) {
+        total += frames[i]->length;
+    }
+    while (first < count && queue->bytes + total > queueLimit) {
+        total -= frames[first++]->length;
+    }
+    if (queue->head == NULL &&
+        writeBatches(queue->sockfd, frames, count, queue->packets ? 1 : SEND_BATCH_MAX, &first, &offset) == -1) {
+        return -1;
+    }
+    for (; first < count; ++first, offset = 0) {
+        if (append(queue, frameRetain(frames[first]), offset) == -1) {
+            return -1;
+        }
+    }
+    if (queue->head != NULL) {
+        arm(queue);
+    }
+    return (ssize_t) total;
+}
+
+// replayed frames may come from users that have left meanwhile, their names are spelled out
+static ssize_t pushEncodedFrames(SendQueue *queue, Frame **frames, size_t count) {
+    Frame **encoded = malloc(count * sizeof(Frame *));
+    ssize_t result;
+    size_t done = 0;
+
+    if (encoded == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while (done < count && (encoded[done] = compactEncode(frames[done], 1)) != NULL) {
+        done++;
+    }
+    result = done == count ? pushFrames(queue, encoded, count) : -1;
+    for (size_t i = 0; i < done; ++i) {
+        frameRelease(encoded[i]);
+    }
+    free(encoded);
+    return result;
+}
+
+ssize_t sendQueuePushFrames(int sockfd, Frame **frames, size_t count) {
+    ssize_t result;
+
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue == NULL) {
+        pthread_rwlock_unlock(&tableLock);
+        return sendUnqueued(sockfd, frames, count);
+    }
+    pthread_mutex_lock(&queue->lock);
+    if (queue->version >= VERSION_COMPACT) {
+        result = pushEncodedFrames(queue, frames, count);
+    } else {
+        result = pushFrames(queue, frames, count);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    pthread_rwlock_unlock(&tableLock);
+    return result;
+}
+
+size_t sendQueueDepth(int sockfd) {
+    size_t depth = 0;
+
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue != NULL) {
+        pthread_mutex_lock(&queue->lock);
+        depth = queue->bytes;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    pthread_rwlock_unlock(&tableLock);
+    return depth;
+}
+
+size_t sendQueueDropped(int sockfd) {
+    size_t dropped = 0;
+
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue != NULL) {
+        pthread_mutex_lock(&queue->lock);
+        dropped = queue->dropped;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    pthread_rwlock_unlock(&tableLock);
+    return dropped;
+}
+
+int sendQueueOverflowed(int sockfd) {
+    int overflowed = 0;
+
+    pthread_rwlock_rdlock(&tableLock);
+    SendQueue *queue = lookup(sockfd);
+    if (queue != NULL) {
+        pthread_mutex_lock(&queue->lock);
+        overflowed = queue->overflowed;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    pthread_rwlock_unlock(&tableLock);
+    return overflowed;
+}
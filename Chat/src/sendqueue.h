@@ -0,0 +1,53 @@
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct Frame;
+
+#define SEND_QUEUE_POLICY_DROP_OLDEST 0
+#define SEND_QUEUE_POLICY_DISCONNECT 1
+
+#define SEND_QUEUE_DEFAULT_LIMIT (64 * 1024)
+// must hold at least a partially sent frame plus a new one of maximum size
+#define SEND_QUEUE_MIN_LIMIT 4096
+
+// starts the thread that drains queues whose sockets were not writable, limit is in bytes per client
+int sendQueueStart(size_t limit, int policy);
+
+// version is the client's protocol version, frames pushed later are encoded for it
+int sendQueueAdd(int sockfd, int version);
+
+void sendQueueRemove(int sockfd);
+
+// sends without blocking and queues what the socket does not take, sockets without a queue
+// (not logged in yet) are written directly, returns -1 if the client is broken or was disconnected
+ssize_t sendQueuePush(int sockfd, const void *data, size_t length);
+
+// like sendQueuePush, but a queued remainder references the shared frame instead of copying it
+ssize_t sendQueuePushFrame(int sockfd, struct Frame *frame);
+
+// sends a batch of frames with few system calls, the oldest are left out if the batch would
+// not fit into the queue, returns the number of bytes accepted or -1 if the client is broken
+ssize_t sendQueuePushFrames(int sockfd, struct Frame **frames, size_t count);
+
+// stops every write to queued sockets, used once they are handed over to the next process
+void sendQueueFreeze(void);
+
+// hands the unsent bytes of a frozen queue to *data (malloc'd, NULL if there are none) and
+// empties the queue, returns their number or -1; for a SOCK_SEQPACKET socket every frame is
+// preceded by its uint32 length, so it still goes out as a packet of its own
+ssize_t sendQueueTake(int sockfd, unsigned char **data);
+
+// queues bytes taken from the previous process's queue as they are, before anything else
+int sendQueueRestore(int sockfd, const void *data, size_t length);
+
+size_t sendQueueDepth(int sockfd);
+
+size_t sendQueueDropped(int sockfd);
+
+// 1 once the disconnect policy closed the connection because the queue was full
+int sendQueueOverflowed(int sockfd);
+
+#endif
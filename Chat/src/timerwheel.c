@@ -0,0 +1,111 @@
+#include "timerwheel.h"
+#include <string.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// slot of level at the tick when, seen from the wheel's next tick
+#define INDEX(when, level) ((size_t) ((when) >> (TIMER_WHEEL_SLOT_BITS * (level))) & SLOT_MASK)
+
+void timerWheelInit(TimerWheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now = now;
+}
+
+static void link(Timer **slot, Timer *timer) {
+    timer->next = *slot;
+    timer->link = slot;
+    if (*slot != NULL) {
+        (*slot)->link = &timer->next;
+    }
+    *slot = timer;
+}
+
+// wheel->now is the next tick to be processed, a timer lands on the lowest level covering it
+static void place(TimerWheel *wheel, Timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level;
+
+    if (timer->expires < wheel->now) {
+        link(&wheel->slots[0][INDEX(wheel->now, 0)], timer);
+        return;
+    }
+    if (delta >= TIMER_WHEEL_RANGE) {
+        timer->expires = wheel->now + TIMER_WHEEL_RANGE - 1;
+        delta = TIMER_WHEEL_RANGE - 1;
+    }
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        if (delta < (uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * (level + 1))) {
+            break;
+        }
+    }
+    link(&wheel->slots[level][INDEX(timer->expires, level)], timer);
+}
+
+void timerWheelAdd(TimerWheel *wheel, Timer *timer, uint64_t expires) {
+    if (timerScheduled(timer)) {
+        timerWheelRemove(wheel, timer);
+    }
+    timer->expires = expires;
+    place(wheel, timer);
+    wheel->count++;
+}
+
+void timerWheelRemove(TimerWheel *wheel, Timer *timer) {
+    if (!timerScheduled(timer)) {
+        return;
+    }
+    *timer->link = timer->next;
+    if (timer->next != NULL) {
+        timer->next->link = timer->link;
+    }
+    timer->next = NULL;
+    timer->link = NULL;
+    wheel->count--;
+}
+
+int timerScheduled(const Timer *timer) {
+    return timer->link != NULL;
+}
+
+// moves the timers of one slot a level down, returns the slot so the caller knows if it wrapped
+static size_t cascade(TimerWheel *wheel, int level, size_t index) {
+    Timer *timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        place(wheel, timer);
+        timer = next;
+    }
+    return index;
+}
+
+Timer *timerWheelAdvance(TimerWheel *wheel, uint64_t now) {
+    Timer *expired = NULL;
+    Timer **tail = &expired;
+
+    while (wheel->now <= now) {
+        size_t index = INDEX(wheel->now, 0);
+        // once level 0 wraps, the next slot of each level above that wrapped too comes down
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+                if (cascade(wheel, level, INDEX(wheel->now, level)) != 0) {
+                    break;
+                }
+            }
+        }
+        wheel->now++;
+        Timer *timer = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        while (timer != NULL) {
+            Timer *next = timer->next;
+            timer->next = NULL;
+            timer->link = NULL;
+            wheel->count--;
+            *tail = timer;
+            tail = &timer->next;
+            timer = next;
+        }
+    }
+    return expired;
+}
@@ -0,0 +1,43 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// hierarchical timing wheel: level 0 has one slot per tick, every further level one slot per
+// TIMER_WHEEL_SLOTS slots of the level below; adding and removing are O(1), a timer is moved
+// down at most TIMER_WHEEL_LEVELS - 1 times before it expires
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS 4
+// timers further out are parked at the end of the last level, the owner rechecks them when they fire
+#define TIMER_WHEEL_RANGE ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))
+
+// embedded in the owner's object, zero initialized means not scheduled
+typedef struct Timer {
+    struct Timer *next;
+    // the previous timer's next, or the slot itself
+    struct Timer **link;
+    uint64_t expires;
+} Timer;
+
+// not thread safe, the owner serializes every call
+typedef struct TimerWheel {
+    uint64_t now;
+    size_t count;
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+void timerWheelInit(TimerWheel *wheel, uint64_t now);
+
+// expires is in ticks, a time that has passed fires on the next advance
+void timerWheelAdd(TimerWheel *wheel, Timer *timer, uint64_t expires);
+
+void timerWheelRemove(TimerWheel *wheel, Timer *timer);
+
+int timerScheduled(const Timer *timer);
+
+// moves the wheel to now and returns the timers that expired, linked by next and no longer scheduled
+Timer *timerWheelAdvance(TimerWheel *wheel, uint64_t now);
+
+#endif
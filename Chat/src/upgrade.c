@@ -0,0 +1,652 @@
+#define _GNU_SOURCE
+
+#include "upgrade.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "util.h"
+#include "compact.h"
+#include "room.h"
+#include "idle.h"
+#include "admin.h"
+#include "journal.h"
+#include "sendqueue.h"
+#include "broadcastagent.h"
+#include "connectionhandler.h"
+#include "cluster.h"
+
+// first message on the upgrade socket, followed by one message per listening socket carrying
+// it, then one per user with its socket, each followed by its unsent bytes in chunks; the new
+// process answers with one byte once it holds everything
+#pragma pack(1)
+typedef struct UpgradeHeader {
+    uint32_t magic;
+    uint32_t listenSockets;
+    uint32_t users;
+    uint32_t lastUserId;
+    uint64_t compactBase;
+} UpgradeHeader;
+
+typedef struct UpgradeUser {
+    uint32_t id;
+    uint8_t version;
+    char name[32];
+    char room[ROOM_NAME_MAX + 1];
+    // receive buffer: a header already parsed and the bytes after it, which follow this record
+    uint8_t receiveState;
+    uint8_t headerType;
+    uint16_t headerLength;
+    uint32_t received;
+    // as sendQueueTake() hands them over, a packet client's frames each behind their length
+    uint32_t unsent;
+} UpgradeUser;
+#pragma pack(0)
+
+typedef struct UpgradeSession {
+    int fd;
+    UpgradeUser record;
+    unsigned char *received;
+    unsigned char *unsent;
+    User *user;
+} UpgradeSession;
+
+typedef struct ParkedConnection {
+    User *user;
+    ReceiveBuffer *receiveBuffer;
+} ParkedConnection;
+
+static atomic_int requested = 0;
+static char upgradePath[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+static pthread_t upgradeThread;
+
+// the running process: what it offers, guarded by upgradeLock
+static pthread_mutex_t upgradeLock = PTHREAD_MUTEX_INITIALIZER;
+static int *offered = NULL;
+static size_t offeredCount = 0;
+static pthread_t *threads = NULL;
+static size_t threadCount = 0;
+static size_t parkedThreads = 0;
+static ParkedConnection *parked = NULL;
+static size_t parkedCount = 0;
+static size_t parkedCapacity = 0;
+// set once the users left behind were dropped, a reader parking later is not handed over
+static int parkingClosed = 0;
+
+// the new process: what it took over
+static int *inherited = NULL;
+static size_t inheritedCount = 0;
+static UpgradeSession *sessions = NULL;
+static size_t sessionCount = 0;
+static uint64_t inheritedBase = 0;
+
+static void interrupted(int signal) {
+    (void) signal;
+}
+
+static int addressOf(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+static void setTimeouts(int fd) {
+    struct timeval timeout = {.tv_sec = UPGRADE_IO_TIMEOUT_S, .tv_usec = 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// one message, passing descriptor along unless it is -1
+static int sendRecord(int fd, const void *data, size_t length, int descriptor) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = (void *) data, .iov_len = length};
+    struct msghdr header;
+
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if (descriptor != -1) {
+        memset(&control, 0, sizeof(control));
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *message = CMSG_FIRSTHDR(&header);
+        message->cmsg_level = SOL_SOCKET;
+        message->cmsg_type = SCM_RIGHTS;
+        message->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(message), &descriptor, sizeof(int));
+    }
+    while (sendmsg(fd, &header, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// returns the length of the message, *descriptor is the one passed along or -1
+static ssize_t receiveRecord(int fd, void *data, size_t length, int *descriptor) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = data, .iov_len = length};
+    struct msghdr header;
+    ssize_t received;
+
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    while ((received = recvmsg(fd, &header, 0)) == -1 && errno == EINTR) {
+    }
+    if (received == -1) {
+        return -1;
+    }
+    if (received == 0 || (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (descriptor != NULL) {
+        *descriptor = -1;
+        struct cmsghdr *message = CMSG_FIRSTHDR(&header);
+        if (message != NULL && message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_RIGHTS) {
+            memcpy(descriptor, CMSG_DATA(message), sizeof(int));
+        }
+    }
+    return received;
+}
+
+static int receiveSessions(int fd, const UpgradeHeader *header) {
+    int descriptor;
+
+    for (size_t i = 0; i < header->listenSockets; ++i) {
+        uint32_t index;
+        if (receiveRecord(fd, &index, sizeof(index), &descriptor) != sizeof(index) || descriptor == -1) {
+            return -1;
+        }
+        inherited[inheritedCount++] = descriptor;
+    }
+    for (size_t i = 0; i < header->users; ++i) {
+        UpgradeSession *session = &sessions[i];
+        unsigned char message[sizeof(UpgradeUser) + RECEIVE_BUFFER_SIZE];
+        ssize_t length = receiveRecord(fd, message, sizeof(message), &descriptor);
+        if (length < (ssize_t) sizeof(UpgradeUser) || descriptor == -1) {
+            if (descriptor != -1) {
+                close(descriptor);
+            }
+            return -1;
+        }
+        session->fd = descriptor;
+        sessionCount++;
+        memcpy(&session->record, message, sizeof(UpgradeUser));
+        if (session->record.received != (size_t) length - sizeof(UpgradeUser)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (session->record.received > 0) {
+            if ((session->received = malloc(session->record.received)) == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            memcpy(session->received, message + sizeof(UpgradeUser), session->record.received);
+        }
+        session->record.name[sizeof(session->record.name) - 1] = '\0';
+        session->record.room[sizeof(session->record.room) - 1] = '\0';
+        if (session->record.unsent == 0) {
+            continue;
+        }
+        if ((session->unsent = malloc(session->record.unsent)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (size_t done = 0; done < session->record.unsent;) {
+            size_t chunk = session->record.unsent - done;
+            chunk = chunk < UPGRADE_CHUNK_SIZE ? chunk : UPGRADE_CHUNK_SIZE;
+            if (receiveRecord(fd, session->unsent + done, chunk, NULL) != (ssize_t) chunk) {
+                return -1;
+            }
+            done += chunk;
+        }
+    }
+    return 1;
+}
+
+int upgradeReceive(const char *path) {
+    struct sockaddr_un address;
+    UpgradeHeader header;
+    int fd;
+
+    if (addressOf(path, &address) == -1 || (fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+        errnoPrint("could not open upgrade socket %s", path);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        int error = errno;
+        close(fd);
+        // nothing to take over, this is a cold start
+        if (error == ENOENT || error == ECONNREFUSED) {
+            return 0;
+        }
+        errno = error;
+        errnoPrint("could not connect to upgrade socket %s", path);
+        return -1;
+    }
+    infoPrint("Taking over from the server at %s", path);
+    setTimeouts(fd);
+    if (receiveRecord(fd, &header, sizeof(header), NULL) != sizeof(header) || header.magic != UPGRADE_MAGIC) {
+        errorPrint("no valid handover from %s", path);
+        close(fd);
+        return -1;
+    }
+    if ((inherited = calloc(header.listenSockets + 1, sizeof(int))) == NULL ||
+        (sessions = calloc(header.users + 1, sizeof(UpgradeSession))) == NULL) {
+        errnoPrint("could not allocate %u sessions", header.users);
+        close(fd);
+        return -1;
+    }
+    if (receiveSessions(fd, &header) == -1 || sendRecord(fd, "", 1, -1) == -1) {
+        errnoPrint("handover from %s broken off", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    inheritedBase = header.compactBase;
+    userIdsContinue(header.lastUserId);
+    infoPrint("Took over %zu listening sockets and %zu users", inheritedCount, sessionCount);
+    return 1;
+}
+
+uint64_t upgradeCompactBase(void) {
+    return inheritedBase;
+}
+
+int upgradeListenSocket(int index) {
+    if (index < 0 || (size_t) index >= inheritedCount || inherited[index] == -1) {
+        return -1;
+    }
+    int fd = inherited[index];
+    inherited[index] = -1;
+    return fd;
+}
+
+void upgradeOfferListenSocket(int fd) {
+    pthread_mutex_lock(&upgradeLock);
+    int *grown = realloc(offered, (offeredCount + 1) * sizeof(int));
+    if (grown != NULL) {
+        offered = grown;
+        offered[offeredCount++] = fd;
+    }
+    pthread_mutex_unlock(&upgradeLock);
+}
+
+size_t upgradeRestoreUsers(void) {
+    for (size_t i = 0; i < inheritedCount; ++i) {
+        if (inherited[i] != -1) {
+            close(inherited[i]);
+            inherited[i] = -1;
+        }
+    }
+    for (size_t i = 0; i < sessionCount; ++i) {
+        UpgradeSession *session = &sessions[i];
+        User *user = restoreUser(session->fd, session->record.name, session->record.version, session->record.id);
+        if (user == NULL) {
+            errnoPrint("could not restore %s", session->record.name);
+            close(session->fd);
+            free(session->unsent);
+            session->unsent = NULL;
+            free(session->received);
+            session->received = NULL;
+            continue;
+        }
+        // the unsent bytes go out first, they are the rest of what the client was receiving
+        if (sendQueueRestore(session->fd, session->unsent, session->record.unsent) == -1 ||
+            roomJoin(user, session->record.room) == -1 || idleTrack(user) == -1) {
+            errnoPrint("could not restore the state of %s", user->name);
+            // a half restored session is not served, retiring the user closes its socket
+            removeUser(user);
+            free(session->unsent);
+            session->unsent = NULL;
+            free(session->received);
+            session->received = NULL;
+            continue;
+        }
+        // this process is a new cluster node, its peers learn about the user once the links are up
+        clusterUserAdded(user);
+        free(session->unsent);
+        session->unsent = NULL;
+        session->user = user;
+    }
+    return sessionCount;
+}
+
+size_t upgradeSessionCount(void) {
+    return sessionCount;
+}
+
+User *upgradeSessionUser(size_t index) {
+    return index < sessionCount ? sessions[index].user : NULL;
+}
+
+User *upgradeResume(size_t index, ReceiveBuffer *receiveBuffer) {
+    UpgradeSession *session = &sessions[index];
+
+    receiveBuffer->version = session->user->version;
+    receiveBuffer->state = session->record.receiveState;
+    receiveBuffer->header.type = session->record.headerType;
+    receiveBuffer->header.length = session->record.headerLength;
+    memcpy(receiveBuffer->data, session->received, session->record.received);
+    receiveBuffer->start = 0;
+    receiveBuffer->end = session->record.received;
+    free(session->received);
+    session->received = NULL;
+    return session->user;
+}
+
+int upgradeRequested(void) {
+    return atomic_load_explicit(&requested, memory_order_relaxed);
+}
+
+void upgradeRegisterThread(void) {
+    pthread_mutex_lock(&upgradeLock);
+    pthread_t *grown = realloc(threads, (threadCount + 1) * sizeof(pthread_t));
+    if (grown != NULL) {
+        threads = grown;
+        threads[threadCount++] = pthread_self();
+    }
+    pthread_mutex_unlock(&upgradeLock);
+}
+
+void upgradePark(User *user, ReceiveBuffer *receiveBuffer) {
+    pthread_mutex_lock(&upgradeLock);
+    if (parkingClosed) {
+        pthread_mutex_unlock(&upgradeLock);
+        return;
+    }
+    if (parkedCount == parkedCapacity) {
+        size_t capacity = parkedCapacity == 0 ? 64 : parkedCapacity * 2;
+        ParkedConnection *grown = realloc(parked, capacity * sizeof(ParkedConnection));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&upgradeLock);
+            errorPrint("out of memory, %s is not handed over", user->name);
+            return;
+        }
+        parked = grown;
+        parkedCapacity = capacity;
+    }
+    parked[parkedCount].user = user;
+    parked[parkedCount].receiveBuffer = receiveBuffer;
+    parkedCount++;
+    pthread_mutex_unlock(&upgradeLock);
+}
+
+void upgradeWait(void) {
+    for (;;) {
+        pause();
+    }
+}
+
+void upgradeParkThread(void) {
+    pthread_mutex_lock(&upgradeLock);
+    parkedThreads++;
+    pthread_mutex_unlock(&upgradeLock);
+    upgradeWait();
+}
+
+void upgradeForgetReader(User *user) {
+    pthread_mutex_lock(&upgradeLock);
+    user->thread = 0;
+    pthread_mutex_unlock(&upgradeLock);
+}
+
+// wakes whoever may still read, returns 1 once every registered thread and every user's reader parked
+static int parkAll(void) {
+    int done;
+
+    pthread_mutex_lock(&upgradeLock);
+    for (size_t i = 0; i < threadCount; ++i) {
+        pthread_kill(threads[i], UPGRADE_SIGNAL);
+    }
+    UserSnapshot *snapshot = userSnapshotAcquire();
+    // in reactor mode the reactors park their users, a reader thread of its own only has to be woken
+    if (connectionHandlerMode() == CONNECTION_MODE_THREADED) {
+        for (size_t i = 0; i < snapshot->count; ++i) {
+            if (snapshot->users[i]->thread != 0) {
+                pthread_kill(snapshot->users[i]->thread, UPGRADE_SIGNAL);
+            }
+        }
+    }
+    // parked users are never removed, so once the counts match every user in the list is parked
+    done = parkedThreads == threadCount && parkedCount == snapshot->count;
+    userSnapshotRelease();
+    pthread_mutex_unlock(&upgradeLock);
+    return done;
+}
+
+static int compareUsers(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t) *(User *const *) a;
+    uintptr_t second = (uintptr_t) *(User *const *) b;
+    return first < second ? -1 : first > second;
+}
+
+// the users whose readers did not park in time are not handed over: the others are told they are
+// gone and their clients see the connection end, instead of a server that never answers again
+static void dropUnparked(void) {
+    UserSnapshot *snapshot = userSnapshotAcquire();
+
+    pthread_mutex_lock(&upgradeLock);
+    parkingClosed = 1;
+    User **handedOver = malloc((parkedCount > 0 ? parkedCount : 1) * sizeof(User *));
+    for (size_t i = 0; handedOver != NULL && i < parkedCount; ++i) {
+        handedOver[i] = parked[i].user;
+    }
+    size_t handedOverCount = parkedCount;
+    pthread_mutex_unlock(&upgradeLock);
+    if (handedOver == NULL) {
+        errorPrint("out of memory, users left behind are not told apart");
+        userSnapshotRelease();
+        return;
+    }
+    qsort(handedOver, handedOverCount, sizeof(User *), compareUsers);
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        User *user = snapshot->users[i];
+        if (bsearch(&user, handedOver, handedOverCount, sizeof(User *), compareUsers) != NULL ||
+            atomic_exchange(&user->kicked, 1) != 0) {
+            continue;
+        }
+        errorPrint("%s is not handed over, closing its connection", user->name);
+        if (notifyUserRemoved(user, USER_REMOVED_STATUS_KICKED_FROM_SERVER) == -1) {
+            errnoPrint("error sending notifyUserRemoved");
+        }
+        shutdown(user->socketFileDescriptor, SHUT_RDWR);
+    }
+    userSnapshotRelease();
+    free(handedOver);
+}
+
+static int sendUser(int fd, const ParkedConnection *connection) {
+    User *user = connection->user;
+    ReceiveBuffer *receiveBuffer = connection->receiveBuffer;
+    unsigned char message[sizeof(UpgradeUser) + RECEIVE_BUFFER_SIZE];
+    UpgradeUser record;
+    unsigned char *unsent;
+    ssize_t unsentLength;
+    int result = 1;
+
+    if ((unsentLength = sendQueueTake(user->socketFileDescriptor, &unsent)) == -1) {
+        return -1;
+    }
+    memset(&record, 0, sizeof(record));
+    record.id = user->id;
+    record.version = user->version;
+    memcpy(record.name, user->name, sizeof(record.name) - 1);
+    if (user->room != NULL) {
+        memcpy(record.room, user->room->name, strnlen(user->room->name, sizeof(record.room) - 1));
+    } else {
+        strcpy(record.room, ROOM_DEFAULT_NAME);
+    }
+    record.receiveState = (uint8_t) receiveBuffer->state;
+    record.headerType = receiveBuffer->header.type;
+    record.headerLength = receiveBuffer->header.length;
+    record.received = (uint32_t) (receiveBuffer->end - receiveBuffer->start);
+    record.unsent = (uint32_t) unsentLength;
+    memcpy(message, &record, sizeof(record));
+    memcpy(message + sizeof(record), receiveBuffer->data + receiveBuffer->start, record.received);
+    if (sendRecord(fd, message, sizeof(record) + record.received, user->socketFileDescriptor) == -1) {
+        result = -1;
+    }
+    for (size_t done = 0; result == 1 && done < record.unsent; done += UPGRADE_CHUNK_SIZE) {
+        size_t chunk = record.unsent - done < UPGRADE_CHUNK_SIZE ? record.unsent - done : UPGRADE_CHUNK_SIZE;
+        result = sendRecord(fd, unsent + done, chunk, -1);
+    }
+    free(unsent);
+    return result;
+}
+
+static int sendEverything(int fd) {
+    UpgradeHeader header = {
+            .magic = UPGRADE_MAGIC,
+            .listenSockets = (uint32_t) offeredCount,
+            .users = (uint32_t) parkedCount,
+            .lastUserId = userIdsIssued(),
+            .compactBase = compactBase()
+    };
+
+    if (sendRecord(fd, &header, sizeof(header), -1) == -1) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < offeredCount; ++i) {
+        if (sendRecord(fd, &i, sizeof(i), offered[i]) == -1) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < parkedCount; ++i) {
+        if (sendUser(fd, &parked[i]) == -1) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// past the point where the readers stopped there is no way back, the process ends either way
+static void handOver(int fd) {
+    static const struct timespec interval = {.tv_sec = 0, .tv_nsec = UPGRADE_SIGNAL_INTERVAL_MS * 1000000L};
+    char ack;
+    int rounds = 0;
+
+    infoPrint("Handing over to a new server process");
+    atomic_store(&requested, 1);
+    idleSuspend();
+    // a kick now would shut down a socket that is about to be handed over
+    adminSuspend();
+    // a paused agent would keep throttled readers from ever reaching their next read
+    resumeServer();
+    while (!parkAll()) {
+        if (++rounds * UPGRADE_SIGNAL_INTERVAL_MS >= UPGRADE_PARK_TIMEOUT_MS) {
+            errorPrint("readers did not stop within %d ms, their users are left behind", UPGRADE_PARK_TIMEOUT_MS);
+            // announced before the send queues are handed over, so the parked users get the notices
+            dropUnparked();
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+    broadcastAgentDrain();
+    if (journalSync() == -1) {
+        errorPrint("journal lost messages, the next process continues it anyway");
+    }
+    // the parked lists only grow, a late reader is not sent but would write nothing anymore
+    sendQueueFreeze();
+    pthread_mutex_lock(&upgradeLock);
+    if (sendEverything(fd) == -1 || receiveRecord(fd, &ack, sizeof(ack), NULL) != sizeof(ack)) {
+        pthread_mutex_unlock(&upgradeLock);
+        errnoPrint("handover failed, exiting");
+        logFlush();
+        _exit(EXIT_FAILURE);
+    }
+    infoPrint("Handed over %zu users, exiting", parkedCount);
+    pthread_mutex_unlock(&upgradeLock);
+    logFlush();
+    // exit() would run nothing useful, and no socket the new process serves may be shut down
+    _exit(EXIT_SUCCESS);
+}
+
+static void *upgradeLoop(void *arg) {
+    int listenFd = *(int *) arg;
+    struct ucred credentials;
+    socklen_t length;
+    int fd;
+
+    free(arg);
+    for (;;) {
+        if ((fd = accept(listenFd, NULL, NULL)) == -1) {
+            if (errno != EINTR) {
+                errnoPrint("accept() on upgrade socket");
+            }
+            continue;
+        }
+        length = sizeof(credentials);
+        // only the same user may take the clients over
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1 || credentials.uid != getuid()) {
+            errorPrint("refusing handover to another user");
+            close(fd);
+            continue;
+        }
+        setTimeouts(fd);
+        handOver(fd);
+    }
+    return NULL;
+}
+
+int upgradeListen(const char *path) {
+    struct sockaddr_un address;
+    struct sigaction action;
+    int *listenFd = malloc(sizeof(int));
+
+    if (listenFd == NULL || addressOf(path, &address) == -1) {
+        free(listenFd);
+        errnoPrint("invalid upgrade socket %s", path);
+        return -1;
+    }
+    strcpy(upgradePath, path);
+    // no SA_RESTART: a blocked recv() or accept() returns EINTR and its thread checks the flag
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupted;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(UPGRADE_SIGNAL, &action, NULL) == -1) {
+        free(listenFd);
+        errnoPrint("sigaction()");
+        return -1;
+    }
+    // a socket left by the previous process (or a crashed one) is replaced
+    unlink(upgradePath);
+    if ((*listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1 ||
+        bind(*listenFd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        chmod(upgradePath, S_IRUSR | S_IWUSR) == -1 || listen(*listenFd, 1) == -1) {
+        errnoPrint("could not listen on upgrade socket %s", upgradePath);
+        if (*listenFd != -1) {
+            close(*listenFd);
+        }
+        free(listenFd);
+        return -1;
+    }
+    if (pthread_create(&upgradeThread, NULL, upgradeLoop, listenFd) != 0) {
+        errnoPrint("error creating upgrade thread");
+        return -1;
+    }
+    debugPrint("accepting a new process on %s", upgradePath);
+    return 1;
+}
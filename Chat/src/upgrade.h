@@ -0,0 +1,69 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include "user.h"
+#include "receivebuffer.h"
+
+// a new binary started with the same --upgrade-socket takes the listening sockets and every
+// logged in connection over from the running one, which exits without closing them
+#define UPGRADE_MAGIC 0x55504732
+// interrupts readers blocked in recv() so they park their connection
+#define UPGRADE_SIGNAL SIGUSR1
+#define UPGRADE_SIGNAL_INTERVAL_MS 10
+// readers that have not parked by then are left behind, their clients are disconnected
+#define UPGRADE_PARK_TIMEOUT_MS 5000
+// unsent bytes of a connection are passed in messages of at most this size
+#define UPGRADE_CHUNK_SIZE (32 * 1024)
+#define UPGRADE_IO_TIMEOUT_S 30
+
+// connects to path and, if a server answers, receives its listening sockets and users; returns 1
+// after a takeover, 0 if no server listens on path, -1 on error
+int upgradeReceive(const char *path);
+
+// base of the compact timestamps of the process taken over from, clients keep using it
+uint64_t upgradeCompactBase(void);
+
+// binds path and starts the thread that hands everything over to the next process connecting to it
+int upgradeListen(const char *path);
+
+// 1 once a handover has begun, readers then park their connection instead of reading
+int upgradeRequested(void);
+
+// a listening socket taken over, -1 if the previous process had fewer than index + 1
+int upgradeListenSocket(int index);
+
+// a listening socket to pass on to the next process
+void upgradeOfferListenSocket(int fd);
+
+// registers the users taken over in the user list and their rooms, nobody is notified; closes
+// the listening sockets not claimed so far and returns the number of sessions
+size_t upgradeRestoreUsers(void);
+
+size_t upgradeSessionCount(void);
+
+// NULL if the session could not be restored
+User *upgradeSessionUser(size_t index);
+
+// once per session, by the thread that serves it: fills receiveBuffer with the bytes the
+// previous process had read but not parsed yet
+User *upgradeResume(size_t index, ReceiveBuffer *receiveBuffer);
+
+// threads that stop without a connection of their own: the accept loop and every reactor
+void upgradeRegisterThread(void);
+
+// hands a logged in connection over, neither user nor receiveBuffer may be touched afterwards
+void upgradePark(User *user, ReceiveBuffer *receiveBuffer);
+
+// a registered thread is done, never returns
+void upgradeParkThread(void) __attribute__((noreturn));
+
+// a reader thread is done with its user and exits, it is not signalled anymore
+void upgradeForgetReader(User *user);
+
+// a reader that parked its connection waits here for the process to end
+void upgradeWait(void) __attribute__((noreturn));
+
+#endif
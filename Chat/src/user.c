@@ -3,23 +3,110 @@
 #include <stdlib.h>
 #include <string.h>
 #include "util.h"
+#include "sendqueue.h"
+#include "frame.h"
+#include "registry.h"
+#include "epoch.h"
+#include "room.h"
+#include "pool.h"
+#include "credit.h"
+#include "fanout.h"
+#include "idle.h"
+#include "cluster.h"
+#include <stdatomic.h>
+#include <sys/socket.h>
 
 static pthread_mutex_t userLock = PTHREAD_MUTEX_INITIALIZER;
+static Pool userPool = POOL_INITIALIZER("User", sizeof(User));
+static Pool mqMessagePool = POOL_INITIALIZER("mqMessage", sizeof(mqMessage));
 struct User *firstUser = NULL;
 struct User *lastUser = NULL;
 
-void *unlockMutex() {
-    pthread_mutex_unlock(&userLock);
-    return NULL;
+// immutable copy of the list, republished by every add/remove, read without any lock
+static _Atomic(UserSnapshot *) currentSnapshot = NULL;
+static UserSnapshot emptySnapshot = {0};
+// guarded by userLock
+static uint32_t lastUserId = 0;
+
+// caller holds userLock
+static void publishSnapshot(void) {
+    size_t count = 0;
+    User *curr;
+
+    for (curr = firstUser; curr != NULL; curr = curr->next) {
+        count++;
+    }
+    UserSnapshot *snapshot = malloc(sizeof(UserSnapshot) + count * sizeof(User *));
+    if (snapshot == NULL) {
+        errorPrint("out of memory, user snapshot not updated");
+        return;
+    }
+    snapshot->count = 0;
+    for (curr = firstUser; curr != NULL; curr = curr->next) {
+        snapshot->users[snapshot->count++] = curr;
+    }
+    UserSnapshot *old = atomic_exchange(&currentSnapshot, snapshot);
+    if (old != NULL) {
+        epochRetire(old, free);
+    }
+}
+
+UserSnapshot *userSnapshotAcquire(void) {
+    epochEnter();
+    UserSnapshot *snapshot = atomic_load(&currentSnapshot);
+    return snapshot != NULL ? snapshot : &emptySnapshot;
+}
+
+void userSnapshotRelease(void) {
+    epochExit();
+}
+
+User *allocUser(void) {
+    User *user = poolAlloc(&userPool);
+    if (user != NULL) {
+        memset(user, 0, sizeof(User));
+    }
+    return user;
+}
+
+void freeUser(User *user) {
+    if (user != NULL) {
+        creditRelease(user->credit);
+        idleRelease(user->idle);
+    }
+    poolFree(&userPool, user);
+}
+
+mqMessage *allocMqMessage(void) {
+    mqMessage *buffer = poolAlloc(&mqMessagePool);
+    if (buffer != NULL) {
+        memset(buffer, 0, sizeof(mqMessage));
+    }
+    return buffer;
+}
+
+void freeMqMessage(mqMessage *buffer) {
+    poolFree(&mqMessagePool, buffer);
+}
+
+// runs once no snapshot reader can reach the user anymore
+static void destroyUser(void *arg) {
+    User *user = (User *) arg;
+    sendQueueRemove(user->socketFileDescriptor);
+    close(user->socketFileDescriptor);
+    freeUser(user);
 }
 
 User *GetNewUser(pthread_t thread, int socketFileDescriptor, char name[]) {
-    struct User *newUser = (struct User *) malloc(sizeof(struct User));
+    struct User *newUser = allocUser();
     if (newUser == NULL) {
         errno = ENOMEM;
         return NULL;
     }
-    memset(newUser, 0, sizeof(User));
+    if ((newUser->credit = creditCreate()) == NULL) {
+        freeUser(newUser);
+        return NULL;
+    }
     newUser->thread = thread;
     newUser->socketFileDescriptor = socketFileDescriptor;
     strncpy(newUser->name, name, sizeof(newUser->name));
@@ -28,13 +115,37 @@ User *GetNewUser(pthread_t thread, int socketFileDescriptor, char name[]) {
     return newUser;
 }
 
-User *addNewUser(pthread_t thread, int socketFileDescriptor, char name[]) {
+// id 0 issues the next id, a given one comes from the process the user was handed over by
+static User *linkNewUser(pthread_t thread, int socketFileDescriptor, char name[], uint8_t version, uint32_t id) {
     pthread_mutex_lock(&userLock);
 
     User *newUser = GetNewUser(thread, socketFileDescriptor, name);
     if (newUser == NULL) {
+        pthread_mutex_unlock(&userLock);
         return NULL;
-    } else if (firstUser == NULL) {
+    }
+    if (registryInsert(newUser) == -1) {
+        debugPrint("could not register %s", name);
+        freeUser(newUser);
+        pthread_mutex_unlock(&userLock);
+        return NULL;
+    }
+    if (id == 0) {
+        id = ++lastUserId;
+    } else if (id > lastUserId) {
+        lastUserId = id;
+    }
+    newUser->id = id;
+    newUser->version = version;
+    // from here on other threads may send to the user, already in its version
+    if (sendQueueAdd(socketFileDescriptor, version) == -1) {
+        errnoPrint("could not create send queue for %s", name);
+        registryRemove(newUser);
+        freeUser(newUser);
+        pthread_mutex_unlock(&userLock);
+        return NULL;
+    }
+    if (firstUser == NULL) {
         firstUser = newUser;
         lastUser = newUser;
     } else if (lastUser != NULL) {
@@ -42,9 +153,41 @@ User *addNewUser(pthread_t thread, int socketFileDescriptor, char name[]) {
         newUser->prev = lastUser;
         lastUser = newUser;
     }
+    publishSnapshot();
+    pthread_mutex_unlock(&userLock);
     return newUser;
 }
 
+User *addNewUser(pthread_t thread, int socketFileDescriptor, char name[], uint8_t version) {
+    return linkNewUser(thread, socketFileDescriptor, name, version, 0);
+}
+
+User *restoreUser(int socketFileDescriptor, char name[], uint8_t version, uint32_t id) {
+    return linkNewUser(0, socketFileDescriptor, name, version, id);
+}
+
+uint32_t userIdsIssued(void) {
+    pthread_mutex_lock(&userLock);
+    uint32_t last = lastUserId;
+    pthread_mutex_unlock(&userLock);
+    return last;
+}
+
+uint32_t userIdIssue(void) {
+    pthread_mutex_lock(&userLock);
+    uint32_t id = ++lastUserId;
+    pthread_mutex_unlock(&userLock);
+    return id;
+}
+
+void userIdsContinue(uint32_t last) {
+    pthread_mutex_lock(&userLock);
+    if (last > lastUserId) {
+        lastUserId = last;
+    }
+    pthread_mutex_unlock(&userLock);
+}
+
 int removeUser(User *userToRemove) {
     pthread_mutex_lock(&userLock);
     int status = 1;
@@ -72,168 +215,280 @@ int removeUser(User *userToRemove) {
         userToRemove->prev->next = userToRemove->next;
         userToRemove->next->prev = userToRemove->prev;
     } else {
-        pthread_mutex_unlock(&userLock);
+        // user never made it into the list (e.g. failed login)
         status = -1;
     }
-    close(userToRemove->socketFileDescriptor);
-    free(userToRemove);
+    registryRemove(userToRemove);
+    if (status != -1) {
+        publishSnapshot();
+    }
     pthread_mutex_unlock(&userLock);
+    roomRemoveUser(userToRemove);
+    creditDetach(userToRemove->credit);
+    idleUntrack(userToRemove);
+    // broadcasters may still hold the user in an old snapshot: stop the traffic now, but keep the
+    // descriptor (and its number) until they are done so nothing reaches a reused socket
+    shutdown(userToRemove->socketFileDescriptor, SHUT_RDWR);
+    epochRetire(userToRemove, destroyUser);
     return status;
 }
 
 
 int notifyUserAdded(User *user) {
-    message *tmp = malloc(sizeof(message));
-    User *currentUser = firstUser;
-    if (firstUser == NULL) {
+    message *tmp = allocMessage();
+    if (tmp == NULL) {
+        return -1;
+    }
+    // everybody gets the same announcement, encode it once
+    Frame *added = frameFromMessage(prepareUserAdded(tmp, user->name, SEND_USER_ADDED_TYPE_NOTIFY));
+    if (added == NULL) {
+        freeMessage(tmp);
+        return -1;
+    }
+    added->sender = user->id;
+    UserSnapshot *snapshot = userSnapshotAcquire();
+    if (snapshot->count == 0) {
         // if user list is empty return -1
+        userSnapshotRelease();
+        frameRelease(added);
+        freeMessage(tmp);
         return -1;
     }
-    while (currentUser != NULL && strcmp(currentUser->name, "") != 0) {
-
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        User *currentUser = snapshot->users[i];
+        if (atomic_load_explicit(&currentUser->kicked, memory_order_relaxed)) {
+            continue;
+        }
 
-        if (sendUserAdded(tmp, currentUser->socketFileDescriptor, user->name, SEND_USER_ADDED_TYPE_NOTIFY) == -1) {
+        if (sendFrame(added, currentUser->socketFileDescriptor) == -1) {
             debugPrint("sending user added message to %s", user->name);
-            return -1;
-
+            if (currentUser == user) {
+                userSnapshotRelease();
+                frameRelease(added);
+                freeMessage(tmp);
+                return -1;
+            }
         }
 
         if (currentUser->socketFileDescriptor != user->socketFileDescriptor) {
             debugPrint("sending user added message to %s", currentUser->name);
-            sendUserAdded(tmp, user->socketFileDescriptor, currentUser->name, SEND_USER_ADDED_TYPE_UPDATE);
+            // as a frame, so a version 1 client learns the id along with the name
+            Frame *update = frameFromMessage(prepareUserAdded(tmp, currentUser->name, SEND_USER_ADDED_TYPE_UPDATE));
+            if (update != NULL) {
+                update->sender = currentUser->id;
+                sendFrame(update, user->socketFileDescriptor);
+                frameRelease(update);
+            }
         }
-
-        currentUser = currentUser->next;
     }
+    userSnapshotRelease();
 
-    free(tmp);
+    frameRelease(added);
+    freeMessage(tmp);
+    clusterUserAdded(user);
     return 1;
 }
 
 int notifyUserRemoved(User *user, uint8_t code) {
-    pthread_mutex_lock(&userLock);
-    message *tmpMessage = malloc(sizeof(message));
-    User *currentUser = firstUser;
-    memset(tmpMessage, 0, sizeof(message));
-    if (firstUser == NULL) {
-        // if user list is empty return -1
+    message *tmpMessage = allocMessage();
+    if (tmpMessage == NULL) {
         return -1;
-    } else {
-        while (currentUser != NULL/* && strcmp(currentUser->name, "") != 0*/) {
-            memset(tmpMessage->messageBody.userRemoved.name, 0, sizeof(tmpMessage->messageBody.userRemoved.name));
-
-                if (currentUser != user) {
-                    //debugPrint("sending user removed to %s", currentUser->name);
-                    sendUserRemoved(tmpMessage, currentUser->socketFileDescriptor, user->name, code);
-                }
-
-            currentUser = currentUser->next;
-
+    }
+    Frame *removed = frameFromMessage(prepareUserRemoved(tmpMessage, user->name, code));
+    if (removed == NULL) {
+        freeMessage(tmpMessage);
+        return -1;
+    }
+    removed->sender = user->id;
+    debugHexdump(removed->data, removed->length, "user removed");
+    UserSnapshot *snapshot = userSnapshotAcquire();
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        if (snapshot->users[i] != user) {
+            sendFrame(removed, snapshot->users[i]->socketFileDescriptor);
         }
     }
-    pthread_mutex_unlock(&userLock);
-    free(tmpMessage);
+    userSnapshotRelease();
+    frameRelease(removed);
+    freeMessage(tmpMessage);
+    clusterUserRemoved(user, code);
     return 1;
 }
 
-int sendMessageToAllUsers(message *message, int code) {
-    User *currentUser = firstUser;
-    if (firstUser == NULL) {
-        // if user list is empty return -1
+int notifyPeerUserAdded(const char *name, uint32_t id, User *to) {
+    message *tmp = allocMessage();
+    if (tmp == NULL) {
         return -1;
+    }
+    Frame *added = frameFromMessage(prepareUserAdded(tmp, (char *) name, to != NULL ? SEND_USER_ADDED_TYPE_UPDATE
+                                                                                 : SEND_USER_ADDED_TYPE_NOTIFY));
+    freeMessage(tmp);
+    if (added == NULL) {
+        return -1;
+    }
+    added->sender = id;
+    if (to != NULL) {
+        sendFrame(added, to->socketFileDescriptor);
     } else {
-        while ((currentUser != NULL)) {
-            sendServerMessage(message, currentUser->socketFileDescriptor, "", code, "");
-            currentUser = currentUser->next;
+        UserSnapshot *snapshot = userSnapshotAcquire();
+        for (size_t i = 0; i < snapshot->count; ++i) {
+            if (!atomic_load_explicit(&snapshot->users[i]->kicked, memory_order_relaxed)) {
+                sendFrame(added, snapshot->users[i]->socketFileDescriptor);
+            }
         }
-        return 1;
+        userSnapshotRelease();
     }
+    frameRelease(added);
+    return 1;
 }
 
-int sendSthTo(mqMessage *buffer) {
-    if (buffer == NULL) {
+int notifyPeerUserRemoved(const char *name, uint32_t id, uint8_t code) {
+    message *tmp = allocMessage();
+    if (tmp == NULL) {
         return -1;
     }
-    int sendType = buffer->message.messageHeader.type;
-    if (sendType == USER_REMOVED) {
-        sendType = SEND_TYPE_OTHERS;
-    } else {
-        sendType = SEND_TYPE_ALL;
+    Frame *removed = frameFromMessage(prepareUserRemoved(tmp, (char *) name, code));
+    freeMessage(tmp);
+    if (removed == NULL) {
+        return -1;
+    }
+    removed->sender = id;
+    UserSnapshot *snapshot = userSnapshotAcquire();
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        sendFrame(removed, snapshot->users[i]->socketFileDescriptor);
     }
+    userSnapshotRelease();
+    frameRelease(removed);
+    return 1;
+}
 
-    User *currentUser = firstUser;
-    if (currentUser == NULL) {
+// message has to be prepared with prepareServerMessage(), it is encoded once for all users
+int sendMessageToAllUsers(message *message, int code) {
+    Frame *frame = frameFromMessage(message);
+    if (frame == NULL) {
         return -1;
     }
-    while (currentUser != NULL && strcmp(currentUser->name, "") != 0) {
-        switch (sendType) {
-            case SEND_TYPE_ALL:
-                if (sendSth(&buffer->message, currentUser->socketFileDescriptor) == -1) {
-                    errnoPrint("error sending message in sendSthTo");
-                    return -1;
-                }
-                break;
-            case SEND_TYPE_OTHERS:
-                debugPrint("SEND_TYPE_OTHERS to: %s", currentUser->name);
-                if (currentUser->socketFileDescriptor != buffer->user->socketFileDescriptor &&
-                    strcmp(currentUser->name, "") != 0) {
-                    if ((sendSth(&buffer->message, currentUser->socketFileDescriptor) == -1)) {
-                        errnoPrint("error sending message in sendSthTo");
-                        return -1;
-                    }
-                }
-                break;
+    debugPrint("sending server code %d to all users", code);
+    UserSnapshot *snapshot = userSnapshotAcquire();
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        sendFrame(frame, snapshot->users[i]->socketFileDescriptor);
+    }
+    userSnapshotRelease();
+    frameRelease(frame);
+    return 1;
+}
+
+int sendSthToUsers(mqMessage *buffer, UserSnapshot *snapshot) {
+    if (buffer == NULL) {
+        return -1;
+    }
+    // a removed user's peers are told, the user itself is not
+    int skipSocket = -1;
+    if (buffer->message.messageHeader.type == USER_REMOVED) {
+        skipSocket = buffer->user->socketFileDescriptor;
+    }
+
+    if (buffer->frame == NULL) {
+        if ((buffer->frame = frameFromMessage(&buffer->message)) == NULL) {
+            return -1;
+        }
+        // server notices have no sender
+        if (buffer->user != NULL && (buffer->message.messageHeader.type != SERVER_2_CLIENT ||
+                                     buffer->message.messageBody.server2Client.originalSender[0] != '\0')) {
+            buffer->frame->sender = buffer->user->id;
         }
-        currentUser = currentUser->next;
     }
+    fanoutSend(buffer->frame, snapshot->users, snapshot->count, skipSocket);
     return 1;
 }
 
+int sendSthTo(mqMessage *buffer) {
+    int result;
+
+    if (buffer == NULL) {
+        return -1;
+    }
+    // cost scales with the room, not with the server
+    if (buffer->room != NULL) {
+        result = sendSthToUsers(buffer, roomMembersAcquire(buffer->room));
+        roomMembersRelease();
+    } else {
+        result = sendSthToUsers(buffer, userSnapshotAcquire());
+        userSnapshotRelease();
+    }
+    return result;
+}
+
 int getSockfd(const char *username) {
-    User *currentUser = firstUser;
+    int sockfd = -1;
     debugPrint("looking for user %s", username);
-    while (currentUser != NULL) {
-        debugPrint("checking %s", currentUser->name);
-        if (strcmp(username, currentUser->name) == 0) {
-            debugPrint("found User %s", username);
-
-            return currentUser->socketFileDescriptor;
-        } else {
-            currentUser = currentUser->next;
-        }
+    pthread_mutex_lock(&userLock);
+    User *user = registryFindByName(username);
+    if (user != NULL) {
+        debugPrint("found User %s", username);
+        sockfd = user->socketFileDescriptor;
     }
-    return -1;
+    pthread_mutex_unlock(&userLock);
+    return sockfd;
+}
+
+User *findUserByName(const char *name) {
+    pthread_mutex_lock(&userLock);
+    User *user = registryFindByName(name);
+    pthread_mutex_unlock(&userLock);
+    return user;
 }
 
 int testUserName(const char *nameToTest) {
-    User *currentUser = firstUser;
+    pthread_mutex_lock(&userLock);
+    int used = registryNameUsed(nameToTest);
+    pthread_mutex_unlock(&userLock);
+    return used ? -1 : 1;
+}
 
-    while (currentUser != NULL) {
-        if (strcmp(currentUser->name, nameToTest) == 0) {
-            return -1;
-        } else { currentUser = currentUser->next; }
+int reserveUserName(const char *name) {
+    pthread_mutex_lock(&userLock);
+    int result = registryReserveName(name);
+    pthread_mutex_unlock(&userLock);
+    // the other cluster nodes must agree before the name is ours
+    if (result != -1 && clusterClaimName(name) == -1) {
+        releaseUserName(name);
+        return -1;
     }
-    return 1;
+    return result;
+}
+
+void releaseUserName(const char *name) {
+    pthread_mutex_lock(&userLock);
+    registryReleaseName(name);
+    pthread_mutex_unlock(&userLock);
+}
+
+void printUserStats(void) {
+    UserSnapshot *snapshot = userSnapshotAcquire();
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        User *curr = snapshot->users[i];
+        size_t throttles;
+        uint64_t throttled;
+        creditStats(curr->credit, &throttles, &throttled);
+        infoPrint("STATS %s: socket %d, %zu bytes queued, %zu frames dropped, throttled %zu times for %.3f ms",
+                  curr->name, curr->socketFileDescriptor, sendQueueDepth(curr->socketFileDescriptor),
+                  sendQueueDropped(curr->socketFileDescriptor), throttles, (double) throttled / 1e6);
+    }
+    userSnapshotRelease();
 }
 
 void printUsers() {
-    User *curr = malloc(sizeof(User));
-    curr = firstUser;
-    while (curr != NULL) {
-        infoPrint("USER: %s", curr->name);
-        curr = curr->next;
+    UserSnapshot *snapshot = userSnapshotAcquire();
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        infoPrint("USER: %s", snapshot->users[i]->name);
     }
+    userSnapshotRelease();
     infoPrint("\n");
 }
 
 User *accessViaSockfd(int sockfd) {
-    User *curr = malloc(sizeof(User));
-    curr = firstUser;
-    while (curr != NULL) {
-        if (curr->socketFileDescriptor == sockfd) {
-            break;
-        }
-        curr = curr->next;
-    }
-    return curr;
+    pthread_mutex_lock(&userLock);
+    User *user = registryFindBySockfd(sockfd);
+    pthread_mutex_unlock(&userLock);
+    return user;
 }
@@ -4,6 +4,7 @@
 #define SEND_TYPE_OTHERS 220
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "protocol.h"
 
 
@@ -14,32 +15,109 @@ typedef struct User {
     pthread_t thread;
     int socketFileDescriptor;
     char name[32];
+    // set by whoever removes the user first: /kick, an idle or duplicate name eviction, or the
+    // user's own thread on a closed connection; atomic_exchange() claims the USER_REMOVED notice
+    atomic_int kicked;
+    // room the user's messages go to, changed by the user's own /join and /leave
+    struct Room *room;
+    // limits the user's messages queued for the broadcast agent
+    struct Credit *credit;
+    // never reused while the server runs, stands for the name in version 1 frames
+    uint32_t id;
+    // negotiated at login
+    uint8_t version;
+    // last activity and heartbeat state, NULL if idle detection is off
+    struct IdleTimer *idle;
 } User;
 #pragma pack(0)
 
+struct Frame;
+struct Room;
+struct Credit;
+struct IdleTimer;
+
 typedef struct mqMessage {
     message message;
     struct User *user;
+    // wire encoding of message, made once by the sender and shared by all recipients
+    struct Frame *frame;
+    // referenced recipients, NULL for every user
+    struct Room *room;
+    // taken from the sender, given back once the message is delivered
+    struct Credit *credit;
+    // received from another cluster node, delivered here but not forwarded again
+    int fromPeer;
 } mqMessage;
 
-User *addNewUser(pthread_t thread, int socketFileDescriptor, char name[]);
+// pooled, zeroed objects
+User *allocUser(void);
+
+void freeUser(User *user);
+
+mqMessage *allocMqMessage(void);
+
+void freeMqMessage(mqMessage *buffer);
+
+// users in insertion order as published by the last addNewUser()/removeUser()
+typedef struct UserSnapshot {
+    size_t count;
+    struct User *users[];
+} UserSnapshot;
+
+// the snapshot and the users in it stay valid until userSnapshotRelease(), no lock is taken
+UserSnapshot *userSnapshotAcquire(void);
+
+void userSnapshotRelease(void);
+
+User *addNewUser(pthread_t thread, int socketFileDescriptor, char name[], uint8_t version);
+
+// registers a user taken over from the previous process with its id, nobody is notified; the
+// caller sets the thread once one serves the socket
+User *restoreUser(int socketFileDescriptor, char name[], uint8_t version, uint32_t id);
 
+// ids are never reused, the next process continues after the last one issued
+uint32_t userIdsIssued(void);
+
+void userIdsContinue(uint32_t last);
+
+// an id for a user of another cluster node, from the same sequence as local users'
+uint32_t userIdIssue(void);
+
+// unlinks the user, its memory and socket are reclaimed once no snapshot reader can see it
 int removeUser(User *user);
 
 int testUserName(const char *nameToTest);
 
+// atomically checks and claims a name for a login in progress, addNewUser() takes the reservation over
+int reserveUserName(const char *name);
+
+void releaseUserName(const char *name);
+
 int sendMessageToAllUsers(message *message, int code);
 
 int notifyUserRemoved(User *user, uint8_t code);
 
 User *accessViaSockfd(int sockfd);
 
+// delivers to buffer->room, or to every user if it has none
 int sendSthTo(mqMessage *buffer);
 
-void *unlockMutex();
+// delivers to recipients the caller has acquired
+int sendSthToUsers(mqMessage *buffer, UserSnapshot *snapshot);
 
 int notifyUserAdded(User *user);
 
+// a user of another cluster node joined, announced to every local user or, if to is not NULL,
+// listed to the user that just logged in
+int notifyPeerUserAdded(const char *name, uint32_t id, User *to);
+
+int notifyPeerUserRemoved(const char *name, uint32_t id, uint8_t code);
+
 int getSockfd(const char *username);
 
+// indexed lookup, the result is only safe to use inside an epoch read section
+User *findUserByName(const char *name);
+
+void printUserStats(void);
+
 #endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "util.h"
 
 typedef enum {
@@ -21,41 +25,403 @@ typedef union {
 } Uint64Bytes;
 
 static const char *prog_name = "<unknown>";
-static int debug_enabled = 0;
+int logLevelCurrent = LOG_LEVEL_INFO;
 static int style_enabled = 1;
 
-static int lockFile(FILE *file) {
-    int oldState;
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
-    flockfile(file);
-    return oldState;
+// records a thread logs before the writer thread runs, or when its ring cannot be created, are
+// written synchronously under the stderr lock as before
+#define LOG_RING_SIZE (16 * 1024)
+#define LOG_LINE_MAX 1024
+// bytes of one hexdump record, a multiple of the 16 bytes of a line; longer dumps take several
+#define LOG_HEXDUMP_MAX 2048
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_IDLE_WAIT_MS 100
+
+#define LOG_RECORD_TEXT 0
+#define LOG_RECORD_HEXDUMP 1
+// fills the rest of the ring when a record does not fit before the end
+#define LOG_RECORD_PADDING 2
+
+typedef struct LogRecordHeader {
+    uint32_t length;
+    uint8_t kind;
+    uint8_t style;
+    // hexdump: bytes of the payload that are the prefix text, the dumped data follows
+    uint16_t prefixLength;
+} LogRecordHeader;
+
+// single producer (the owning thread), single consumer (whoever holds drainLock)
+typedef struct LogRing {
+    struct LogRing *next;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    // the owning thread has exited, the ring is recycled once it is drained
+    atomic_int orphaned;
+    _Alignas(LogRecordHeader) unsigned char data[LOG_RING_SIZE];
+} LogRing;
+
+typedef struct LogBatch {
+    char *data;
+    size_t capacity;
+    size_t used;
+} LogBatch;
+
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *rings = NULL;
+static LogRing *freeRings = NULL;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static __thread LogRing *threadRing = NULL;
+
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static char writerBuffer[LOG_BATCH_SIZE];
+static pthread_t writerThread;
+static atomic_int writerRunning = 0;
+static atomic_int writerSleeping = 0;
+static sem_t writerWakeup;
+static atomic_size_t droppedRecords = 0;
+static size_t reportedDrops = 0;
+
+static const char *styleCode(OutputStyle style) {
+    if (!style_enabled || !isatty(STDERR_FILENO)) {
+        return "";
+    }
+    switch (style) {
+        case STYLE_INFO:
+            return "\033[1;39;49m";    //bold, default colors
+        case STYLE_ERROR:
+            return "\033[1;31;49m";    //bold, red
+        case STYLE_DEBUG:
+            return "\033[0;33;49m";    //regular, yellow
+        case STYLE_HEXDUMP:
+            return "\033[0;32;49m";    //regular, green
+        case STYLE_NORMAL:
+        default:
+            return "\033[0;39;49m";    //reset attributes and foreground color
+    }
 }
 
-static void unlockFile(FILE *file, int savedCancelState) {
-    funlockfile(file);
-    pthread_setcancelstate(savedCancelState, NULL);
+// caller holds the stderr lock
+static void batchFlush(LogBatch *batch) {
+    if (batch->used > 0) {
+        fwrite(batch->data, 1, batch->used, stderr);
+        batch->used = 0;
+    }
+}
+
+static void batchAppend(LogBatch *batch, const char *text, size_t length) {
+    while (length > 0) {
+        if (batch->used == batch->capacity) {
+            batchFlush(batch);
+        }
+        size_t chunk = batch->capacity - batch->used;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(batch->data + batch->used, text, chunk);
+        batch->used += chunk;
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+static void batchPrintf(LogBatch *batch, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void batchPrintf(LogBatch *batch, const char *fmt, ...) {
+    char line[LOG_LINE_MAX];
+    va_list args;
+
+    va_start(args, fmt);
+    int length = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (length > 0) {
+        batchAppend(batch, line, (size_t) length < sizeof(line) ? (size_t) length : sizeof(line) - 1);
+    }
+}
+
+static void formatHexdump(LogBatch *batch, const char *prefix, size_t prefixLength, const unsigned char *array,
+                          size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    const size_t charsPerLine = 16U;
+    // "xx " per byte, three spaces, one character per byte
+    char line[16U * 3U + 3U + 16U + 1U];
+
+    for (size_t offset = 0; offset < n; offset += charsPerLine) {
+        size_t columns = n - offset < charsPerLine ? n - offset : charsPerLine;
+        size_t column;
+        char *next = line;
+
+        //program name and prefix
+        batchPrintf(batch, "%s: %.*s: ", getProgName(), (int) prefixLength, prefix);
+
+        //bytes as hex values, empty spaces filled on the last line
+        for (column = 0; column < charsPerLine; ++column) {
+            if (column < columns) {
+                *next++ = digits[array[offset + column] >> 4U];
+                *next++ = digits[array[offset + column] & 0xfU];
+            } else {
+                *next++ = ' ';
+                *next++ = ' ';
+            }
+            *next++ = ' ';
+        }
+
+        //space between hex values and ASCII characters
+        memcpy(next, "   ", 3);
+        next += 3;
+
+        //bytes as ASCII characters
+        for (column = 0; column < columns; ++column) {
+            *next++ = isgraph(array[offset + column]) ? (char) array[offset + column] : '.';
+        }
+
+        //line ending
+        *next++ = '\n';
+        batchAppend(batch, line, (size_t) (next - line));
+    }
+}
+
+static void formatRecord(LogBatch *batch, const LogRecordHeader *header, const unsigned char *payload) {
+    const char *style = styleCode((OutputStyle) header->style);
+
+    batchAppend(batch, style, strlen(style));
+    if (header->kind == LOG_RECORD_HEXDUMP) {
+        formatHexdump(batch, (const char *) payload, header->prefixLength, payload + header->prefixLength,
+                      header->length - header->prefixLength);
+    } else {
+        batchPrintf(batch, "%s: ", getProgName());
+        batchAppend(batch, (const char *) payload, header->length);
+        batchAppend(batch, "\n", 1);
+    }
+    if (*style != '\0') {
+        style = styleCode(STYLE_NORMAL);
+        batchAppend(batch, style, strlen(style));
+    }
+}
+
+// runs in the exiting thread, which must not touch the ring once the writer may recycle it
+static void releaseRing(void *arg) {
+    threadRing = NULL;
+    atomic_store_explicit(&((LogRing *) arg)->orphaned, 1, memory_order_release);
+}
+
+static void createRingKey(void) {
+    pthread_key_create(&ringKey, releaseRing);
+}
+
+static LogRing *acquireRing(void) {
+    if (threadRing != NULL) {
+        return threadRing;
+    }
+    pthread_once(&ringKeyOnce, createRingKey);
+    pthread_mutex_lock(&ringsLock);
+    LogRing *ring = freeRings;
+    if (ring != NULL) {
+        freeRings = ring->next;
+    } else if ((ring = malloc(sizeof(LogRing))) == NULL) {
+        pthread_mutex_unlock(&ringsLock);
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->orphaned, 0);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&ringsLock);
+    pthread_setspecific(ringKey, ring);
+    threadRing = ring;
+    return ring;
+}
+
+static size_t recordSize(size_t payloadLength) {
+    const size_t alignment = sizeof(LogRecordHeader);
+    return (sizeof(LogRecordHeader) + payloadLength + alignment - 1) / alignment * alignment;
+}
+
+// never blocks, a record that does not fit is counted and dropped
+static int ringPush(LogRing *ring, const LogRecordHeader *header, const void *prefix, size_t prefixLength,
+                    const void *data, size_t dataLength) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t need = recordSize(prefixLength + dataLength);
+    size_t position = head % LOG_RING_SIZE;
+    size_t contiguous = LOG_RING_SIZE - position;
+    size_t padding = need > contiguous ? contiguous : 0;
+
+    if (LOG_RING_SIZE - (head - tail) < padding + need) {
+        atomic_fetch_add_explicit(&droppedRecords, 1, memory_order_relaxed);
+        return -1;
+    }
+    if (padding > 0) {
+        LogRecordHeader pad = {.length = (uint32_t) (padding - sizeof(LogRecordHeader)),
+                               .kind = LOG_RECORD_PADDING};
+        memcpy(ring->data + position, &pad, sizeof(pad));
+        position = 0;
+    }
+    memcpy(ring->data + position, header, sizeof(LogRecordHeader));
+    memcpy(ring->data + position + sizeof(LogRecordHeader), prefix, prefixLength);
+    if (dataLength > 0) {
+        memcpy(ring->data + position + sizeof(LogRecordHeader) + prefixLength, data, dataLength);
+    }
+    atomic_store_explicit(&ring->head, head + padding + need, memory_order_release);
+    return 1;
 }
 
-static void setStyle(FILE *file, OutputStyle style) {
-    if (style_enabled && isatty(fileno(file))) {
-        switch (style) {
-            case STYLE_NORMAL:
-                fprintf(file, "\033[0;39;49m");    //reset attributes and foreground color
-                break;
-            case STYLE_INFO:
-                fprintf(file, "\033[1;39;49m");    //bold, default colors
-                break;
-            case STYLE_ERROR:
-                fprintf(file, "\033[1;31;49m");    //bold, red
-                break;
-            case STYLE_DEBUG:
-                fprintf(file, "\033[0;33;49m");    //regular, yellow
-                break;
-            case STYLE_HEXDUMP:
-                fprintf(file, "\033[0;32;49m");    //regular, green
-                break;
+// caller holds drainLock and the stderr lock, returns the number of records written
+static size_t ringDrain(LogRing *ring, LogBatch *batch) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t records = 0;
+
+    while (tail != head) {
+        LogRecordHeader header;
+        const unsigned char *record = ring->data + tail % LOG_RING_SIZE;
+        memcpy(&header, record, sizeof(header));
+        if (header.kind != LOG_RECORD_PADDING) {
+            formatRecord(batch, &header, record + sizeof(header));
+            records++;
         }
+        tail += recordSize(header.length);
     }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return records;
+}
+
+// writes everything that is queued in one batch, returns the number of records written
+static size_t drainRings(void) {
+    LogBatch batch = {.data = writerBuffer, .capacity = sizeof(writerBuffer), .used = 0};
+    size_t records = 0;
+    LogRing **link;
+
+    pthread_mutex_lock(&drainLock);
+    flockfile(stderr);
+    pthread_mutex_lock(&ringsLock);
+    for (link = &rings; *link != NULL;) {
+        LogRing *ring = *link;
+        // read before draining, so nothing the thread wrote before exiting is missed
+        int orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        records += ringDrain(ring, &batch);
+        if (orphaned) {
+            *link = ring->next;
+            ring->next = freeRings;
+            freeRings = ring;
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+    size_t dropped = atomic_load_explicit(&droppedRecords, memory_order_relaxed);
+    if (dropped != reportedDrops) {
+        const char *style = styleCode(STYLE_ERROR);
+        batchAppend(&batch, style, strlen(style));
+        batchPrintf(&batch, "%s: %zu log records dropped, ring full", getProgName(), dropped - reportedDrops);
+        batchAppend(&batch, "\n", 1);
+        if (*style != '\0') {
+            style = styleCode(STYLE_NORMAL);
+            batchAppend(&batch, style, strlen(style));
+        }
+        reportedDrops = dropped;
+    }
+    batchFlush(&batch);
+    funlockfile(stderr);
+    pthread_mutex_unlock(&drainLock);
+    return records;
+}
+
+static void *logWriter(void *arg) {
+    (void) arg;
+    struct timespec deadline;
+
+    for (;;) {
+        if (drainRings() > 0) {
+            continue;
+        }
+        // producers post only while this is set, an update they miss is picked up on the timeout
+        atomic_store(&writerSleeping, 1);
+        if (drainRings() > 0) {
+            atomic_store(&writerSleeping, 0);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_IDLE_WAIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&writerWakeup, &deadline);
+        atomic_store(&writerSleeping, 0);
+    }
+    return NULL;
+}
+
+int logAsyncStart(void) {
+    if (atomic_load(&writerRunning)) {
+        return 1;
+    }
+    if (sem_init(&writerWakeup, 0, 0) == -1) {
+        return -1;
+    }
+    if (pthread_create(&writerThread, NULL, logWriter, NULL) != 0) {
+        sem_destroy(&writerWakeup);
+        return -1;
+    }
+    pthread_detach(writerThread);
+    atomic_store(&writerRunning, 1);
+    atexit(logFlush);
+    return 1;
+}
+
+void logFlush(void) {
+    if (atomic_load(&writerRunning)) {
+        drainRings();
+    }
+}
+
+size_t logDroppedRecords(void) {
+    return atomic_load_explicit(&droppedRecords, memory_order_relaxed);
+}
+
+static void logRecord(OutputStyle style, int kind, const char *prefix, size_t prefixLength, const void *data,
+                      size_t dataLength) {
+    LogRecordHeader header = {.length = (uint32_t) (prefixLength + dataLength), .kind = (uint8_t) kind,
+                              .style = (uint8_t) style, .prefixLength = (uint16_t) prefixLength};
+    int savedCancelState;
+    LogRing *ring;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &savedCancelState);
+    if (atomic_load_explicit(&writerRunning, memory_order_acquire) && (ring = acquireRing()) != NULL) {
+        if (ringPush(ring, &header, prefix, prefixLength, data, dataLength) == 1 &&
+            atomic_load_explicit(&writerSleeping, memory_order_relaxed) &&
+            atomic_exchange(&writerSleeping, 0)) {
+            sem_post(&writerWakeup);
+        }
+    } else {
+        char buffer[4096];
+        LogBatch batch = {.data = buffer, .capacity = sizeof(buffer), .used = 0};
+        unsigned char payload[LOG_LINE_MAX + LOG_HEXDUMP_MAX];
+        memcpy(payload, prefix, prefixLength);
+        if (dataLength > 0) {
+            memcpy(payload + prefixLength, data, dataLength);
+        }
+        flockfile(stderr);
+        formatRecord(&batch, &header, payload);
+        batchFlush(&batch);
+        funlockfile(stderr);
+    }
+    pthread_setcancelstate(savedCancelState, NULL);
+}
+
+static void vlogPrint(OutputStyle style, const char *fmt, va_list args) {
+    char line[LOG_LINE_MAX];
+    int length = vsnprintf(line, sizeof(line), fmt, args);
+
+    if (length < 0) {
+        return;
+    }
+    if ((size_t) length >= sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    logRecord(style, LOG_RECORD_TEXT, line, (size_t) length, NULL, 0);
 }
 
 void setProgName(const char *argv0) {
@@ -66,16 +432,35 @@ const char *getProgName(void) {
     return prog_name;
 }
 
+void logLevelSet(int level) {
+    logLevelCurrent = level;
+}
+
+int logLevelFromName(const char *name) {
+    if (strcmp(name, "debug") == 0) {
+        return LOG_LEVEL_DEBUG;
+    }
+    if (strcmp(name, "info") == 0) {
+        return LOG_LEVEL_INFO;
+    }
+    if (strcmp(name, "error") == 0) {
+        return LOG_LEVEL_ERROR;
+    }
+    return -1;
+}
+
 void debugEnable(void) {
-    debug_enabled = 1;
+    logLevelCurrent = LOG_LEVEL_DEBUG;
 }
 
 int debugEnabled(void) {
-    return debug_enabled;
+    return LOG_LEVEL_MIN <= LOG_LEVEL_DEBUG && logLevelCurrent <= LOG_LEVEL_DEBUG;
 }
 
 void debugDisable(void) {
-    debug_enabled = 0;
+    if (logLevelCurrent < LOG_LEVEL_INFO) {
+        logLevelCurrent = LOG_LEVEL_INFO;
+    }
 }
 
 void styleEnable(void) {
@@ -92,86 +477,68 @@ void styleDisable(void) {
 
 void normalPrint(const char *fmt, ...) {
     va_list args;
-    int savedCancelState;
 
     va_start(args, fmt);
-    savedCancelState = lockFile(stderr);
-    fprintf(stderr, "%s: ", getProgName());
-    vfprintf(stderr, fmt, args);
-    putc_unlocked('\n', stderr);
-    unlockFile(stderr, savedCancelState);
+    vlogPrint(STYLE_NORMAL, fmt, args);
     va_end(args);
 }
 
-void debugPrint(const char *fmt, ...) {
+// names in parentheses, the macros of util.h wrap the call sites
+void (debugPrint)(const char *fmt, ...) {
     va_list args;
-    int savedCancelState;
 
-    if (debug_enabled) {
+    if (logLevelCurrent <= LOG_LEVEL_DEBUG) {
         va_start(args, fmt);
-        savedCancelState = lockFile(stderr);
-        setStyle(stderr, STYLE_DEBUG);
-        fprintf(stderr, "%s: ", getProgName());
-        vfprintf(stderr, fmt, args);
-        putc_unlocked('\n', stderr);
-        setStyle(stderr, STYLE_NORMAL);
-        unlockFile(stderr, savedCancelState);
+        vlogPrint(STYLE_DEBUG, fmt, args);
         va_end(args);
     }
 }
 
-void infoPrint(const char *fmt, ...) {
+void (infoPrint)(const char *fmt, ...) {
     va_list args;
-    int savedCancelState;
 
-    va_start(args, fmt);
-    savedCancelState = lockFile(stderr);
-    setStyle(stderr, STYLE_INFO);
-    fprintf(stderr, "%s: ", getProgName());
-    vfprintf(stderr, fmt, args);
-    putc_unlocked('\n', stderr);
-    setStyle(stderr, STYLE_NORMAL);
-    unlockFile(stderr, savedCancelState);
-    va_end(args);
+    if (logLevelCurrent <= LOG_LEVEL_INFO) {
+        va_start(args, fmt);
+        vlogPrint(STYLE_INFO, fmt, args);
+        va_end(args);
+    }
 }
 
 void errorPrint(const char *fmt, ...) {
     va_list args;
-    int savedCancelState;
 
     va_start(args, fmt);
-    savedCancelState = lockFile(stderr);
-    setStyle(stderr, STYLE_ERROR);
-    fprintf(stderr, "%s: ", getProgName());
-    vfprintf(stderr, fmt, args);
-    putc_unlocked('\n', stderr);
-    setStyle(stderr, STYLE_NORMAL);
-    unlockFile(stderr, savedCancelState);
+    vlogPrint(STYLE_ERROR, fmt, args);
     va_end(args);
 }
 
 void errnoPrint(const char *prefixFmt, ...) {
     va_list args;
-    int savedCancelState;
     int savedErrno = errno;
+    char line[LOG_LINE_MAX];
+    char message[256];
 
     va_start(args, prefixFmt);
-    savedCancelState = lockFile(stderr);
-    setStyle(stderr, STYLE_ERROR);
-    fprintf(stderr, "%s: ", getProgName());
-    vfprintf(stderr, prefixFmt, args);
-    fputs(": ", stderr);
-    errno = savedErrno;
-    perror(NULL);
-    setStyle(stderr, STYLE_NORMAL);
-    unlockFile(stderr, savedCancelState);
+    int length = vsnprintf(line, sizeof(line), prefixFmt, args);
     va_end(args);
+    if (length < 0) {
+        length = 0;
+    } else if ((size_t) length >= sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    length += snprintf(line + length, sizeof(line) - (size_t) length, ": %s",
+                       strerror_r(savedErrno, message, sizeof(message)));
+    if ((size_t) length >= sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    logRecord(STYLE_ERROR, LOG_RECORD_TEXT, line, (size_t) length, NULL, 0);
+    errno = savedErrno;
 }
 
-void debugHexdump(const void *ptr, size_t n, const char *fmt, ...) {
+void (debugHexdump)(const void *ptr, size_t n, const char *fmt, ...) {
     va_list args;
 
-    if (debug_enabled) {
+    if (logLevelCurrent <= LOG_LEVEL_DEBUG) {
         va_start(args, fmt);
         vhexdump(ptr, n, fmt, args);
         va_end(args);
@@ -186,82 +553,23 @@ void hexdump(const void *ptr, size_t n, const char *fmt, ...) {
     va_end(args);
 }
 
+// only the prefix is formatted by the caller, the hex lines are produced by the writer
 void vhexdump(const void *ptr, size_t n, const char *fmt, va_list args) {
-    const size_t charsPerLine = 16U;
-    const size_t fullLines = n / charsPerLine;
-    const size_t incompleteLine = n % charsPerLine;
-    const unsigned char *array = (const unsigned char *) ptr;
-    char byte;
-    size_t line;
-    size_t column;
-    va_list a;
-    int savedCancelState;
+    char prefix[LOG_LINE_MAX];
+    int length = vsnprintf(prefix, sizeof(prefix), fmt, args);
 
-    savedCancelState = lockFile(stderr);
-    setStyle(stderr, STYLE_HEXDUMP);
-
-    //print every complete line
-    for (line = 0; line < fullLines; ++line) {
-        //program name
-        fprintf(stderr, "%s: ", getProgName());
-
-        //prefix
-        va_copy(a, args);
-        vfprintf(stderr, fmt, a);
-        va_end(a);
-        fprintf(stderr, ": ");
-
-        //bytes as hex values
-        for (column = 0; column < charsPerLine; ++column)
-            fprintf(stderr, "%02x ", (unsigned) array[line * charsPerLine + column]);
-
-        //space between hex values and ASCII characters
-        fprintf(stderr, "%3s", "");
-
-        //bytes as ASCII characters
-        for (column = 0; column < charsPerLine; ++column) {
-            byte = array[line * charsPerLine + column];
-            fprintf(stderr, "%c", isgraph(byte) ? byte : '.');
-        }
-
-        //line ending
-        fputc('\n', stderr);
+    if (length < 0) {
+        return;
     }
-
-    //print last, incomplete line
-    if (incompleteLine) {
-        //program name
-        fprintf(stderr, "%s: ", getProgName());
-
-        //prefix
-        va_copy(a, args);
-        vfprintf(stderr, fmt, a);
-        va_end(a);
-        fprintf(stderr, ": ");
-
-        //bytes as hex values
-        for (column = 0; column < incompleteLine; ++column)
-            fprintf(stderr, "%02x ", (unsigned) array[line * charsPerLine + column]);
-
-        //fill empty hex value spaces
-        while (column++ < charsPerLine)
-            fprintf(stderr, "   ");
-
-        //space between hex values and ASCII characters
-        fprintf(stderr, "%3s", "");
-
-        //bytes as ASCII characters
-        for (column = 0; column < incompleteLine; ++column) {
-            byte = array[line * charsPerLine + column];
-            fprintf(stderr, "%c", isgraph(byte) ? byte : '.');
-        }
-
-        //line ending
-        fputc('\n', stderr);
+    if ((size_t) length >= sizeof(prefix)) {
+        length = sizeof(prefix) - 1;
+    }
+    // every line repeats the prefix, so a long dump is just several records of whole lines
+    for (size_t offset = 0; offset < n; offset += LOG_HEXDUMP_MAX) {
+        size_t chunk = n - offset < LOG_HEXDUMP_MAX ? n - offset : LOG_HEXDUMP_MAX;
+        logRecord(STYLE_HEXDUMP, LOG_RECORD_HEXDUMP, prefix, (size_t) length, (const unsigned char *) ptr + offset,
+                  chunk);
     }
-
-    setStyle(stderr, STYLE_NORMAL);
-    unlockFile(stderr, savedCancelState);
 }
 
 size_t nameBytesValidate(const char *input, size_t n) {
@@ -12,12 +12,40 @@
 #  define  __attribute__(x)  /* empty */
 #endif
 
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_ERROR 2
+
+// lowest level that is compiled in, e.g. -DLOG_LEVEL_MIN=LOG_LEVEL_INFO removes every debugPrint()
+// and debugHexdump() call site together with the evaluation of its arguments
+#ifndef LOG_LEVEL_MIN
+#  define LOG_LEVEL_MIN LOG_LEVEL_DEBUG
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// runtime level, messages below it are skipped before their arguments are evaluated
+extern int logLevelCurrent;
+
+void logLevelSet(int level);
+
+// "debug", "info" or "error", -1 for anything else
+int logLevelFromName(const char *name);
+
 void setProgName(const char *argv0);
 
+// from here on every thread logs into its own lock-free ring and a background thread formats
+// and writes the records in batches, before that (and if it fails) output is synchronous
+int logAsyncStart(void);
+
+// writes everything queued so far, also registered with atexit()
+void logFlush(void);
+
+// records lost because a thread's ring was full
+size_t logDroppedRecords(void);
+
 const char *getProgName(void);
 
 void debugEnable(void);
@@ -44,6 +72,7 @@ void errnoPrint(const char *prefixFmt, ...) __attribute__((format(printf, 1, 2))
 
 void debugHexdump(const void *ptr, size_t n, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
+// the whole of ptr is dumped; beyond 2048 bytes lines of other threads may come in between
 void hexdump(const void *ptr, size_t n, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
 void vhexdump(const void *ptr, size_t n, const char *fmt, va_list args);
@@ -58,6 +87,23 @@ uint64_t hton64u(uint64_t host64u);
 }
 #endif
 
+// a disabled call site still type checks its format, but is dead code
+#define LOG_DISABLED(call) ((void) (0 && ((call), 0)))
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_DEBUG
+#  define debugPrint(...) (logLevelCurrent <= LOG_LEVEL_DEBUG ? debugPrint(__VA_ARGS__) : (void) 0)
+#  define debugHexdump(...) (logLevelCurrent <= LOG_LEVEL_DEBUG ? debugHexdump(__VA_ARGS__) : (void) 0)
+#else
+#  define debugPrint(...) LOG_DISABLED(debugPrint(__VA_ARGS__))
+#  define debugHexdump(...) LOG_DISABLED(debugHexdump(__VA_ARGS__))
+#endif
+
+#if LOG_LEVEL_MIN <= LOG_LEVEL_INFO
+#  define infoPrint(...) (logLevelCurrent <= LOG_LEVEL_INFO ? infoPrint(__VA_ARGS__) : (void) 0)
+#else
+#  define infoPrint(...) LOG_DISABLED(infoPrint(__VA_ARGS__))
+#endif
+
 /* If we have defined __attribute__ before, undefine it again. The reasoning
  * behind this is, that after including this header, a module can use
  * constructs that depend on __attribute__ not only to show compiler warnings